@@ -0,0 +1,79 @@
+#ifndef CSSOPTIM_ARENA_H
+#define CSSOPTIM_ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block arena_block_t;
+
+/**
+ * @brief Bump allocator. Memory is handed out from large blocks and released
+ * all at once; individual allocations are never freed.
+ */
+typedef struct {
+  arena_block_t *head;
+  size_t block_size;
+  size_t reserved;
+  size_t peak; // highest value `reserved` reached
+} arena_t;
+
+/**
+ * @brief Saved allocation position, see arena_mark().
+ */
+typedef struct {
+  arena_block_t *head;
+  arena_block_t *next;
+  size_t used;
+} arena_mark_t;
+
+/**
+ * @brief Initializes an arena.
+ * @param arena The arena.
+ * @param block_size Minimum size of each backing block (0 for the default).
+ */
+void arena_init(arena_t *arena, size_t block_size);
+
+/**
+ * @brief Allocates memory from the arena, aligned for any type.
+ * @param arena The arena.
+ * @param size Number of bytes.
+ * @return Pointer to the memory, or NULL on failure.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * @brief Copies a span into the arena and NUL-terminates it.
+ * @param arena The arena.
+ * @param str Start of the span (need not be NUL-terminated).
+ * @param len Length of the span.
+ * @return Pointer to the copy, or NULL on failure.
+ */
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+/**
+ * @brief Records the current allocation position.
+ * @param arena The arena.
+ * @return A mark for arena_rewind().
+ */
+arena_mark_t arena_mark(const arena_t *arena);
+
+/**
+ * @brief Releases everything allocated since a mark, for scratch memory that
+ * is only needed for a short while. Marks taken later become invalid.
+ * @param arena The arena.
+ * @param mark A mark taken on this arena.
+ */
+void arena_rewind(arena_t *arena, arena_mark_t mark);
+
+/**
+ * @brief Empties the arena but keeps its most recent block for reuse.
+ * @param arena The arena.
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * @brief Frees every block owned by the arena. The arena can be reused.
+ * @param arena The arena.
+ */
+void arena_release(arena_t *arena);
+
+#endif // CSSOPTIM_ARENA_H
@@ -7,4 +7,24 @@
 char *read_file(const char *filename, size_t *length);
 bool write_file(const char *filename, const char *content);
 
+// Opens a temporary file beside filename to write its new contents into, so
+// a failed run leaves the old file as it was and a file being read is never
+// truncated under its reader. Returns the descriptor, with the temporary path
+// in *temp_path, or -1.
+int open_output(const char *filename, char **temp_path);
+// Closes fd and renames the temporary file over filename if ok, or removes
+// it. Frees temp_path. Returns whether filename now holds the new contents.
+bool finish_output(int fd, char *temp_path, const char *filename, bool ok);
+
+// Maps a file read-only so its pages can be dropped and re-read under memory
+// pressure instead of living on the heap. An empty file gives empty text
+// that is not mapped; unmap_file() accepts it all the same.
+const char *map_file(const char *filename, size_t *length);
+void unmap_file(const char *data, size_t length);
+
+// Output sinks (css_write_cb_t): `user` is a FILE *, or points to an int file
+// descriptor, which gets every byte however many writes it takes.
+bool write_to_stream(const char *data, size_t len, void *user);
+bool write_to_fd(const char *data, size_t len, void *user);
+
 #endif // CSSOPTIM_IO_H
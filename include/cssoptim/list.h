@@ -9,6 +9,8 @@
  */
 typedef struct string_list string_list_t;
 
+#define STRING_LIST_NPOS ((size_t)-1)
+
 /**
  * @brief Creates a new string list.
  * @return Pointer to a new string list, or NULL on failure.
@@ -29,6 +31,15 @@ void string_list_destroy(string_list_t *list);
  */
 bool string_list_add(string_list_t *list, const char *str);
 
+/**
+ * @brief Adds a span to the list if it doesn't already exist.
+ * @param list The list to add to.
+ * @param str Start of the span (need not be NUL-terminated).
+ * @param len Length of the span.
+ * @return true if added, false if it already exists or on failure.
+ */
+bool string_list_add_n(string_list_t *list, const char *str, size_t len);
+
 /**
  * @brief Checks if a string is in the list.
  * @param list The list to check.
@@ -37,6 +48,16 @@ bool string_list_add(string_list_t *list, const char *str);
  */
 bool string_list_contains(const string_list_t *list, const char *str);
 
+/**
+ * @brief Finds the position of a span in the list.
+ * @param list The list to check.
+ * @param str Start of the span (need not be NUL-terminated).
+ * @param len Length of the span.
+ * @return Insertion index of the item, or STRING_LIST_NPOS if absent.
+ */
+size_t string_list_index_n(const string_list_t *list, const char *str,
+                           size_t len);
+
 /**
  * @brief Gets the number of items in the list.
  * @param list The list.
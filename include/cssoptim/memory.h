@@ -0,0 +1,91 @@
+#ifndef CSSOPTIM_MEMORY_H
+#define CSSOPTIM_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Phases that lexbor allocations are attributed to.
+ */
+typedef enum {
+  CSS_MEM_PHASE_OTHER,
+  CSS_MEM_PHASE_CSS_PARSE,  // stylesheet parsing
+  CSS_MEM_PHASE_HTML_PARSE, // HTML documents scanned for usage
+  CSS_MEM_PHASE_NESTED,     // at-rule blocks parsed by the walk
+  CSS_MEM_PHASE_COUNT
+} css_mem_phase_t;
+
+/**
+ * @brief Memory figures of a job, in bytes requested by lexbor.
+ */
+typedef struct {
+  size_t live[CSS_MEM_PHASE_COUNT];  // currently allocated
+  size_t peak[CSS_MEM_PHASE_COUNT];  // highest live value
+  size_t total[CSS_MEM_PHASE_COUNT]; // ever allocated
+  size_t peak_live;                  // highest live sum over all phases
+  size_t region_reserved;            // held by the job's region, if any
+} css_mem_stats_t;
+
+/**
+ * @brief Opaque handle for a memory job: an accounting scope for lexbor
+ * allocations, optionally backed by one region that is dropped as a whole.
+ * A job is entered per thread, and may be current on several threads at
+ * once; allocations made while it is current are counted against it and, in
+ * region mode, served from its region.
+ */
+typedef struct css_mem_job css_mem_job_t;
+
+/**
+ * @brief Routes lexbor's allocator through cssoptim. Must be called before
+ * any lexbor object is created; later calls do nothing.
+ * @return true on success, false if lexbor rejected the allocator.
+ */
+bool css_memory_install(void);
+
+/**
+ * @brief Creates a memory job.
+ * @param region true to serve allocations from a region. Frees inside the
+ * region are no-ops; everything is released by css_mem_job_destroy().
+ * @param limit Maximum live bytes (0 for no limit). Allocations beyond it
+ * fail, which lexbor reports as an error.
+ * @return Pointer to a new job, or NULL on failure.
+ */
+css_mem_job_t *css_mem_job_create(bool region, size_t limit);
+
+/**
+ * @brief Destroys a job and drops its region. Lexbor objects allocated
+ * under the job must not be used or destroyed afterwards, since frees are
+ * counted against the job a block was allocated in.
+ * @param job The job to destroy (must not be current on any thread).
+ */
+void css_mem_job_destroy(css_mem_job_t *job);
+
+/**
+ * @brief Makes a job current on the calling thread.
+ * @param job The job, or NULL for plain unaccounted allocation.
+ * @return The previously current job, to restore later.
+ */
+css_mem_job_t *css_mem_job_enter(css_mem_job_t *job);
+
+/**
+ * @brief Returns the job current on the calling thread, e.g. to enter it on
+ * worker threads.
+ * @return The current job, or NULL.
+ */
+css_mem_job_t *css_mem_job_current(void);
+
+/**
+ * @brief Sets the phase new allocations on the calling thread belong to.
+ * @param phase The phase.
+ * @return The previous phase, to restore later.
+ */
+css_mem_phase_t css_mem_phase_enter(css_mem_phase_t phase);
+
+/**
+ * @brief Reads the figures of a job.
+ * @param job The job.
+ * @param stats Receives the figures.
+ */
+void css_mem_job_stats(const css_mem_job_t *job, css_mem_stats_t *stats);
+
+#endif // CSSOPTIM_MEMORY_H
@@ -1,6 +1,7 @@
 #ifndef CSSOPTIM_OPTIMIZER_H
 #define CSSOPTIM_OPTIMIZER_H
 
+#include "usage.h"
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -10,6 +11,11 @@ typedef enum {
   LXB_CSS_OPTIM_MODE_CONSERVATIVE
 } css_optim_mode_t;
 
+// Figures about one css_optimize() / css_optimize_ctx() call
+typedef struct {
+  size_t scratch_peak; // bytes reserved by the per-run scratch arena at peak
+} css_optimize_stats_t;
+
 typedef struct {
   const char **used_classes;
   size_t class_count;
@@ -18,15 +24,115 @@ typedef struct {
   const char **used_attrs;
   size_t attr_count;
 
+  // Usage set filled by scan_html_usage/scan_js_usage. When set, the arrays
+  // above are ignored; otherwise they are indexed into a temporary set.
+  const css_usage_t *usage;
+
   bool remove_unused_keyframes;
   bool remove_form_pseudoelements;
   bool remove_vendor_prefixes;
 
+  // Parse the declarations of a style rule only if some selector of it is
+  // used. Rules are dropped from the text before the full parse instead of
+  // after it; the output is the same.
+  bool lazy_parse;
+
+  // Drop style rules whose selectors are all unused before parsing, when
+  // they are simple enough (classes, tags, IDs, plain pseudo-classes) to be
+  // decided from the raw text without lexbor. The output is the same.
+  bool prefilter_rules;
+
   css_optim_mode_t mode;
+
+  // Threads serializing the output of css_optimize_ctx(),
+  // css_optimize_to_sink() and css_optimize_stream(), each a run of
+  // top-level rules; 0 or 1 serializes on the calling thread. Output too
+  // small to share out is serialized on one thread. The output is the same.
+  // The threads allocate under the caller's memory job.
+  unsigned serialize_threads;
+
+  // Filled in by css_optimize when set
+  css_optimize_stats_t *stats;
 } OptimizerConfig;
 
+// Parser, lexbor memory pool and scratch memory reused across
+// css_optimize_ctx() and css_validate_ctx() calls. A context holds no shared
+// state, so threads can each optimize with their own. Under a region memory
+// job it must be destroyed before the job.
+typedef struct css_optimizer_ctx css_optimizer_ctx_t;
+
+css_optimizer_ctx_t *css_optimizer_ctx_create(void);
+void css_optimizer_ctx_destroy(css_optimizer_ctx_t *ctx);
+
 bool css_validate(const char *css_content, size_t length);
+bool css_validate_ctx(css_optimizer_ctx_t *ctx, const char *css_content,
+                      size_t length);
+char *css_optimize_ctx(css_optimizer_ctx_t *ctx, const char *css_content,
+                       size_t length, OptimizerConfig *config);
+// One-shot css_optimize_ctx() with a temporary context
 char *css_optimize(const char *css_content, size_t length,
                    OptimizerConfig *config);
 
+// Optimizes a stylesheet on up to `threads` threads (at most 64). It is cut
+// at top-level rule boundaries into one chunk per thread. Chunks are parsed
+// and filtered in parallel, the custom properties and keyframes they
+// reference are merged, and they are then pruned and serialized in parallel
+// and joined in order. The output is byte-identical to css_optimize().
+// Worker threads allocate under the caller's memory job.
+char *css_optimize_parallel(const char *css_content, size_t length,
+                            OptimizerConfig *config, unsigned threads);
+
+// Supplies input piece by piece: stores up to `size` bytes at `data` and
+// their count in `*len`, 0 once the input has ended. Returns false on error.
+typedef bool (*css_read_cb_t)(char *data, size_t size, size_t *len,
+                              void *user);
+
+// Optimizes a stylesheet that arrives piece by piece, e.g. from a pipe.
+// Complete top-level rules are parsed and filtered while the rest is still
+// being read. The output is the same as css_optimize_ctx() on the whole
+// input (empty for empty input), or NULL if reading fails.
+char *css_optimize_stream(css_optimizer_ctx_t *ctx, css_read_cb_t read,
+                          void *user, OptimizerConfig *config);
+
+// Receives optimized CSS piece by piece; returns false to stop. See io.h for
+// sinks writing to a FILE * or a file descriptor.
+typedef bool (*css_write_cb_t)(const char *data, size_t len, void *user);
+
+// css_optimize_ctx() writing its output to `write` instead of returning it.
+// Rules are passed on through a fixed-size buffer as they are serialized, so
+// the whole output is never held at once and writing starts early. Returns
+// false if the stylesheet does not parse or a write fails; output already
+// written stays written.
+bool css_optimize_to_sink(css_optimizer_ctx_t *ctx, const char *css_content,
+                          size_t length, OptimizerConfig *config,
+                          css_write_cb_t write, void *user);
+
+// Optimizes a stylesheet too large to hold as one parse tree. It is split at
+// top-level rule boundaries into windows sized so each one's parse tree and
+// output stay near max_memory bytes, and read twice: once to collect the
+// custom properties and keyframes in use, once to prune and write each
+// window. Only those names are kept between windows, and the rules written
+// are the ones css_optimize() would keep.
+bool css_optimize_windowed(css_optimizer_ctx_t *ctx, const char *css_content,
+                           size_t length, size_t max_memory,
+                           OptimizerConfig *config, css_write_cb_t write,
+                           void *user);
+
+// Splice mode: the rules css_optimize() would keep, copied from the input
+// wherever they are unchanged, with the whitespace and comments before them,
+// instead of re-serialized. A style rule that only lost selectors gets a new
+// selector list in front of its original block; other edited rules, e.g. an
+// at-rule with rules removed inside, are re-serialized. A stylesheet nothing
+// is removed from comes out byte for byte.
+bool css_optimize_splice(css_optimizer_ctx_t *ctx, const char *css_content,
+                         size_t length, OptimizerConfig *config,
+                         css_write_cb_t write, void *user);
+
+// css_optimize_splice() writing to out_fd with writev(). With in_fd >= 0, a
+// file holding css_content from offset 0, the copied ranges are moved with
+// copy_file_range() where the system supports it for the two descriptors.
+bool css_optimize_splice_fd(css_optimizer_ctx_t *ctx, const char *css_content,
+                            size_t length, OptimizerConfig *config, int in_fd,
+                            int out_fd);
+
 #endif // CSSOPTIM_OPTIMIZER_H
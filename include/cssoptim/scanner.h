@@ -2,10 +2,28 @@
 #define CSSOPTIM_SCANNER_H
 
 #include "list.h"
+#include "usage.h"
 #include <stddef.h>
 
 void scan_html(const char *content, size_t length, string_list_t *classes,
                string_list_t *tags, string_list_t *attrs);
 void scan_js(const char *content, size_t length, string_list_t *classes);
 
+/* Variants that record classes, tags and attributes into one shared usage
+ * set, ready to be handed to the optimizer via OptimizerConfig.usage.
+ */
+void scan_html_usage(const char *content, size_t length, css_usage_t *usage);
+void scan_js_usage(const char *content, size_t length, css_usage_t *usage);
+
+/* HTML parser and document memory reused across scan_html_usage_ctx() calls,
+ * for scanning many pages. One scanner per thread; under a region memory job
+ * it must be destroyed before the job.
+ */
+typedef struct css_scanner css_scanner_t;
+
+css_scanner_t *css_scanner_create(void);
+void css_scanner_destroy(css_scanner_t *scanner);
+void scan_html_usage_ctx(css_scanner_t *scanner, const char *content,
+                         size_t length, css_usage_t *usage);
+
 #endif // CSSOPTIM_SCANNER_H
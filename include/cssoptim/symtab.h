@@ -0,0 +1,65 @@
+#ifndef CSSOPTIM_SYMTAB_H
+#define CSSOPTIM_SYMTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Dense integer ID assigned to an interned string.
+ */
+typedef uint32_t symbol_id_t;
+
+#define SYMBOL_NONE ((symbol_id_t)UINT32_MAX)
+
+/**
+ * @brief Opaque handle for a symbol table. IDs are assigned in insertion
+ * order starting at 0, so they can index plain arrays and bitsets.
+ */
+typedef struct symtab symtab_t;
+
+/**
+ * @brief Creates a new symbol table.
+ * @return Pointer to a new symbol table, or NULL on failure.
+ */
+symtab_t *symtab_create(void);
+
+/**
+ * @brief Destroys a symbol table and frees all its memory.
+ * @param table The table to destroy.
+ */
+void symtab_destroy(symtab_t *table);
+
+/**
+ * @brief Interns a span, assigning it a new ID if it was not seen before.
+ * @param table The table.
+ * @param str Start of the span (need not be NUL-terminated).
+ * @param len Length of the span.
+ * @return The symbol ID, or SYMBOL_NONE on failure.
+ */
+symbol_id_t symtab_intern(symtab_t *table, const char *str, size_t len);
+
+/**
+ * @brief Looks up a span without interning it.
+ * @param table The table.
+ * @param str Start of the span.
+ * @param len Length of the span.
+ * @return The symbol ID, or SYMBOL_NONE if the span was never interned.
+ */
+symbol_id_t symtab_lookup(const symtab_t *table, const char *str, size_t len);
+
+/**
+ * @brief Gets the number of interned symbols.
+ * @param table The table.
+ * @return Number of symbols (one past the largest ID).
+ */
+size_t symtab_count(const symtab_t *table);
+
+/**
+ * @brief Gets the NUL-terminated text of a symbol.
+ * @param table The table.
+ * @param id The symbol ID.
+ * @return The text, or NULL if the ID is out of range.
+ */
+const char *symtab_name(const symtab_t *table, symbol_id_t id);
+
+#endif // CSSOPTIM_SYMTAB_H
@@ -0,0 +1,192 @@
+#ifndef CSSOPTIM_USAGE_H
+#define CSSOPTIM_USAGE_H
+
+#include "symtab.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Kinds of names collected from HTML/JS sources.
+ */
+typedef enum {
+  CSS_USAGE_CLASS,
+  CSS_USAGE_TAG,
+  CSS_USAGE_ATTR,
+  CSS_USAGE_KIND_COUNT
+} css_usage_kind_t;
+
+/**
+ * @brief Attribute selector operators, mirroring lxb_css_selector_match_t.
+ */
+typedef enum {
+  CSS_ATTR_EXISTS,   // [name]
+  CSS_ATTR_EQUAL,    // [name=value]
+  CSS_ATTR_INCLUDE,  // [name~=value]
+  CSS_ATTR_DASH,     // [name|=value]
+  CSS_ATTR_PREFIX,   // [name^=value]
+  CSS_ATTR_SUFFIX,   // [name$=value]
+  CSS_ATTR_SUBSTRING // [name*=value]
+} css_attr_match_t;
+
+/**
+ * @brief Counters kept by the optional Bloom prefilter. They are updated
+ * atomically, so they stay exact when one usage set is shared by optimizer
+ * contexts on several threads.
+ */
+typedef struct {
+  uint64_t lookups;         // name lookups that consulted the filter
+  uint64_t rejected;        // misses answered by the filter alone
+  uint64_t false_positives; // passed the filter but absent from the tables
+  size_t bytes;             // current size of the filter
+} css_usage_prefilter_stats_t;
+
+/**
+ * @brief Opaque handle for a usage set: one symbol table shared by all kinds
+ * plus one bitset per kind, so a usage check is a hash probe and a bit test.
+ * Attribute names are stored like other names; their values go to a
+ * per-name index that answers every attribute selector operator. Tags are
+ * case-insensitive; standard HTML tags are additionally kept as a bitset of
+ * lexbor tag IDs (lxb_tag_id_t), custom elements only by name.
+ */
+typedef struct css_usage css_usage_t;
+
+/**
+ * @brief Creates an empty usage set.
+ * @return Pointer to a new usage set, or NULL on failure.
+ */
+css_usage_t *css_usage_create(void);
+
+/**
+ * @brief Destroys a usage set and frees all its memory.
+ * @param usage The usage set to destroy.
+ */
+void css_usage_destroy(css_usage_t *usage);
+
+/**
+ * @brief Records a name as used.
+ * @param usage The usage set.
+ * @param kind What the name refers to.
+ * @param str Start of the name (need not be NUL-terminated).
+ * @param len Length of the name.
+ * @return true if newly recorded, false if already present or on failure.
+ */
+bool css_usage_add(css_usage_t *usage, css_usage_kind_t kind, const char *str,
+                   size_t len);
+
+/**
+ * @brief Checks whether a name was recorded as used.
+ * @param usage The usage set.
+ * @param kind What the name refers to.
+ * @param str Start of the name.
+ * @param len Length of the name.
+ * @return true if used, false otherwise.
+ */
+bool css_usage_has(const css_usage_t *usage, css_usage_kind_t kind,
+                   const char *str, size_t len);
+
+/**
+ * @brief Records an attribute, and optionally its value, as used. Passing
+ * CSS_USAGE_ATTR with a "name=value" string to css_usage_add() is equivalent.
+ * @param usage The usage set.
+ * @param name The attribute name (case-insensitive).
+ * @param name_len Length of the name.
+ * @param value The attribute value, or NULL to record the name only.
+ * @param value_len Length of the value.
+ * @return true on success, false on failure.
+ */
+bool css_usage_add_attr(css_usage_t *usage, const char *name, size_t name_len,
+                        const char *value, size_t value_len);
+
+/**
+ * @brief Evaluates an attribute selector against the recorded attributes.
+ * @param usage The usage set.
+ * @param name The attribute name (case-insensitive).
+ * @param name_len Length of the name.
+ * @param op The selector operator.
+ * @param value The selector value (ignored for CSS_ATTR_EXISTS).
+ * @param value_len Length of the value.
+ * @param ignore_case true for the `i` modifier.
+ * @return true if some recorded element could match, false otherwise.
+ */
+bool css_usage_match_attr(const css_usage_t *usage, const char *name,
+                          size_t name_len, css_attr_match_t op,
+                          const char *value, size_t value_len,
+                          bool ignore_case);
+
+/**
+ * @brief Records a tag as used by its lexbor tag ID.
+ * @param usage The usage set.
+ * @param tag_id The element's lxb_tag_id_t. IDs outside the static lexbor
+ * table (custom elements) are recorded by name only.
+ * @param name The element's local name.
+ * @param len Length of the name.
+ * @return true if newly recorded, false if already present or on failure.
+ */
+bool css_usage_add_tag_id(css_usage_t *usage, uintptr_t tag_id,
+                          const char *name, size_t len);
+
+/**
+ * @brief Resolves a tag name (any case) to its static lexbor tag ID.
+ * @param usage The usage set.
+ * @param name The tag name.
+ * @param len Length of the name.
+ * @return The lxb_tag_id_t, or 0 (LXB_TAG__UNDEF) for custom elements.
+ */
+uintptr_t css_usage_tag_id(const css_usage_t *usage, const char *name,
+                           size_t len);
+
+/**
+ * @brief Checks whether a standard tag was used, by lexbor tag ID.
+ * @param usage The usage set.
+ * @param tag_id The lxb_tag_id_t.
+ * @return true if used, false otherwise.
+ */
+bool css_usage_has_tag_id(const css_usage_t *usage, uintptr_t tag_id);
+
+/**
+ * @brief Gets the number of distinct names recorded for a kind.
+ * @param usage The usage set.
+ * @param kind The kind.
+ * @return Number of names.
+ */
+size_t css_usage_count(const css_usage_t *usage, css_usage_kind_t kind);
+
+/**
+ * @brief Gets the symbol table backing the usage set.
+ * @param usage The usage set.
+ * @return The symbol table.
+ */
+const symtab_t *css_usage_symbols(const css_usage_t *usage);
+
+/**
+ * @brief Checks whether an interned symbol is used as the given kind.
+ * @param usage The usage set.
+ * @param kind The kind.
+ * @param id Symbol ID from css_usage_symbols().
+ * @return true if used, false otherwise.
+ */
+bool css_usage_symbol_has(const css_usage_t *usage, css_usage_kind_t kind,
+                          symbol_id_t id);
+
+/**
+ * @brief Puts a blocked Bloom filter in front of the name tables. Class,
+ * custom tag and attribute name lookups that miss are then usually rejected
+ * by a single cache-line probe. The filter is built from the names recorded
+ * so far and kept up to date by later additions.
+ * @param usage The usage set.
+ * @param bits_per_key Filter bits per recorded name (0 for the default).
+ * @return true on success, false on failure.
+ */
+bool css_usage_enable_prefilter(css_usage_t *usage, unsigned bits_per_key);
+
+/**
+ * @brief Reads the prefilter counters.
+ * @param usage The usage set.
+ * @param stats Receives the counters.
+ * @return true if the prefilter is enabled, false otherwise.
+ */
+bool css_usage_prefilter_stats(const css_usage_t *usage,
+                               css_usage_prefilter_stats_t *stats);
+
+#endif // CSSOPTIM_USAGE_H
@@ -14,10 +14,11 @@ static const char *const usages[] = {
 /* Argument parsing callbacks for the argparse library */
 
 /* Callback for --css flag. Collects all subsequent non-hyphenated arguments as
- * CSS files. */
+ * CSS files, plus "-" for standard input. */
 static int css_cb(struct argparse *self, const struct argparse_option *opt) {
   css_args_t *args = (css_args_t *)opt->data;
-  while (self->argc > 1 && self->argv[1][0] != '-') {
+  while (self->argc > 1 &&
+         (self->argv[1][0] != '-' || strcmp(self->argv[1], "-") == 0)) {
     if (args->css_file_count < MAX_INPUT_FILES) {
       args->css_files[args->css_file_count++] = self->argv[1];
     }
@@ -51,8 +52,30 @@ int parse_args(int argc, const char **argv, css_args_t *args) {
       OPT_STRING('r', "reduction", &args->reduction,
                  "reduction mode: strict, safe, conservative (default: safe)",
                  NULL, 0, 0),
-      OPT_BOOLEAN(0, "css", NULL, "list of CSS files", css_cb, (intptr_t)args,
-                  0),
+      OPT_BOOLEAN(0, "prefilter", &args->prefilter,
+                  "check names against a Bloom filter first (large HTML sets)",
+                  NULL, 0, 0),
+      OPT_BOOLEAN(0, "region", &args->region,
+                  "allocate parser memory from one region dropped at exit",
+                  NULL, 0, 0),
+      OPT_BOOLEAN(0, "lazy", &args->lazy,
+                  "parse declarations only for rules with used selectors",
+                  NULL, 0, 0),
+      OPT_BOOLEAN(0, "prefilter-rules", &args->prefilter_rules,
+                  "drop unused rules with simple selectors before parsing",
+                  NULL, 0, 0),
+      OPT_STRING(0, "max-memory", &args->max_memory,
+                 "optimize in windows using about this much memory (e.g. 64M)",
+                 NULL, 0, 0),
+      OPT_INTEGER(0, "threads", &args->threads,
+                  "optimize each stylesheet in chunks on this many threads",
+                  NULL, 0, 0),
+      OPT_BOOLEAN(0, "splice", &args->splice,
+                  "copy unchanged rules from CSS files instead of "
+                  "re-serializing them",
+                  NULL, 0, 0),
+      OPT_BOOLEAN(0, "css", NULL, "list of CSS files (- for standard input)",
+                  css_cb, (intptr_t)args, 0),
       OPT_BOOLEAN(0, "html", NULL, "list of HTML/JS files", html_cb,
                   (intptr_t)args, 0),
       OPT_END(),
@@ -11,6 +11,13 @@ typedef struct {
   const char *html_files[MAX_INPUT_FILES];
   int html_file_count;
   const char *reduction;
+  int prefilter; // argparse stores OPT_BOOLEAN values as int
+  int region;
+  int lazy;
+  int prefilter_rules;
+  const char *max_memory; // size with an optional K, M or G suffix
+  int threads;
+  int splice;
   bool verbose;
 } css_args_t;
 
@@ -0,0 +1,354 @@
+#include "attr_index.h"
+#include "cssoptim/arena.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Values longer than this only enter the tries by their first/last
+ * TRIE_DEPTH bytes; longer queries fall back to scanning the value list.
+ */
+#define TRIE_DEPTH 128
+
+typedef struct trie_node {
+  struct trie_node *child;
+  struct trie_node *sibling;
+  unsigned char byte;
+} trie_node_t;
+
+typedef struct value_node {
+  struct value_node *next;
+  const char *str;
+  size_t len;
+} value_node_t;
+
+typedef struct {
+  trie_node_t prefix;
+  trie_node_t suffix;
+  value_node_t *values;
+} attr_entry_t;
+
+/* Open-addressing set of (name, value) symbol pairs. */
+typedef struct {
+  uint64_t *keys; // pair + 1, 0 marks an empty slot
+  size_t mask;
+  size_t count;
+} pair_set_t;
+
+struct attr_index {
+  symtab_t *symbols;
+  arena_t arena;
+
+  attr_entry_t **entries; // indexed by attribute name symbol
+  size_t entry_count;
+
+  pair_set_t exact;  // name=value
+  pair_set_t tokens; // name~=token
+};
+
+// --- Pair Set ---
+
+static uint64_t pair_key(symbol_id_t name, symbol_id_t value) {
+  return ((uint64_t)name << 32 | value) + 1;
+}
+
+static size_t pair_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (size_t)key;
+}
+
+static bool pair_set_contains(const pair_set_t *set, uint64_t key) {
+  if (!set->keys)
+    return false;
+  size_t i = pair_hash(key) & set->mask;
+  while (set->keys[i]) {
+    if (set->keys[i] == key)
+      return true;
+    i = (i + 1) & set->mask;
+  }
+  return false;
+}
+
+// Makes room for one more key, so the next pair_set_add() cannot fail.
+static bool pair_set_reserve(pair_set_t *set) {
+  if (set->keys && (set->count + 1) * 4 <= (set->mask + 1) * 3)
+    return true;
+
+  size_t size = set->keys ? (set->mask + 1) * 2 : 64;
+  uint64_t *keys = calloc(size, sizeof(uint64_t));
+  if (!keys)
+    return false;
+  for (size_t j = 0; set->keys && j <= set->mask; j++) {
+    if (!set->keys[j])
+      continue;
+    size_t i = pair_hash(set->keys[j]) & (size - 1);
+    while (keys[i])
+      i = (i + 1) & (size - 1);
+    keys[i] = set->keys[j];
+  }
+  free(set->keys);
+  set->keys = keys;
+  set->mask = size - 1;
+  return true;
+}
+
+static bool pair_set_add(pair_set_t *set, uint64_t key) {
+  if (!pair_set_reserve(set))
+    return false;
+
+  size_t i = pair_hash(key) & set->mask;
+  while (set->keys[i]) {
+    if (set->keys[i] == key)
+      return false;
+    i = (i + 1) & set->mask;
+  }
+  set->keys[i] = key;
+  set->count++;
+  return true;
+}
+
+// --- Tries ---
+
+static trie_node_t *trie_child(const trie_node_t *node, unsigned char byte) {
+  trie_node_t *child = node->child;
+  while (child && child->byte != byte)
+    child = child->sibling;
+  return child;
+}
+
+// Inserts len bytes read forwards (step 1) or backwards (step -1) from str.
+static bool trie_insert(arena_t *arena, trie_node_t *root, const char *str,
+                        size_t len, int step) {
+  trie_node_t *node = root;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char byte = (unsigned char)*str;
+    str += step;
+    trie_node_t *child = trie_child(node, byte);
+    if (!child) {
+      child = arena_alloc(arena, sizeof(trie_node_t));
+      if (!child)
+        return false;
+      child->child = NULL;
+      child->byte = byte;
+      child->sibling = node->child;
+      node->child = child;
+    }
+    node = child;
+  }
+  return true;
+}
+
+static const trie_node_t *trie_walk(const trie_node_t *root, const char *str,
+                                    size_t len, int step) {
+  const trie_node_t *node = root;
+  for (size_t i = 0; i < len && node; i++) {
+    node = trie_child(node, (unsigned char)*str);
+    str += step;
+  }
+  return node;
+}
+
+// --- Linear Matching ---
+
+static bool bytes_equal(const char *a, const char *b, size_t len,
+                        bool ignore_case) {
+  if (!ignore_case)
+    return memcmp(a, b, len) == 0;
+  for (size_t i = 0; i < len; i++) {
+    if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+      return false;
+  }
+  return true;
+}
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool value_matches(const value_node_t *v, css_attr_match_t op,
+                          const char *q, size_t qlen, bool ignore_case) {
+  switch (op) {
+  case CSS_ATTR_EQUAL:
+    return v->len == qlen && bytes_equal(v->str, q, qlen, ignore_case);
+  case CSS_ATTR_DASH:
+    return v->len >= qlen && bytes_equal(v->str, q, qlen, ignore_case) &&
+           (v->len == qlen || v->str[qlen] == '-');
+  case CSS_ATTR_PREFIX:
+    return v->len >= qlen && bytes_equal(v->str, q, qlen, ignore_case);
+  case CSS_ATTR_SUFFIX:
+    return v->len >= qlen &&
+           bytes_equal(v->str + v->len - qlen, q, qlen, ignore_case);
+  case CSS_ATTR_SUBSTRING:
+    for (size_t i = 0; i + qlen <= v->len; i++) {
+      if (bytes_equal(v->str + i, q, qlen, ignore_case))
+        return true;
+    }
+    return false;
+  case CSS_ATTR_INCLUDE: {
+    size_t i = 0;
+    while (i < v->len) {
+      while (i < v->len && is_space(v->str[i]))
+        i++;
+      size_t start = i;
+      while (i < v->len && !is_space(v->str[i]))
+        i++;
+      if (i - start == qlen && bytes_equal(v->str + start, q, qlen, ignore_case))
+        return true;
+    }
+    return false;
+  }
+  default:
+    return false;
+  }
+}
+
+// --- Public API ---
+
+attr_index_t *attr_index_create(symtab_t *symbols) {
+  attr_index_t *index = calloc(1, sizeof(attr_index_t));
+  if (!index)
+    return NULL;
+  index->symbols = symbols;
+  arena_init(&index->arena, 0);
+  return index;
+}
+
+void attr_index_destroy(attr_index_t *index) {
+  if (!index)
+    return;
+  arena_release(&index->arena);
+  free(index->entries);
+  free(index->exact.keys);
+  free(index->tokens.keys);
+  free(index);
+}
+
+static attr_entry_t *get_entry(attr_index_t *index, symbol_id_t name) {
+  if (name >= index->entry_count) {
+    size_t count = index->entry_count ? index->entry_count : 16;
+    while (count <= name)
+      count *= 2;
+    attr_entry_t **entries =
+        realloc(index->entries, count * sizeof(attr_entry_t *));
+    if (!entries)
+      return NULL;
+    memset(entries + index->entry_count, 0,
+           (count - index->entry_count) * sizeof(attr_entry_t *));
+    index->entries = entries;
+    index->entry_count = count;
+  }
+
+  if (!index->entries[name]) {
+    attr_entry_t *entry = arena_alloc(&index->arena, sizeof(attr_entry_t));
+    if (!entry)
+      return NULL;
+    memset(entry, 0, sizeof(attr_entry_t));
+    index->entries[name] = entry;
+  }
+  return index->entries[name];
+}
+
+bool attr_index_add(attr_index_t *index, symbol_id_t name, const char *value,
+                    size_t len) {
+  symbol_id_t value_id = symtab_intern(index->symbols, value, len);
+  if (value_id == SYMBOL_NONE)
+    return false;
+  uint64_t key = pair_key(name, value_id);
+  if (pair_set_contains(&index->exact, key))
+    return true;
+
+  // The pair goes into the exact set and the value list last, once nothing
+  // can fail. A failure before leaves at most trie nodes or tokens claiming
+  // the value, which only keeps rules.
+  attr_entry_t *entry = get_entry(index, name);
+  value_node_t *node = arena_alloc(&index->arena, sizeof(value_node_t));
+  if (!entry || !node || !pair_set_reserve(&index->exact))
+    return false;
+
+  size_t depth = len < TRIE_DEPTH ? len : TRIE_DEPTH;
+  if (!trie_insert(&index->arena, &entry->prefix, value, depth, 1) ||
+      (len > 0 &&
+       !trie_insert(&index->arena, &entry->suffix, value + len - 1, depth, -1)))
+    return false;
+
+  // Whitespace-separated tokens for [name~=token]
+  size_t i = 0;
+  while (i < len) {
+    while (i < len && is_space(value[i]))
+      i++;
+    size_t start = i;
+    while (i < len && !is_space(value[i]))
+      i++;
+    if (i > start) {
+      symbol_id_t token = symtab_intern(index->symbols, value + start, i - start);
+      if (token == SYMBOL_NONE ||
+          (!pair_set_add(&index->tokens, pair_key(name, token)) &&
+           !pair_set_contains(&index->tokens, pair_key(name, token))))
+        return false;
+    }
+  }
+
+  node->str = symtab_name(index->symbols, value_id);
+  node->len = len;
+  node->next = entry->values;
+  entry->values = node;
+  pair_set_add(&index->exact, key);
+  return true;
+}
+
+bool attr_index_match(const attr_index_t *index, symbol_id_t name,
+                      css_attr_match_t op, const char *value, size_t len,
+                      bool ignore_case) {
+  if (name >= index->entry_count || !index->entries[name])
+    return false;
+  const attr_entry_t *entry = index->entries[name];
+
+  // Selectors Level 4: an empty value never matches these operators, and
+  // whitespace can never be part of a ~= token.
+  if (len == 0 && (op == CSS_ATTR_PREFIX || op == CSS_ATTR_SUFFIX ||
+                   op == CSS_ATTR_SUBSTRING || op == CSS_ATTR_INCLUDE))
+    return false;
+  if (op == CSS_ATTR_INCLUDE) {
+    for (size_t i = 0; i < len; i++) {
+      if (is_space(value[i]))
+        return false;
+    }
+  }
+
+  bool indexed = !ignore_case && len < TRIE_DEPTH;
+  if (indexed) {
+    switch (op) {
+    case CSS_ATTR_EQUAL:
+    case CSS_ATTR_INCLUDE: {
+      symbol_id_t id = symtab_lookup(index->symbols, value, len);
+      const pair_set_t *set =
+          op == CSS_ATTR_EQUAL ? &index->exact : &index->tokens;
+      return id != SYMBOL_NONE && pair_set_contains(set, pair_key(name, id));
+    }
+    case CSS_ATTR_PREFIX:
+      return trie_walk(&entry->prefix, value, len, 1) != NULL;
+    case CSS_ATTR_SUFFIX:
+      return trie_walk(&entry->suffix, value + len - 1, len, -1) != NULL;
+    case CSS_ATTR_DASH: {
+      symbol_id_t id = symtab_lookup(index->symbols, value, len);
+      if (id != SYMBOL_NONE && pair_set_contains(&index->exact,
+                                                 pair_key(name, id)))
+        return true;
+      const trie_node_t *node = trie_walk(&entry->prefix, value, len, 1);
+      return node && trie_child(node, '-') != NULL;
+    }
+    default:
+      break;
+    }
+  }
+
+  // Substring, case-insensitive and over-long queries scan this attribute's
+  // values; the list only holds values seen for this one name.
+  for (const value_node_t *v = entry->values; v; v = v->next) {
+    if (value_matches(v, op, value, len, ignore_case))
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,29 @@
+#ifndef CSSOPTIM_ATTR_INDEX_H
+#define CSSOPTIM_ATTR_INDEX_H
+
+#include "cssoptim/symtab.h"
+#include "cssoptim/usage.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Per-attribute-name index of the values seen in scanned documents.
+ * Values are interned into the caller's symbol table; each attribute name
+ * gets an exact-match set, a whitespace-token set, and depth-capped prefix
+ * and suffix tries. Queries never allocate.
+ */
+typedef struct attr_index attr_index_t;
+
+attr_index_t *attr_index_create(symtab_t *symbols);
+void attr_index_destroy(attr_index_t *index);
+
+// Records value as seen on attribute `name` (a symbol of the same table).
+bool attr_index_add(attr_index_t *index, symbol_id_t name, const char *value,
+                    size_t len);
+
+// Evaluates `[name <op> value]` against the recorded values. CSS_ATTR_EXISTS
+// is answered by the caller, which knows whether the name was seen at all.
+bool attr_index_match(const attr_index_t *index, symbol_id_t name,
+                      css_attr_match_t op, const char *value, size_t len,
+                      bool ignore_case);
+
+#endif // CSSOPTIM_ATTR_INDEX_H
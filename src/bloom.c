@@ -0,0 +1,98 @@
+#define _POSIX_C_SOURCE 200112L
+#include "bloom.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks start on a cache line, so a probe never spans two
+#define CACHE_LINE 64
+
+#define BLOCK_WORDS 8
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+
+typedef struct {
+  uint64_t words[BLOCK_WORDS];
+} bloom_block_t;
+
+struct bloom {
+  bloom_block_t *blocks;
+  size_t block_mask;
+  size_t capacity;
+};
+
+// Odd multipliers picking one bit per word (as in split-block filters)
+static const uint32_t salts[BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+bloom_t *bloom_create(size_t keys, unsigned bits_per_key) {
+  bloom_t *bloom = calloc(1, sizeof(bloom_t));
+  if (!bloom)
+    return NULL;
+
+  if (keys == 0)
+    keys = 1;
+  if (bits_per_key == 0)
+    bits_per_key = 1;
+  size_t wanted = (keys * bits_per_key + BLOCK_BITS - 1) / BLOCK_BITS;
+  size_t count = 1;
+  while (count < wanted)
+    count *= 2;
+
+  void *blocks = NULL;
+  if (posix_memalign(&blocks, CACHE_LINE, count * sizeof(bloom_block_t)) !=
+      0) {
+    free(bloom);
+    return NULL;
+  }
+  memset(blocks, 0, count * sizeof(bloom_block_t));
+  bloom->blocks = blocks;
+  bloom->block_mask = count - 1;
+  bloom->capacity = keys;
+  return bloom;
+}
+
+void bloom_destroy(bloom_t *bloom) {
+  if (!bloom)
+    return;
+  free(bloom->blocks);
+  free(bloom);
+}
+
+uint64_t bloom_hash(const char *str, size_t len, uint64_t seed) {
+  // FNV-1a, then a 64-bit finalizer so both halves are well mixed
+  uint64_t h = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)str[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+void bloom_add(bloom_t *bloom, uint64_t hash) {
+  bloom_block_t *block = &bloom->blocks[(hash >> 32) & bloom->block_mask];
+  uint32_t key = (uint32_t)hash;
+  for (int i = 0; i < BLOCK_WORDS; i++)
+    block->words[i] |= (uint64_t)1 << ((key * salts[i]) >> 26);
+}
+
+bool bloom_maybe_contains(const bloom_t *bloom, uint64_t hash) {
+  const bloom_block_t *block =
+      &bloom->blocks[(hash >> 32) & bloom->block_mask];
+  uint32_t key = (uint32_t)hash;
+  for (int i = 0; i < BLOCK_WORDS; i++) {
+    if (!((block->words[i] >> ((key * salts[i]) >> 26)) & 1))
+      return false;
+  }
+  return true;
+}
+
+size_t bloom_capacity(const bloom_t *bloom) { return bloom->capacity; }
+
+size_t bloom_bytes(const bloom_t *bloom) {
+  return (bloom->block_mask + 1) * sizeof(bloom_block_t);
+}
@@ -0,0 +1,28 @@
+#ifndef CSSOPTIM_BLOOM_H
+#define CSSOPTIM_BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Blocked Bloom filter. Every key maps to one 64-byte block (a cache line)
+ * and sets one bit in each of its eight words, so a query touches a single
+ * line. Used as a prefilter in front of the usage tables.
+ */
+typedef struct bloom bloom_t;
+
+// Sizes the filter for `keys` entries at roughly `bits_per_key` bits each.
+bloom_t *bloom_create(size_t keys, unsigned bits_per_key);
+void bloom_destroy(bloom_t *bloom);
+
+// Hashes a span; the seed separates key spaces sharing one filter.
+uint64_t bloom_hash(const char *str, size_t len, uint64_t seed);
+
+void bloom_add(bloom_t *bloom, uint64_t hash);
+bool bloom_maybe_contains(const bloom_t *bloom, uint64_t hash);
+
+// Number of keys the filter was sized for, and its size in bytes.
+size_t bloom_capacity(const bloom_t *bloom);
+size_t bloom_bytes(const bloom_t *bloom);
+
+#endif // CSSOPTIM_BLOOM_H
@@ -0,0 +1,117 @@
+#include "cssoptim/arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_DEFAULT_BLOCK 16384
+#define ARENA_ALIGN 16
+
+struct arena_block {
+  arena_block_t *next;
+  size_t used;
+  size_t size;
+  // Payload follows, aligned to ARENA_ALIGN
+};
+
+#define ARENA_HEADER                                                           \
+  ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(arena_t *arena, size_t block_size) {
+  arena->head = NULL;
+  arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK;
+  arena->reserved = 0;
+  arena->peak = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  arena_block_t *block = arena->head;
+  if (!block || block->size - block->used < size) {
+    size_t payload = size > arena->block_size ? size : arena->block_size;
+    block = malloc(ARENA_HEADER + payload);
+    if (!block)
+      return NULL;
+    block->used = 0;
+    block->size = payload;
+    arena->reserved += ARENA_HEADER + payload;
+    if (arena->reserved > arena->peak)
+      arena->peak = arena->reserved;
+
+    // Oversized requests get a dedicated block behind the current one so the
+    // partially used head keeps serving small allocations.
+    if (arena->head && payload > arena->block_size) {
+      block->next = arena->head->next;
+      arena->head->next = block;
+    } else {
+      block->next = arena->head;
+      arena->head = block;
+    }
+  }
+
+  void *ptr = (char *)block + ARENA_HEADER + block->used;
+  block->used += size;
+  return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  if (!copy)
+    return NULL;
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+arena_mark_t arena_mark(const arena_t *arena) {
+  arena_mark_t mark;
+  mark.head = arena->head;
+  mark.next = arena->head ? arena->head->next : NULL;
+  mark.used = arena->head ? arena->head->used : 0;
+  return mark;
+}
+
+static void free_block(arena_t *arena, arena_block_t *block) {
+  arena->reserved -= ARENA_HEADER + block->size;
+  free(block);
+}
+
+void arena_rewind(arena_t *arena, arena_mark_t mark) {
+  // Blocks pushed in front of the marked head
+  while (arena->head && arena->head != mark.head) {
+    arena_block_t *next = arena->head->next;
+    free_block(arena, arena->head);
+    arena->head = next;
+  }
+  if (!arena->head)
+    return;
+
+  // Oversized blocks slotted in right behind it
+  while (arena->head->next != mark.next) {
+    arena_block_t *block = arena->head->next;
+    arena->head->next = block->next;
+    free_block(arena, block);
+  }
+  arena->head->used = mark.used;
+}
+
+void arena_reset(arena_t *arena) {
+  if (!arena->head)
+    return;
+  while (arena->head->next) {
+    arena_block_t *block = arena->head->next;
+    arena->head->next = block->next;
+    free_block(arena, block);
+  }
+  arena->head->used = 0;
+}
+
+void arena_release(arena_t *arena) {
+  arena_block_t *block = arena->head;
+  while (block) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->head = NULL;
+  arena->reserved = 0;
+}
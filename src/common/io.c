@@ -1,7 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
 #include "cssoptim/io.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 char *read_file(const char *filename, size_t *length) {
   FILE *f = fopen(filename, "rb");
@@ -39,15 +45,105 @@ char *read_file(const char *filename, size_t *length) {
 }
 
 bool write_file(const char *filename, const char *content) {
-  FILE *f = fopen(filename, "wb");
-  if (!f) return false;
-  
-  size_t len = strlen(content);
-  if (fwrite(content, 1, len, f) < len) {
-    fclose(f);
-    return false;
+  char *temp_path;
+  int fd = open_output(filename, &temp_path);
+  if (fd < 0) return false;
+
+  bool ok = write_to_fd(content, strlen(content), &fd);
+  return finish_output(fd, temp_path, filename, ok);
+}
+
+int open_output(const char *filename, char **temp_path) {
+  size_t len = strlen(filename);
+  char *path = malloc(len + sizeof(".XXXXXX"));
+  if (!path) return -1;
+  memcpy(path, filename, len);
+  memcpy(path + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    free(path);
+    return -1;
+  }
+
+  // mkstemp() creates the file 0600; give it the mode the old file had, or
+  // the one open() would have given a new file
+  struct stat st;
+  mode_t mode;
+  if (stat(filename, &st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+  if (fchmod(fd, mode) != 0) {
+    int err = errno;
+    close(fd);
+    unlink(path);
+    free(path);
+    errno = err;
+    return -1;
+  }
+
+  *temp_path = path;
+  return fd;
+}
+
+bool finish_output(int fd, char *temp_path, const char *filename, bool ok) {
+  if (close(fd) != 0) ok = false;
+  if (ok && rename(temp_path, filename) != 0) ok = false;
+  if (!ok) {
+    int err = errno;
+    unlink(temp_path);
+    errno = err;
+  }
+  free(temp_path);
+  return ok;
+}
+
+const char *map_file(const char *filename, size_t *length) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  // An empty file cannot be mapped; it reads as empty text, like read_file
+  if (st.st_size <= 0) {
+    close(fd);
+    *length = 0;
+    return "";
+  }
+
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  // Windows are read front to back, twice
+  posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+  *length = (size_t)st.st_size;
+  return map;
+}
+
+void unmap_file(const char *data, size_t length) {
+  if (data && length > 0) munmap((void *)data, length);
+}
+
+bool write_to_stream(const char *data, size_t len, void *user) {
+  return fwrite(data, 1, len, (FILE *)user) == len;
+}
+
+bool write_to_fd(const char *data, size_t len, void *user) {
+  int fd = *(const int *)user;
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= (size_t)n;
   }
-  
-  fclose(f);
   return true;
 }
@@ -1,59 +1,148 @@
 #include "cssoptim/list.h"
+#include "cssoptim/arena.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Insertion-ordered string set.
+ * Strings live in a bump arena; an open-addressing table of item indices
+ * (linear probing, power-of-two size) gives O(1) membership checks.
+ */
 struct string_list {
   char **items;
+  size_t *lengths;
+  uint32_t *hashes;
   size_t count;
   size_t capacity;
+
+  uint32_t *slots; // item index + 1, 0 marks an empty slot
+  size_t slot_mask;
+
+  arena_t strings;
 };
 
+static uint32_t hash_span(const char *str, size_t len) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)str[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Returns the slot holding the span, or the empty slot where it would go.
+static size_t find_slot(const string_list_t *list, const char *str, size_t len,
+                        uint32_t hash) {
+  size_t i = hash & list->slot_mask;
+  while (list->slots[i]) {
+    size_t idx = list->slots[i] - 1;
+    if (list->hashes[idx] == hash && list->lengths[idx] == len &&
+        memcmp(list->items[idx], str, len) == 0) {
+      return i;
+    }
+    i = (i + 1) & list->slot_mask;
+  }
+  return i;
+}
+
+static bool grow_slots(string_list_t *list) {
+  size_t new_size = list->slots ? (list->slot_mask + 1) * 2 : 32;
+  uint32_t *slots = calloc(new_size, sizeof(uint32_t));
+  if (!slots)
+    return false;
+
+  free(list->slots);
+  list->slots = slots;
+  list->slot_mask = new_size - 1;
+  for (size_t idx = 0; idx < list->count; idx++) {
+    size_t i = list->hashes[idx] & list->slot_mask;
+    while (slots[i])
+      i = (i + 1) & list->slot_mask;
+    slots[i] = (uint32_t)(idx + 1);
+  }
+  return true;
+}
+
+static bool grow_items(string_list_t *list) {
+  size_t new_capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+  char **items = realloc(list->items, new_capacity * sizeof(char *));
+  if (!items)
+    return false;
+  list->items = items;
+
+  size_t *lengths = realloc(list->lengths, new_capacity * sizeof(size_t));
+  if (!lengths)
+    return false;
+  list->lengths = lengths;
+
+  uint32_t *hashes = realloc(list->hashes, new_capacity * sizeof(uint32_t));
+  if (!hashes)
+    return false;
+  list->hashes = hashes;
+
+  list->capacity = new_capacity;
+  return true;
+}
+
 string_list_t *string_list_create(void) {
-  string_list_t *list = malloc(sizeof(string_list_t));
+  string_list_t *list = calloc(1, sizeof(string_list_t));
   if (list) {
-    list->items = NULL;
-    list->count = 0;
-    list->capacity = 0;
+    arena_init(&list->strings, 0);
   }
   return list;
 }
 
 void string_list_destroy(string_list_t *list) {
   if (!list) return;
-  for (size_t i = 0; i < list->count; i++) {
-    free(list->items[i]);
-  }
+  arena_release(&list->strings);
+  free(list->slots);
+  free(list->hashes);
+  free(list->lengths);
   free(list->items);
   free(list);
 }
 
 bool string_list_add(string_list_t *list, const char *str) {
   if (!list || !str) return false;
-  if (string_list_contains(list, str)) return false;
-  
-  if (list->count == list->capacity) {
-    size_t new_capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
-    char **new_items = realloc(list->items, new_capacity * sizeof(char *));
-    if (!new_items) return false;
-    list->items = new_items;
-    list->capacity = new_capacity;
+  return string_list_add_n(list, str, strlen(str));
+}
+
+bool string_list_add_n(string_list_t *list, const char *str, size_t len) {
+  if (!list || !str) return false;
+
+  // Keep the table at most 3/4 full
+  if (!list->slots || (list->count + 1) * 4 > (list->slot_mask + 1) * 3) {
+    if (!grow_slots(list)) return false;
   }
-  
-  size_t slen = strlen(str);
-  char *dup = malloc(slen + 1);
-  if (!dup) return false;
-  
-  memcpy(dup, str, slen + 1);
-  list->items[list->count++] = dup;
+
+  uint32_t hash = hash_span(str, len);
+  size_t slot = find_slot(list, str, len, hash);
+  if (list->slots[slot]) return false;
+
+  if (list->count == list->capacity && !grow_items(list)) return false;
+
+  char *copy = arena_strndup(&list->strings, str, len);
+  if (!copy) return false;
+
+  list->items[list->count] = copy;
+  list->lengths[list->count] = len;
+  list->hashes[list->count] = hash;
+  list->slots[slot] = (uint32_t)(++list->count);
   return true;
 }
 
 bool string_list_contains(const string_list_t *list, const char *str) {
-  if (!list || !str) return false;
-  for (size_t i = 0; i < list->count; i++) {
-    if (strcmp(list->items[i], str) == 0) return true;
-  }
-  return false;
+  if (!list || !str || !list->slots) return false;
+  size_t len = strlen(str);
+  return list->slots[find_slot(list, str, len, hash_span(str, len))] != 0;
+}
+
+size_t string_list_index_n(const string_list_t *list, const char *str,
+                           size_t len) {
+  if (!list || !str || !list->slots) return STRING_LIST_NPOS;
+  uint32_t idx = list->slots[find_slot(list, str, len, hash_span(str, len))];
+  return idx ? (size_t)idx - 1 : STRING_LIST_NPOS;
 }
 
 size_t string_list_count(const string_list_t *list) {
@@ -0,0 +1,52 @@
+#include "cssoptim/symtab.h"
+#include "cssoptim/list.h"
+#include <stdlib.h>
+
+/* The string list already keeps items in insertion order behind a hash
+ * index, so a symbol ID is simply the item's position in the list.
+ */
+struct symtab {
+  string_list_t *names;
+};
+
+symtab_t *symtab_create(void) {
+  symtab_t *table = malloc(sizeof(symtab_t));
+  if (!table)
+    return NULL;
+  table->names = string_list_create();
+  if (!table->names) {
+    free(table);
+    return NULL;
+  }
+  return table;
+}
+
+void symtab_destroy(symtab_t *table) {
+  if (!table)
+    return;
+  string_list_destroy(table->names);
+  free(table);
+}
+
+symbol_id_t symtab_intern(symtab_t *table, const char *str, size_t len) {
+  size_t index = string_list_index_n(table->names, str, len);
+  if (index != STRING_LIST_NPOS)
+    return (symbol_id_t)index;
+  if (string_list_count(table->names) >= SYMBOL_NONE ||
+      !string_list_add_n(table->names, str, len))
+    return SYMBOL_NONE;
+  return (symbol_id_t)(string_list_count(table->names) - 1);
+}
+
+symbol_id_t symtab_lookup(const symtab_t *table, const char *str, size_t len) {
+  size_t index = string_list_index_n(table->names, str, len);
+  return index == STRING_LIST_NPOS ? SYMBOL_NONE : (symbol_id_t)index;
+}
+
+size_t symtab_count(const symtab_t *table) {
+  return string_list_count(table->names);
+}
+
+const char *symtab_name(const symtab_t *table, symbol_id_t id) {
+  return string_list_get(table->names, id);
+}
@@ -0,0 +1,187 @@
+#include "dep_graph.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_EDGE UINT32_MAX
+
+// Nodes interleave the kinds: node = 2 * symbol + kind
+#define NODE(kind, id) ((dep_node_t)((id) * DEP_KIND_COUNT + (kind)))
+#define NODE_KIND(node) ((dep_kind_t)((node) % DEP_KIND_COUNT))
+#define NODE_SYMBOL(node) ((symbol_id_t)((node) / DEP_KIND_COUNT))
+
+typedef struct {
+  dep_node_t to;
+  uint32_t next; // previous edge from the same node
+} dep_edge_t;
+
+typedef struct {
+  uint32_t last_edge;
+  bool root;
+  bool used;
+} dep_entry_t;
+
+struct dep_graph {
+  symtab_t *names[DEP_KIND_COUNT];
+
+  dep_entry_t *nodes; // indexed by node
+  size_t node_count;
+  size_t node_capacity;
+
+  dep_edge_t *edges;
+  size_t edge_count;
+  size_t edge_capacity;
+};
+
+dep_graph_t *dep_graph_create(void) {
+  dep_graph_t *graph = calloc(1, sizeof(dep_graph_t));
+  if (!graph)
+    return NULL;
+  for (int kind = 0; kind < DEP_KIND_COUNT; kind++) {
+    graph->names[kind] = symtab_create();
+    if (!graph->names[kind]) {
+      dep_graph_destroy(graph);
+      return NULL;
+    }
+  }
+  return graph;
+}
+
+void dep_graph_destroy(dep_graph_t *graph) {
+  if (!graph)
+    return;
+  for (int kind = 0; kind < DEP_KIND_COUNT; kind++)
+    symtab_destroy(graph->names[kind]);
+  free(graph->nodes);
+  free(graph->edges);
+  free(graph);
+}
+
+dep_node_t dep_graph_node(dep_graph_t *graph, dep_kind_t kind,
+                          const char *name, size_t len) {
+  symbol_id_t id = symtab_intern(graph->names[kind], name, len);
+  if (id == SYMBOL_NONE)
+    return DEP_NONE;
+
+  dep_node_t node = NODE(kind, id);
+  if (node >= graph->node_count) {
+    if (node >= graph->node_capacity) {
+      size_t capacity = graph->node_capacity ? graph->node_capacity * 2 : 64;
+      while (capacity <= node)
+        capacity *= 2;
+      dep_entry_t *nodes =
+          realloc(graph->nodes, capacity * sizeof(dep_entry_t));
+      if (!nodes)
+        return DEP_NONE;
+      graph->nodes = nodes;
+      graph->node_capacity = capacity;
+    }
+    // The other kind's slots in between are empty nodes
+    for (size_t n = graph->node_count; n <= node; n++) {
+      graph->nodes[n].last_edge = NO_EDGE;
+      graph->nodes[n].root = false;
+      graph->nodes[n].used = false;
+    }
+    graph->node_count = (size_t)node + 1;
+  }
+  return node;
+}
+
+static bool add_edge(dep_graph_t *graph, dep_node_t from, dep_node_t to) {
+  dep_entry_t *entry = &graph->nodes[from];
+  // A definition mentioning the same name twice in a row only counts once
+  if (entry->last_edge != NO_EDGE && graph->edges[entry->last_edge].to == to)
+    return true;
+
+  if (graph->edge_count == graph->edge_capacity) {
+    size_t capacity = graph->edge_capacity ? graph->edge_capacity * 2 : 64;
+    dep_edge_t *edges = realloc(graph->edges, capacity * sizeof(dep_edge_t));
+    if (!edges)
+      return false;
+    graph->edges = edges;
+    graph->edge_capacity = capacity;
+  }
+
+  dep_edge_t *edge = &graph->edges[graph->edge_count];
+  edge->to = to;
+  edge->next = entry->last_edge;
+  entry->last_edge = (uint32_t)graph->edge_count++;
+  return true;
+}
+
+bool dep_graph_add_ref(dep_graph_t *graph, dep_node_t from, dep_kind_t kind,
+                       const char *name, size_t len) {
+  dep_node_t to = dep_graph_node(graph, kind, name, len);
+  if (to == DEP_NONE)
+    return false;
+  if (from == DEP_NONE) {
+    graph->nodes[to].root = true;
+    return true;
+  }
+  return from < graph->node_count && add_edge(graph, from, to);
+}
+
+bool dep_graph_resolve(dep_graph_t *graph) {
+  dep_node_t *stack = malloc((graph->node_count + 1) * sizeof(dep_node_t));
+  if (!stack)
+    return false;
+
+  size_t top = 0;
+  for (size_t n = 0; n < graph->node_count; n++) {
+    graph->nodes[n].used = graph->nodes[n].root;
+    if (graph->nodes[n].root)
+      stack[top++] = (dep_node_t)n;
+  }
+  // Every node is pushed at most once, when it is first marked
+  while (top > 0) {
+    dep_node_t node = stack[--top];
+    for (uint32_t e = graph->nodes[node].last_edge; e != NO_EDGE;
+         e = graph->edges[e].next) {
+      dep_entry_t *to = &graph->nodes[graph->edges[e].to];
+      if (!to->used) {
+        to->used = true;
+        stack[top++] = graph->edges[e].to;
+      }
+    }
+  }
+
+  free(stack);
+  return true;
+}
+
+bool dep_graph_is_used(const dep_graph_t *graph, dep_kind_t kind,
+                       const char *name, size_t len) {
+  symbol_id_t id = symtab_lookup(graph->names[kind], name, len);
+  if (id == SYMBOL_NONE)
+    return false;
+  dep_node_t node = NODE(kind, id);
+  return node < graph->node_count && graph->nodes[node].used;
+}
+
+bool dep_graph_merge(dep_graph_t *dst, const dep_graph_t *src) {
+  dep_node_t *map = malloc((src->node_count + 1) * sizeof(dep_node_t));
+  if (!map)
+    return false;
+
+  bool ok = true;
+  for (size_t n = 0; ok && n < src->node_count; n++) {
+    symtab_t *names = src->names[NODE_KIND(n)];
+    symbol_id_t id = NODE_SYMBOL(n);
+    map[n] = DEP_NONE;
+    if (id >= symtab_count(names))
+      continue; // padding for the other kind
+    const char *name = symtab_name(names, id);
+    map[n] = dep_graph_node(dst, NODE_KIND(n), name, strlen(name));
+    ok = map[n] != DEP_NONE;
+    if (ok && src->nodes[n].root)
+      dst->nodes[map[n]].root = true;
+  }
+
+  for (size_t n = 0; ok && n < src->node_count; n++) {
+    for (uint32_t e = src->nodes[n].last_edge; ok && e != NO_EDGE;
+         e = src->edges[e].next)
+      ok = add_edge(dst, map[n], map[src->edges[e].to]);
+  }
+
+  free(map);
+  return ok;
+}
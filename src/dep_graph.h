@@ -0,0 +1,53 @@
+#ifndef CSSOPTIM_DEP_GRAPH_H
+#define CSSOPTIM_DEP_GRAPH_H
+
+#include "cssoptim/symtab.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Dependency graph between the custom properties and keyframes of a
+ * stylesheet. Names of each kind are interned into a hash-indexed symbol
+ * table, so lookups are O(1) and there is no limit on their number.
+ *
+ * A reference either comes from a rule that is kept regardless (a root), or
+ * from the definition of another name, e.g. `--a: var(--b)` or a var() inside
+ * @keyframes, and then only counts once that name is used. Edges are between
+ * names rather than rules, so graphs built over separate pieces of a
+ * stylesheet can be merged before they are resolved.
+ */
+typedef struct dep_graph dep_graph_t;
+
+typedef enum { DEP_VAR, DEP_ANIM, DEP_KIND_COUNT } dep_kind_t;
+
+// A name of either kind
+typedef uint32_t dep_node_t;
+
+#define DEP_NONE ((dep_node_t)UINT32_MAX)
+
+dep_graph_t *dep_graph_create(void);
+void dep_graph_destroy(dep_graph_t *graph);
+
+// Returns the node of a name, adding it if new, or DEP_NONE on allocation
+// failure.
+dep_node_t dep_graph_node(dep_graph_t *graph, dep_kind_t kind,
+                          const char *name, size_t len);
+
+// Records that the definition of `from` references a name. With `from`
+// DEP_NONE the reference is a root. Returns false on allocation failure.
+bool dep_graph_add_ref(dep_graph_t *graph, dep_node_t from, dep_kind_t kind,
+                       const char *name, size_t len);
+
+// Marks every name reachable from a root as used (a fixpoint over the
+// edges). Returns false on allocation failure.
+bool dep_graph_resolve(dep_graph_t *graph);
+
+// Whether a name was found used by the last dep_graph_resolve().
+bool dep_graph_is_used(const dep_graph_t *graph, dep_kind_t kind,
+                       const char *name, size_t len);
+
+// Adds every name, root and edge of `src` to `dst`. Returns false on
+// allocation failure.
+bool dep_graph_merge(dep_graph_t *dst, const dep_graph_t *src);
+
+#endif // CSSOPTIM_DEP_GRAPH_H
@@ -1,11 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
 #include "args.h"
 #include "cssoptim/io.h"
+#include "cssoptim/memory.h"
 #include "cssoptim/optimizer.h"
 #include "cssoptim/scanner.h"
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /* Main entry point for the CSS Optimizer.
  * Coordinates scanning of input files (HTML/JS) and optimization of CSS files.
@@ -21,23 +26,215 @@ static bool has_extension(const char *filename, const char *ext) {
   return strcmp(dot + 1, ext) == 0;
 }
 
+// Helper to print lexbor memory use per phase
+static void print_memory_stats(const css_mem_job_t *job) {
+  static const char *const phases[CSS_MEM_PHASE_COUNT] = {
+      "other", "CSS parse", "HTML parse", "nested blocks"};
+  css_mem_stats_t stats;
+  css_mem_job_stats(job, &stats);
+  printf("Parser memory (peak %zu bytes", stats.peak_live);
+  if (stats.region_reserved)
+    printf(", region %zu bytes", stats.region_reserved);
+  printf("):\n");
+  for (int p = 0; p < CSS_MEM_PHASE_COUNT; p++) {
+    printf("  %-14s peak %zu, total %zu bytes\n", phases[p], stats.peak[p],
+           stats.total[p]);
+  }
+}
+
+// Helper to list every name of one kind in a usage set
+static void print_usage_kind(const css_usage_t *usage, css_usage_kind_t kind,
+                             const char *header) {
+  const symtab_t *symbols = css_usage_symbols(usage);
+  printf(header, css_usage_count(usage, kind));
+  for (symbol_id_t id = 0; id < symtab_count(symbols); id++) {
+    if (css_usage_symbol_has(usage, kind, id))
+      printf("  - %s\n", symtab_name(symbols, id));
+  }
+}
+
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if invalid.
+static size_t parse_size(const char *text) {
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text)
+    return 0;
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    value <<= 10;
+    /* fall through */
+  case 'M':
+    value <<= 10;
+    /* fall through */
+  case 'K':
+    value <<= 10;
+    end++;
+    break;
+  }
+  return *end == '\0' ? (size_t)value : 0;
+}
+
+// Reads whatever input is ready, so parsing starts before a pipe is drained
+static bool read_from_fd(char *data, size_t size, size_t *len, void *user) {
+  ssize_t n;
+  do {
+    n = read(*(const int *)user, data, size);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return false;
+  *len = (size_t)n;
+  return true;
+}
+
+// Optimizes a CSS file window by window, writing each one out as it is done.
+// The input is mapped rather than read so it does not count against the
+// budget.
+static bool optimize_windowed(css_optimizer_ctx_t *ctx, const char *fname,
+                              const char *output_file, size_t max_memory,
+                              OptimizerConfig *config) {
+  size_t len = 0;
+  const char *content = map_file(fname, &len);
+  if (!content) {
+    fprintf(stderr, "Error: Could not read CSS file %s: %s\n", fname,
+            strerror(errno));
+    return false;
+  }
+
+  // The output goes to a new file, so -o naming the input does not truncate
+  // the mapped pages
+  bool ok;
+  if (output_file) {
+    char *temp_path;
+    int fd = open_output(output_file, &temp_path);
+    if (fd < 0) {
+      fprintf(stderr, "Error: Could not write output file %s: %s\n",
+              output_file, strerror(errno));
+      unmap_file(content, len);
+      return false;
+    }
+    ok = css_optimize_windowed(ctx, content, len, max_memory, config,
+                               write_to_fd, &fd);
+    ok = finish_output(fd, temp_path, output_file, ok);
+  } else {
+    ok = css_optimize_windowed(ctx, content, len, max_memory, config,
+                               write_to_stream, stdout) &&
+         putchar('\n') != EOF;
+  }
+  if (!ok)
+    fprintf(stderr, "Error optimizing CSS file: %s\n", fname);
+
+  unmap_file(content, len);
+  return ok;
+}
+
+// Optimizes a CSS file straight into the output file or stdout, which gets
+// the first rules while later ones are still being serialized. The output
+// file is only replaced once the whole file was optimized.
+static bool optimize_to_output(css_optimizer_ctx_t *ctx, const char *fname,
+                               const char *output_file,
+                               OptimizerConfig *config) {
+  size_t len = 0;
+  char *content = read_file(fname, &len);
+  if (!content) {
+    fprintf(stderr, "Error: Could not read CSS file %s: %s\n", fname,
+            strerror(errno));
+    return false;
+  }
+
+  bool ok;
+  if (output_file) {
+    char *temp_path;
+    int fd = open_output(output_file, &temp_path);
+    if (fd < 0) {
+      fprintf(stderr, "Error: Could not write output file %s: %s\n",
+              output_file, strerror(errno));
+      free(content);
+      return false;
+    }
+    ok = css_optimize_to_sink(ctx, content, len, config, write_to_fd, &fd);
+    ok = finish_output(fd, temp_path, output_file, ok);
+  } else {
+    ok = css_optimize_to_sink(ctx, content, len, config, write_to_stream,
+                              stdout) &&
+         putchar('\n') != EOF;
+  }
+  if (!ok)
+    fprintf(stderr, "Error optimizing CSS file: %s\n", fname);
+
+  free(content);
+  return ok;
+}
+
+// Optimizes a CSS file in splice mode, copying the rules kept unchanged from
+// the file to the output file or stdout.
+static bool optimize_spliced(css_optimizer_ctx_t *ctx, const char *fname,
+                             const char *output_file,
+                             OptimizerConfig *config) {
+  size_t len = 0;
+  const char *content = map_file(fname, &len);
+  if (!content) {
+    fprintf(stderr, "Error: Could not read CSS file %s: %s\n", fname,
+            strerror(errno));
+    return false;
+  }
+
+  // Without a descriptor the copied ranges are still written from the map.
+  // The output goes to a new file, so -o naming the input leaves both the
+  // mapping and the ranges copied from in_fd intact.
+  int in_fd = open(fname, O_RDONLY);
+  int out_fd = STDOUT_FILENO;
+  char *temp_path = NULL;
+  if (output_file) {
+    out_fd = open_output(output_file, &temp_path);
+    if (out_fd < 0) {
+      fprintf(stderr, "Error: Could not write output file %s: %s\n",
+              output_file, strerror(errno));
+      if (in_fd >= 0)
+        close(in_fd);
+      unmap_file(content, len);
+      return false;
+    }
+  } else {
+    fflush(stdout); // verbose output comes first
+  }
+
+  bool ok = css_optimize_splice_fd(ctx, content, len, config, in_fd, out_fd);
+  if (ok && !output_file)
+    ok = write_to_fd("\n", 1, &out_fd);
+  if (output_file)
+    ok = finish_output(out_fd, temp_path, output_file, ok);
+  if (!ok)
+    fprintf(stderr, "Error optimizing CSS file: %s\n", fname);
+
+  if (in_fd >= 0)
+    close(in_fd);
+  unmap_file(content, len);
+  return ok;
+}
+
 int main(int argc, const char **argv) {
+  // Lexbor allocations are accounted per phase from here on
+  css_memory_install();
+
   css_args_t args = {0};
   if (parse_args(argc, argv, &args) != 0) {
     return 1;
   }
 
-  // Scan HTML/JS files for classes and tags
-  string_list_t *used_classes = string_list_create();
-  string_list_t *used_tags = string_list_create();
-  string_list_t *used_attrs = string_list_create();
+  css_mem_job_t *job = css_mem_job_create(args.region, 0);
+  css_mem_job_enter(job);
 
-  if (!used_classes || !used_tags || !used_attrs) {
-    fprintf(stderr, "Error: Failed to initialize string lists\n");
+  // Scan HTML/JS files for classes, tags and attributes
+  css_usage_t *usage = css_usage_create();
+  if (!usage) {
+    fprintf(stderr, "Error: Failed to initialize usage set\n");
+    css_mem_job_enter(NULL);
+    css_mem_job_destroy(job);
     return 1;
   }
 
-  // Process HTML/JS files
+  // Process HTML/JS files, reusing one HTML parser and document for all pages
+  css_scanner_t *scanner = css_scanner_create();
   for (int i = 0; i < args.html_file_count; i++) {
     const char *fname = args.html_files[i];
     size_t len = 0;
@@ -52,34 +249,32 @@ int main(int argc, const char **argv) {
     if (has_extension(fname, "html") || has_extension(fname, "htm")) {
       if (args.verbose)
         printf("Scanning HTML: %s\n", fname);
-      scan_html(content, len, used_classes, used_tags, used_attrs);
+      scan_html_usage_ctx(scanner, content, len, usage);
     } else if (has_extension(fname, "js") || has_extension(fname, "jsx") ||
                has_extension(fname, "ts")) {
       if (args.verbose)
         printf("Scanning JS: %s\n", fname);
-      scan_js(content, len, used_classes);
+      scan_js_usage(content, len, usage);
     } else {
       if (args.verbose)
         printf("Scanning unknown file type as HTML: %s\n", fname);
-      scan_html(content, len, used_classes, used_tags, used_attrs);
+      scan_html_usage_ctx(scanner, content, len, usage);
     }
 
     free(content);
   }
 
+  css_scanner_destroy(scanner);
+
+  if (args.prefilter && !css_usage_enable_prefilter(usage, 0)) {
+    fprintf(stderr, "Warning: Could not build the usage prefilter\n");
+  }
+
   if (args.verbose) {
-    printf("Found %zu used classes:\n", string_list_count(used_classes));
-    for (size_t i = 0; i < string_list_count(used_classes); i++) {
-      printf("  - %s\n", string_list_get(used_classes, i));
-    }
-    printf("Found %zu used tags:\n", string_list_count(used_tags));
-    for (size_t i = 0; i < string_list_count(used_tags); i++) {
-      printf("  - %s\n", string_list_get(used_tags, i));
-    }
-    printf("Collected %zu unique attributes:\n", string_list_count(used_attrs));
-    for (size_t i = 0; i < string_list_count(used_attrs); i++) {
-      printf("  - %s\n", string_list_get(used_attrs, i));
-    }
+    print_usage_kind(usage, CSS_USAGE_CLASS, "Found %zu used classes:\n");
+    print_usage_kind(usage, CSS_USAGE_TAG, "Found %zu used tags:\n");
+    print_usage_kind(usage, CSS_USAGE_ATTR,
+                     "Collected %zu unique attributes:\n");
   }
 
   // Determine reduction mode
@@ -97,57 +292,128 @@ int main(int argc, const char **argv) {
     }
   }
 
-  // Process CSS files
-  bool success = true;
-  for (int i = 0; i < args.css_file_count; i++) {
+  size_t max_memory = 0;
+  if (args.max_memory) {
+    max_memory = parse_size(args.max_memory);
+    if (max_memory == 0)
+      fprintf(stderr, "Warning: Invalid --max-memory '%s'. Ignoring it.\n",
+              args.max_memory);
+    else if (args.region)
+      fprintf(stderr, "Warning: --region keeps every window's parser memory "
+                      "until exit.\n");
+  }
+  if (args.threads > 1 && max_memory)
+    fprintf(stderr, "Warning: --threads is ignored with --max-memory.\n");
+  if (args.splice && (args.threads > 1 || max_memory))
+    fprintf(stderr,
+            "Warning: --threads and --max-memory are ignored with --splice.\n");
+
+  // Process CSS files, reusing one parser and scratch arena for all of them
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  bool success = ctx != NULL;
+  if (!ctx)
+    fprintf(stderr, "Error: Failed to initialize the optimizer\n");
+  for (int i = 0; ctx && i < args.css_file_count; i++) {
     const char *fname = args.css_files[i];
     if (args.verbose)
       printf("Processing CSS: %s\n", fname);
 
-    size_t len = 0;
-    char *content = read_file(fname, &len);
-    if (content) {
-      // Pass used classes, tags, and attributes to the optimizer
-      OptimizerConfig config = {
-          .used_classes = string_list_items(used_classes),
-          .class_count = string_list_count(used_classes),
-          .used_tags = string_list_items(used_tags),
-          .tag_count = string_list_count(used_tags),
-          .used_attrs = string_list_items(used_attrs),
-          .attr_count = string_list_count(used_attrs),
-          .mode = mode,
-          .remove_unused_keyframes = true,
-          .remove_form_pseudoelements =
-              (string_list_count(used_tags) > 0) // Only if we have tag info
-      };
-
-      char *optimized = css_optimize(content, len, &config);
-      if (optimized) {
-        if (args.output_file) {
-          if (!write_file(args.output_file, optimized)) {
-            fprintf(stderr, "Error: Could not write output file %s: %s\n",
-                    args.output_file, strerror(errno));
-            success = false;
-          }
-        } else {
-          printf("%s\n", optimized);
-        }
-        free(optimized);
-      } else {
-        fprintf(stderr, "Error optimizing CSS file: %s\n", fname);
+    // Pass used classes, tags, and attributes to the optimizer
+    css_optimize_stats_t stats = {0};
+    OptimizerConfig config = {
+        .usage = usage,
+        .mode = mode,
+        .remove_unused_keyframes = true,
+        // Only if we have tag info
+        .remove_form_pseudoelements =
+            (css_usage_count(usage, CSS_USAGE_TAG) > 0),
+        .lazy_parse = args.lazy,
+        .prefilter_rules = args.prefilter_rules,
+        // Standard input is read in batches, each serialized on the threads
+        .serialize_threads = args.threads > 1 ? (unsigned)args.threads : 0,
+        .stats = &stats};
+
+    // "-" streams standard input, which cannot be mapped for windows
+    bool from_stdin = strcmp(fname, "-") == 0;
+    if (args.splice && !from_stdin) {
+      if (!optimize_spliced(ctx, fname, args.output_file, &config))
+        success = false;
+      if (args.verbose)
+        printf("Scratch memory peak: %zu bytes\n", stats.scratch_peak);
+      continue;
+    }
+
+    if (max_memory && !from_stdin) {
+      if (!optimize_windowed(ctx, fname, args.output_file, max_memory,
+                             &config))
         success = false;
+      if (args.verbose)
+        printf("Scratch memory peak: %zu bytes\n", stats.scratch_peak);
+      continue;
+    }
+
+    if (!from_stdin && args.threads <= 1) {
+      if (!optimize_to_output(ctx, fname, args.output_file, &config))
+        success = false;
+      if (args.verbose)
+        printf("Scratch memory peak: %zu bytes\n", stats.scratch_peak);
+      continue;
+    }
+
+    char *optimized;
+    if (from_stdin) {
+      int fd = STDIN_FILENO;
+      optimized = css_optimize_stream(ctx, read_from_fd, &fd, &config);
+    } else {
+      size_t len = 0;
+      char *content = read_file(fname, &len);
+      if (!content) {
+        fprintf(stderr, "Error: Could not read CSS file %s: %s\n", fname,
+                strerror(errno));
+        success = false;
+        continue;
       }
+      optimized = css_optimize_parallel(content, len, &config,
+                                        (unsigned)args.threads);
       free(content);
+    }
+
+    if (args.verbose)
+      printf("Scratch memory peak: %zu bytes\n", stats.scratch_peak);
+    if (optimized) {
+      if (args.output_file) {
+        if (!write_file(args.output_file, optimized)) {
+          fprintf(stderr, "Error: Could not write output file %s: %s\n",
+                  args.output_file, strerror(errno));
+          success = false;
+        }
+      } else {
+        printf("%s\n", optimized);
+      }
+      free(optimized);
     } else {
-      fprintf(stderr, "Error: Could not read CSS file %s: %s\n", fname,
-              strerror(errno));
+      fprintf(stderr, "Error optimizing CSS file: %s\n", fname);
       success = false;
     }
   }
 
-  string_list_destroy(used_classes);
-  string_list_destroy(used_tags);
-  string_list_destroy(used_attrs);
+  css_optimizer_ctx_destroy(ctx);
+
+  css_usage_prefilter_stats_t stats;
+  if (args.verbose && css_usage_prefilter_stats(usage, &stats)) {
+    printf("Prefilter (%zu bytes): %llu lookups, %llu rejected, "
+           "%llu false positives\n",
+           stats.bytes, (unsigned long long)stats.lookups,
+           (unsigned long long)stats.rejected,
+           (unsigned long long)stats.false_positives);
+  }
+
+  css_usage_destroy(usage);
+
+  if (args.verbose && job)
+    print_memory_stats(job);
+  css_mem_job_enter(NULL);
+  css_mem_job_destroy(job);
 
   return success ? 0 : 1;
 }
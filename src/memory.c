@@ -0,0 +1,226 @@
+#include "cssoptim/memory.h"
+#include "cssoptim/arena.h"
+#include <lexbor/core/lexbor.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lexbor allocator hooks.
+ * Every block carries a small header recording its size, the job and phase
+ * it was allocated in and whether it lives in a region, so frees are
+ * accounted where the block was counted and region blocks skipped. The
+ * current job and phase are per thread; a job entered on several threads is
+ * counted with atomic updates and its region is locked.
+ */
+#define REGION_BLOCK (1024 * 1024)
+
+typedef struct {
+  css_mem_job_t *job; // counted in, or NULL
+  size_t size;
+  uint32_t phase;
+  uint32_t in_region;
+} mem_header_t;
+
+// Keeps the payload as aligned as malloc's
+#define HEADER_SIZE ((sizeof(mem_header_t) + 15) & ~(size_t)15)
+
+struct css_mem_job {
+  css_mem_stats_t stats;
+  size_t live_total;
+  size_t limit;
+  bool region;
+  pthread_mutex_t region_lock; // guards arena
+  arena_t arena;
+};
+
+static __thread css_mem_job_t *current_job = NULL;
+static __thread css_mem_phase_t current_phase = CSS_MEM_PHASE_OTHER;
+static bool installed = false;
+
+static mem_header_t *header_of(void *ptr) {
+  return (mem_header_t *)((char *)ptr - HEADER_SIZE);
+}
+
+// Raises *peak to value unless another thread raised it further
+static void raise_peak(size_t *peak, size_t value) {
+  size_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > seen &&
+         !__atomic_compare_exchange_n(peak, &seen, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// Whether `size` more bytes, after `released` are given back, stay within
+// the job's limit. Threads allocating at once may each pass the check, so
+// the limit can be overshot by one allocation per thread.
+static bool within_limit(const css_mem_job_t *job, size_t size,
+                         size_t released) {
+  return !job || !job->limit ||
+         __atomic_load_n(&job->live_total, __ATOMIC_RELAXED) - released +
+                 size <=
+             job->limit;
+}
+
+// Counts a block once it is allocated, so a failed allocation leaves the
+// figures alone
+static void account_alloc(css_mem_job_t *job, css_mem_phase_t phase,
+                          size_t size) {
+  if (!job)
+    return;
+
+  css_mem_stats_t *stats = &job->stats;
+  raise_peak(&stats->peak[phase],
+             __atomic_add_fetch(&stats->live[phase], size, __ATOMIC_RELAXED));
+  __atomic_add_fetch(&stats->total[phase], size, __ATOMIC_RELAXED);
+  raise_peak(&stats->peak_live,
+             __atomic_add_fetch(&job->live_total, size, __ATOMIC_RELAXED));
+}
+
+static void account_free(css_mem_job_t *job, css_mem_phase_t phase,
+                         size_t size) {
+  if (!job)
+    return;
+  __atomic_sub_fetch(&job->stats.live[phase], size, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&job->live_total, size, __ATOMIC_RELAXED);
+}
+
+static void *mem_malloc(size_t size) {
+  css_mem_job_t *job = current_job;
+  if (size > SIZE_MAX - HEADER_SIZE || !within_limit(job, size, 0))
+    return NULL;
+
+  mem_header_t *header;
+  if (job && job->region) {
+    pthread_mutex_lock(&job->region_lock);
+    header = arena_alloc(&job->arena, HEADER_SIZE + size);
+    __atomic_store_n(&job->stats.region_reserved, job->arena.reserved,
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&job->region_lock);
+  } else {
+    header = malloc(HEADER_SIZE + size);
+  }
+  if (!header)
+    return NULL;
+  account_alloc(job, current_phase, size);
+
+  header->job = job;
+  header->size = size;
+  header->phase = current_phase;
+  header->in_region = job && job->region;
+  return (char *)header + HEADER_SIZE;
+}
+
+static void *mem_calloc(size_t num, size_t size) {
+  if (size && num > SIZE_MAX / size)
+    return NULL;
+  void *ptr = mem_malloc(num * size);
+  if (ptr)
+    memset(ptr, 0, num * size);
+  return ptr;
+}
+
+static void mem_free(void *ptr) {
+  if (!ptr)
+    return;
+  mem_header_t *header = header_of(ptr);
+  account_free(header->job, (css_mem_phase_t)header->phase, header->size);
+  // Region blocks go away with their job
+  if (!header->in_region)
+    free(header);
+}
+
+static void *mem_realloc(void *ptr, size_t size) {
+  if (!ptr)
+    return mem_malloc(size);
+  if (size == 0) {
+    mem_free(ptr);
+    return NULL;
+  }
+
+  mem_header_t *header = header_of(ptr);
+  if (header->in_region) {
+    // Regions never move blocks; copy into a fresh one
+    void *copy = mem_malloc(size);
+    if (!copy)
+      return NULL;
+    memcpy(copy, ptr, header->size < size ? header->size : size);
+    mem_free(ptr);
+    return copy;
+  }
+
+  // The block stays with the job and phase it was allocated in
+  css_mem_job_t *job = header->job;
+  css_mem_phase_t phase = (css_mem_phase_t)header->phase;
+  size_t old_size = header->size;
+  if (size > SIZE_MAX - HEADER_SIZE || !within_limit(job, size, old_size))
+    return NULL;
+
+  mem_header_t *grown = realloc(header, HEADER_SIZE + size);
+  if (!grown)
+    return NULL;
+  account_free(job, phase, old_size);
+  account_alloc(job, phase, size);
+  grown->size = size;
+  return (char *)grown + HEADER_SIZE;
+}
+
+bool css_memory_install(void) {
+  if (installed)
+    return true;
+  if (lexbor_memory_setup(mem_malloc, mem_realloc, mem_calloc, mem_free) !=
+      LXB_STATUS_OK)
+    return false;
+  installed = true;
+  return true;
+}
+
+css_mem_job_t *css_mem_job_create(bool region, size_t limit) {
+  css_mem_job_t *job = calloc(1, sizeof(css_mem_job_t));
+  if (!job)
+    return NULL;
+  if (pthread_mutex_init(&job->region_lock, NULL) != 0) {
+    free(job);
+    return NULL;
+  }
+  job->region = region;
+  job->limit = limit;
+  arena_init(&job->arena, REGION_BLOCK);
+  return job;
+}
+
+void css_mem_job_destroy(css_mem_job_t *job) {
+  if (!job)
+    return;
+  arena_release(&job->arena);
+  pthread_mutex_destroy(&job->region_lock);
+  free(job);
+}
+
+css_mem_job_t *css_mem_job_enter(css_mem_job_t *job) {
+  css_mem_job_t *previous = current_job;
+  current_job = job;
+  return previous;
+}
+
+css_mem_job_t *css_mem_job_current(void) { return current_job; }
+
+css_mem_phase_t css_mem_phase_enter(css_mem_phase_t phase) {
+  css_mem_phase_t previous = current_phase;
+  current_phase = phase;
+  return previous;
+}
+
+void css_mem_job_stats(const css_mem_job_t *job, css_mem_stats_t *stats) {
+  if (!job || !stats)
+    return;
+  const css_mem_stats_t *from = &job->stats;
+  for (int p = 0; p < CSS_MEM_PHASE_COUNT; p++) {
+    stats->live[p] = __atomic_load_n(&from->live[p], __ATOMIC_RELAXED);
+    stats->peak[p] = __atomic_load_n(&from->peak[p], __ATOMIC_RELAXED);
+    stats->total[p] = __atomic_load_n(&from->total[p], __ATOMIC_RELAXED);
+  }
+  stats->peak_live = __atomic_load_n(&from->peak_live, __ATOMIC_RELAXED);
+  stats->region_reserved =
+      __atomic_load_n(&from->region_reserved, __ATOMIC_RELAXED);
+}
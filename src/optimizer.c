@@ -1,402 +1,676 @@
 #include "cssoptim/optimizer.h"
+#include "cssoptim/arena.h"
+#include "cssoptim/memory.h"
 #include <ctype.h>
 #include <lexbor/core/serialize.h>
 #include <lexbor/css/at_rule.h>
 #include <lexbor/css/css.h>
 #include <lexbor/css/parser.h>
+#include <lexbor/css/property.h>
 #include <lexbor/css/rule.h>
 #include <lexbor/css/selectors/selector.h>
+#include <lexbor/css/selectors/selectors.h>
 #include <lexbor/css/stylesheet.h>
+#include <lexbor/tag/const.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
-// --- Garbage Collection for Block Strings ---
-typedef struct garbage_node {
-  char *ptr;
-  struct garbage_node *next;
-} garbage_node_t;
+// Form pseudo-elements, their required attributes/tags and vendor prefixes
+// come from src/pseudo_table.def via a generated perfect hash (needs the
+// LXB_TAG_* constants above).
+#include "pseudo_phash.h"
 
-static garbage_node_t *garbage_head = NULL;
+// References between custom properties, keyframes and the rules that
+// survive the selector filter.
+#include "dep_graph.h"
 
-static void register_garbage(char *ptr) {
-  if (!ptr)
-    return;
-  garbage_node_t *node = malloc(sizeof(garbage_node_t));
-  if (node) {
-    node->ptr = ptr;
-    node->next = garbage_head;
-    garbage_head = node;
+// Style rule selectors compiled to flat bytecode for the selector filter
+#include "selector_program.h"
+
+// Top-level rule boundaries for css_optimize_windowed()
+#include "rule_split.h"
+
+// Byte-level verdicts on simple selectors for config->prefilter_rules
+#include "simple_selector.h"
+
+// Output assembled from input ranges for css_optimize_splice()
+#include "splice.h"
+
+// Parse tree plus output per input byte, used to size windows from a memory
+// budget
+#define WINDOW_EXPANSION 8
+
+// Upper bound on the threads of css_optimize_parallel() and on
+// config->serialize_threads
+#define MAX_THREADS 64
+
+// Estimated serialized bytes below which config->serialize_threads does not
+// start another thread
+#define SERIALIZE_CHUNK_MIN 65536
+
+// --- Optimizer Context ---
+// Everything a run needs besides its input, so separate contexts can be used
+// from separate threads. The parser is cleaned and reused for every
+// stylesheet and nested block, which all allocate from the one lexbor memory
+// pool; the pool and the scratch arena are emptied after each run but keep
+// their blocks.
+// Nested at-rule blocks are parsed once per run and kept, keyed by their
+// at-rule, in an open-addressing table (power-of-two size).
+typedef struct {
+  const lxb_css_at_rule__undef_t *undef;
+  lxb_css_stylesheet_t *stylesheet;
+} nested_entry_t;
+
+struct css_optimizer_ctx {
+  lxb_css_parser_t *parser;
+  lxb_css_memory_t *memory;
+  arena_t arena;
+
+  nested_entry_t *nested;
+  size_t nested_mask;
+  size_t nested_count;
+};
+
+// --- Per-Run State ---
+// One css_optimize_ctx call. Every temporary string, and the nested blocks
+// re-serialized after the walk, come from the context arena, which is reset in one
+// go once the output has been built.
+typedef struct {
+  OptimizerConfig *config;
+  css_optimizer_ctx_t *ctx;
+  arena_t *arena;
+  size_t edits; // lists the walk or the lazy parse cut rules from
+} optim_run_t;
+
+// Creates the context's parser and memory pool on first use.
+static bool ctx_prepare(css_optimizer_ctx_t *ctx) {
+  if (!ctx->parser) {
+    ctx->parser = lxb_css_parser_create();
+    if (ctx->parser && lxb_css_parser_init(ctx->parser, NULL) != LXB_STATUS_OK)
+      ctx->parser = lxb_css_parser_destroy(ctx->parser, true);
+  }
+  if (!ctx->memory) {
+    ctx->memory = lxb_css_memory_create();
+    if (ctx->memory && lxb_css_memory_init(ctx->memory, 128) != LXB_STATUS_OK)
+      ctx->memory = lxb_css_memory_destroy(ctx->memory, true);
   }
+  return ctx->parser && ctx->memory;
 }
 
-static void clear_garbage() {
-  garbage_node_t *node = garbage_head;
-  while (node) {
-    garbage_node_t *next = node->next;
-    if (node->ptr)
-      free(node->ptr);
-    free(node);
-    node = next;
+// Parses CSS with the context's parser into its memory pool. Stylesheets are
+// released with lxb_css_stylesheet_destroy(stylesheet, false); the pool
+// itself is emptied by end_run().
+static lxb_css_stylesheet_t *parse_stylesheet(css_optimizer_ctx_t *ctx,
+                                              const lxb_char_t *data,
+                                              size_t length,
+                                              css_mem_phase_t phase) {
+  css_mem_phase_t previous = css_mem_phase_enter(phase);
+  lxb_css_stylesheet_t *stylesheet = NULL;
+  if (ctx_prepare(ctx)) {
+    lxb_css_parser_clean(ctx->parser);
+    lxb_css_parser_memory_set(ctx->parser, ctx->memory);
+    stylesheet = lxb_css_stylesheet_parse(ctx->parser, data, length);
+    // The parser never holds on to the pool between parses
+    lxb_css_parser_memory_set(ctx->parser, NULL);
   }
-  garbage_head = NULL;
+  css_mem_phase_enter(previous);
+  return stylesheet;
 }
 
-// --- Dependency List ---
-#define MAX_DEPS 1024
-typedef struct {
-  char *items[MAX_DEPS];
-  size_t count;
-} dep_list_t;
+// Empties the memory pool and scratch arena once nothing parsed in the run
+// (or window) is referenced any more.
+static void end_run(css_optimizer_ctx_t *ctx) {
+  if (ctx->nested_count) {
+    memset(ctx->nested, 0, (ctx->nested_mask + 1) * sizeof(nested_entry_t));
+    ctx->nested_count = 0;
+  }
+  if (ctx->memory)
+    lxb_css_memory_clean(ctx->memory);
+  arena_reset(&ctx->arena);
+}
 
-static void add_dep(dep_list_t *list, const char *name, size_t len) {
-  if (list->count >= MAX_DEPS)
-    return;
-  for (size_t i = 0; i < list->count; i++) {
-    if (strncmp(list->items[i], name, len) == 0 &&
-        list->items[i][len] == '\0') {
-      return;
-    }
+static lxb_css_stylesheet_t *parse_rules(optim_run_t *run,
+                                         const lxb_char_t *data, size_t length,
+                                         css_mem_phase_t phase);
+
+// Growable string in a run arena, filled by lexbor serializers
+typedef struct {
+  arena_t *arena;
+  char *data;
+  size_t len;
+  size_t cap;
+} scratch_str_t;
+
+static lxb_status_t scratch_serializer_cb(const lxb_char_t *data, size_t len,
+                                          void *ctx) {
+  scratch_str_t *str = (scratch_str_t *)ctx;
+  if (str->len + len + 1 > str->cap) {
+    size_t cap = str->cap ? str->cap * 2 : 64;
+    while (cap < str->len + len + 1)
+      cap *= 2;
+    char *grown = arena_alloc(str->arena, cap);
+    if (!grown)
+      return LXB_STATUS_ERROR;
+    if (str->len)
+      memcpy(grown, str->data, str->len);
+    str->data = grown;
+    str->cap = cap;
   }
-  char *copy = malloc(len + 1);
-  if (!copy)
-    return;
-  memcpy(copy, name, len);
-  copy[len] = '\0';
-  list->items[list->count++] = copy;
+  memcpy(str->data + str->len, data, len);
+  str->len += len;
+  str->data[str->len] = '\0';
+  return LXB_STATUS_OK;
 }
 
-static void free_deps(dep_list_t *list) {
-  for (size_t i = 0; i < list->count; i++) {
-    free(list->items[i]);
+// --- Output Buffer ---
+// Optimized text as it is serialized. The length is tracked and the capacity
+// doubles, so building the output is linear in its size. After a failed
+// append the buffer keeps what it had and only reports the failure.
+// With a sink, the text is passed on whenever OUT_SINK_SIZE bytes are
+// buffered, except for the bytes from `hold` on, which stay until released.
+typedef struct {
+  char *data; // NUL-terminated once anything was appended
+  size_t len;
+  size_t cap;
+  bool failed;
+
+  css_write_cb_t write; // NULL to keep the whole text
+  void *user;
+  size_t flushed; // bytes already passed to the sink
+  size_t hold;
+  bool holding;
+} out_buf_t;
+
+// Bytes buffered before they are passed to a sink
+#define OUT_SINK_SIZE 65536
+
+// Passes the buffered text before any held bytes to the sink
+static bool out_buf_flush(out_buf_t *buf) {
+  size_t count = buf->holding ? buf->hold : buf->len;
+  if (buf->failed || !buf->write || count == 0)
+    return !buf->failed;
+  if (!buf->write(buf->data, count, buf->user)) {
+    buf->failed = true;
+    return false;
   }
-  list->count = 0;
+  memmove(buf->data, buf->data + count, buf->len - count + 1);
+  buf->len -= count;
+  buf->flushed += count;
+  if (buf->holding)
+    buf->hold = 0;
+  return true;
 }
 
-static bool is_dep_used(const dep_list_t *list, const char *name, size_t len) {
-  for (size_t i = 0; i < list->count; i++) {
-    if (strncmp(list->items[i], name, len) == 0 &&
-        list->items[i][len] == '\0') {
-      return true;
+static bool out_buf_append(out_buf_t *buf, const char *data, size_t len) {
+  if (buf->failed)
+    return false;
+  if (buf->write && buf->len + len > OUT_SINK_SIZE && !out_buf_flush(buf))
+    return false;
+  if (buf->len + len + 1 > buf->cap) {
+    size_t cap = buf->cap ? buf->cap * 2 : 4096;
+    while (cap < buf->len + len + 1)
+      cap *= 2;
+    char *grown = realloc(buf->data, cap);
+    if (!grown) {
+      buf->failed = true;
+      return false;
     }
+    buf->data = grown;
+    buf->cap = cap;
   }
-  return false;
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+  return true;
 }
 
-// --- Serializer Callback ---
-static lxb_status_t string_serializer_cb(const lxb_char_t *data, size_t len,
-                                         void *ctx) {
-  char **buffer = (char **)ctx;
-  size_t current_len = *buffer ? strlen(*buffer) : 0;
-  char *new_buf = realloc(*buffer, current_len + len + 1);
-  if (!new_buf)
-    return LXB_STATUS_ERROR;
-  *buffer = new_buf;
-  memcpy(*buffer + current_len, data, len);
-  (*buffer)[current_len + len] = '\0';
-  return LXB_STATUS_OK;
+static lxb_status_t out_buf_serializer_cb(const lxb_char_t *data, size_t len,
+                                          void *ctx) {
+  return out_buf_append(ctx, (const char *)data, len) ? LXB_STATUS_OK
+                                                       : LXB_STATUS_ERROR;
 }
 
-// --- Nested Processing Helper ---
-typedef void (*nested_cb_t)(lxb_css_rule_t *root, void *ctx);
+// Appends text serialized elsewhere. With a sink, the buffered text is
+// passed on first and the piece is written as it is, without a copy.
+static bool out_buf_put(out_buf_t *buf, const char *data, size_t len) {
+  if (!buf->write || buf->holding)
+    return out_buf_append(buf, data, len);
+  if (!out_buf_flush(buf))
+    return false;
+  if (len > 0 && !buf->write(data, len, buf->user)) {
+    buf->failed = true;
+    return false;
+  }
+  buf->flushed += len;
+  return true;
+}
 
-static void process_nested_block(lxb_css_at_rule__undef_t *undef,
-                                 nested_cb_t cb, void *ctx) {
-  if (!undef || !undef->block.data)
-    return;
+// Bytes of output so far, passed on or not
+static size_t out_buf_size(const out_buf_t *buf) {
+  return buf->flushed + buf->len;
+}
 
-  lxb_css_parser_t *parser = lxb_css_parser_create();
-  lxb_css_parser_init(parser, NULL);
-  lxb_css_stylesheet_t *ss =
-      lxb_css_stylesheet_parse(parser, undef->block.data, undef->block.length);
+// Hands over the text built (empty if nothing was appended), or frees it and
+// returns NULL if an append failed.
+static char *out_buf_finish(out_buf_t *buf) {
+  char *data = buf->data;
+  bool failed = buf->failed;
+  *buf = (out_buf_t){0};
+  if (failed) {
+    free(data);
+    return NULL;
+  }
+  return data ? data : calloc(1, 1);
+}
 
-  if (ss && ss->root) {
-    cb(ss->root, ctx);
+// Passes what is left to the sink and frees the buffer. Returns false if an
+// append or write failed.
+static bool out_buf_close(out_buf_t *buf) {
+  buf->holding = false;
+  bool ok = out_buf_flush(buf);
+  free(buf->data);
+  *buf = (out_buf_t){0};
+  return ok;
+}
 
-    char *new_block = NULL;
-    lxb_css_rule_serialize(ss->root, string_serializer_cb, &new_block);
+// --- Nested Blocks ---
+static size_t nested_hash(const lxb_css_at_rule__undef_t *undef) {
+  uint64_t h = (uint64_t)(uintptr_t)undef * 0x9E3779B97F4A7C15ull;
+  return (size_t)(h >> 32);
+}
 
-    if (new_block) {
-      undef->block.data = (lxb_char_t *)new_block;
-      undef->block.length = strlen(new_block);
-      register_garbage(new_block);
-    } else {
-      undef->block.data = (lxb_char_t *)"";
-      undef->block.length = 0;
-    }
-    lxb_css_stylesheet_destroy(ss, true);
+// Returns the entry for an at-rule, or the empty one where it would go.
+static nested_entry_t *nested_find(const css_optimizer_ctx_t *ctx,
+                                   const lxb_css_at_rule__undef_t *undef) {
+  size_t i = nested_hash(undef) & ctx->nested_mask;
+  while (ctx->nested[i].undef && ctx->nested[i].undef != undef)
+    i = (i + 1) & ctx->nested_mask;
+  return &ctx->nested[i];
+}
+
+static bool nested_grow(css_optimizer_ctx_t *ctx) {
+  size_t old_size = ctx->nested ? ctx->nested_mask + 1 : 0;
+  size_t new_size = old_size ? old_size * 2 : 64;
+  nested_entry_t *old = ctx->nested;
+  nested_entry_t *entries = calloc(new_size, sizeof(nested_entry_t));
+  if (!entries)
+    return false;
+
+  ctx->nested = entries;
+  ctx->nested_mask = new_size - 1;
+  for (size_t i = 0; i < old_size; i++) {
+    if (old[i].undef)
+      *nested_find(ctx, old[i].undef) = old[i];
   }
-  lxb_css_parser_destroy(parser, true);
+  free(old);
+  return true;
 }
 
-// --- Forward Declarations ---
-// --- Forward Declarations ---
-static void pass1_filter_rules(lxb_css_rule_t *rule, OptimizerConfig *config);
-static void pass2_collect_deps(lxb_css_rule_t *rule, dep_list_t *vars,
-                               dep_list_t *anims);
-static bool pass3_refine_rules(lxb_css_rule_t *rule, dep_list_t *used_vars,
-                               dep_list_t *used_anims, OptimizerConfig *config);
+// Returns the parsed rules of a nested block, parsing it on first use. They
+// live in the context memory pool until the end of the run; the walk edits
+// them in place and flush_nested_blocks() writes them back before output.
+static lxb_css_rule_t *nested_root(optim_run_t *run,
+                                   lxb_css_at_rule__undef_t *undef) {
+  css_optimizer_ctx_t *ctx = run->ctx;
+  if (ctx->nested) {
+    nested_entry_t *entry = nested_find(ctx, undef);
+    if (entry->undef)
+      return entry->stylesheet->root;
+  }
 
-// --- Wrappers and Helpers ---
+  lxb_css_stylesheet_t *ss = parse_rules(run, undef->block.data,
+                                         undef->block.length,
+                                         CSS_MEM_PHASE_NESTED);
+  if (!ss || !ss->root)
+    return NULL;
 
-// Pass 1 Wrapper
-struct pass1_ctx {
-  OptimizerConfig *config;
-};
-static void pass1_cb(lxb_css_rule_t *root, void *ctx) {
-  struct pass1_ctx *p1 = (struct pass1_ctx *)ctx;
-  pass1_filter_rules(root, p1->config);
+  // Keep the table at most half full
+  if ((!ctx->nested || (ctx->nested_count + 1) * 2 > ctx->nested_mask + 1) &&
+      !nested_grow(ctx))
+    return NULL;
+  nested_entry_t *entry = nested_find(ctx, undef);
+  entry->undef = undef;
+  entry->stylesheet = ss;
+  ctx->nested_count++;
+  return ss->root;
 }
 
-// Pass 2 Wrapper
-struct pass2_ctx {
-  dep_list_t *vars;
-  dep_list_t *anims;
-};
-static void pass2_cb(lxb_css_rule_t *root, void *ctx) {
-  struct pass2_ctx *p2 = (struct pass2_ctx *)ctx;
-  pass2_collect_deps(root, p2->vars, p2->anims);
+// Unlinks a rule from its list and destroys it. At-rules are only unlinked:
+// their memory goes back with the pool at the end of the run, so no other
+// at-rule can take over an address keyed in the nested table meanwhile.
+static void remove_rule(lxb_css_rule_list_t *list, lxb_css_rule_t *rule) {
+  if (rule->prev)
+    rule->prev->next = rule->next;
+  else
+    list->first = rule->next;
+
+  if (rule->next)
+    rule->next->prev = rule->prev;
+  else
+    list->last = rule->prev;
+
+  if (rule->type != LXB_CSS_RULE_AT_RULE)
+    lxb_css_rule_destroy(rule, true);
 }
 
-// Pass 3 Wrapper
-struct pass3_ctx {
-  dep_list_t *vars;
-  dep_list_t *anims;
-  OptimizerConfig *config;
-};
-static void pass3_cb(lxb_css_rule_t *root, void *ctx) {
-  struct pass3_ctx *p3 = (struct pass3_ctx *)ctx;
-  pass3_refine_rules(root, p3->vars, p3->anims, p3->config);
+// Serializes the nested blocks still in the tree back into their at-rules,
+// innermost first, ready for the final serialization.
+static void flush_nested_blocks(optim_run_t *run, lxb_css_rule_t *rule) {
+  if (!rule || !run->ctx->nested_count)
+    return;
+
+  if (rule->type == LXB_CSS_RULE_LIST) {
+    for (lxb_css_rule_t *child = lxb_css_rule_list(rule)->first; child;
+         child = child->next)
+      flush_nested_blocks(run, child);
+  } else if (rule->type == LXB_CSS_RULE_AT_RULE) {
+    lxb_css_rule_at_t *at = (lxb_css_rule_at_t *)rule;
+    if (at->type != LXB_CSS_AT_RULE__UNDEF)
+      return;
+    nested_entry_t *entry = nested_find(run->ctx, at->u.undef);
+    if (!entry->undef)
+      return;
+
+    lxb_css_rule_t *root = entry->stylesheet->root;
+    flush_nested_blocks(run, root);
+
+    scratch_str_t block = {.arena = run->arena};
+    lxb_css_rule_serialize(root, scratch_serializer_cb, &block);
+    at->u.undef->block.data = (lxb_char_t *)(block.data ? block.data : "");
+    at->u.undef->block.length = block.len;
+  }
 }
 
 // Helper: Check if class is used
 static bool is_class_used(const char *class_name, size_t len,
-                          const char **used_classes, size_t class_count) {
-  if (!used_classes || class_count == 0)
-    return false;
-  for (size_t i = 0; i < class_count; i++) {
-    if (strncmp(class_name, used_classes[i], len) == 0 &&
-        used_classes[i][len] == '\0') {
-      return true;
-    }
-  }
-  return false;
+                          const css_usage_t *usage) {
+  return css_usage_has(usage, CSS_USAGE_CLASS, class_name, len);
 }
 
-// Helper: Check if tag is used
+// Helper: Check if tag is used. Standard tags resolve to a lexbor tag ID once
+// and are answered by a bit test; custom elements fall back to the name table.
 static bool is_tag_used(const char *tag_name, size_t len,
-                        const char **used_tags, size_t tag_count) {
-  if (!used_tags || tag_count == 0 || !tag_name)
+                        const css_usage_t *usage) {
+  if (!tag_name)
     return false;
+  uintptr_t tag_id = css_usage_tag_id(usage, tag_name, len);
+  if (tag_id != LXB_TAG__UNDEF)
+    return css_usage_has_tag_id(usage, tag_id);
+  return css_usage_has(usage, CSS_USAGE_TAG, tag_name, len);
+}
 
-  for (size_t i = 0; i < tag_count; i++) {
-    if (strncasecmp(tag_name, used_tags[i], len) == 0 &&
-        used_tags[i][len] == '\0') {
-      return true;
-    }
+static bool check_form_pseudo_removal(const char *name, size_t len,
+                                      OptimizerConfig *config) {
+  if (!config->remove_form_pseudoelements)
+    return false;
+
+  // Raw selector text still carries the "::" prefix
+  if (len >= 2 && name[0] == ':' && name[1] == ':') {
+    name += 2;
+    len -= 2;
   }
-  return false;
-}
 
-// Helper: Check if attribute is used
-static bool is_attr_used(lxb_css_selector_t *sel, const char **used_attrs,
-                         size_t attr_count) {
-  if (!used_attrs || attr_count == 0 || !sel->name.data)
+  const pseudo_phash_entry_t *entry = pseudo_phash_lookup(name, len);
+  if (!entry || entry->kind != PSEUDO_KIND_FORM)
     return false;
 
-  // Check attribute name + value if present
-  char *match = NULL;
-  if (sel->u.attribute.value.data) {
-    size_t nlen = sel->name.length;
-    size_t vlen = sel->u.attribute.value.length;
-    match = malloc(nlen + vlen + 2);
-    if (match) {
-      memcpy(match, sel->name.data, nlen);
-      match[nlen] = '=';
-      memcpy(match + nlen + 1, sel->u.attribute.value.data, vlen);
-      match[nlen + 1 + vlen] = '\0';
+  // Keep it if any required attribute or tag is used, remove it otherwise
+  const char *const *attrs = pseudo_rule_attrs[entry->rule];
+  for (size_t k = 0; attrs[k]; k++) {
+    if (css_usage_has(config->usage, CSS_USAGE_ATTR, attrs[k],
+                      strlen(attrs[k]))) {
+      return false;
     }
-  } else {
-    match = malloc(sel->name.length + 1);
-    if (match) {
-      memcpy(match, sel->name.data, sel->name.length);
-      match[sel->name.length] = '\0';
+  }
+
+  const lxb_tag_id_t *tags = pseudo_rule_tags[entry->rule];
+  for (size_t k = 0; tags[k] != LXB_TAG__UNDEF; k++) {
+    if (css_usage_has_tag_id(config->usage, tags[k])) {
+      return false;
     }
   }
 
-  if (!match)
-    return false;
+  return true; // Remove because context missing
+}
 
-  bool found = false;
+// Helper: Check whether a pseudo-element (name without "::") is dropped
+static bool is_pseudo_element_dropped(const char *name, size_t len,
+                                      OptimizerConfig *config) {
+  return check_form_pseudo_removal(name, len, config);
+}
+
+// Binds the usage set to a compiled selector program: every name and
+// attribute test is checked once, however many selectors share it.
+static void bind_selector_program(selector_program_t *program,
+                                  OptimizerConfig *config) {
+  const symtab_t *symbols = selector_program_symbols(program);
+  bool tags_known = css_usage_count(config->usage, CSS_USAGE_TAG) > 0;
+
+  for (symbol_id_t id = 0; id < symtab_count(symbols); id++) {
+    uint8_t ops = selector_program_symbol_ops(program, id);
+    const char *name = symtab_name(symbols, id);
+    size_t len = strlen(name);
+    uint8_t fail = 0;
+
+    if ((ops & SELOP_BIT(SELOP_CLASS)) &&
+        !is_class_used(name, len, config->usage))
+      fail |= SELPROG_FAIL_CLASS;
+    if ((ops & SELOP_BIT(SELOP_TAG)) && tags_known &&
+        !is_tag_used(name, len, config->usage))
+      fail |= SELPROG_FAIL_TAG;
+    if ((ops & SELOP_BIT(SELOP_PSEUDO_ELEMENT)) &&
+        is_pseudo_element_dropped(name, len, config))
+      fail |= SELPROG_FAIL_PSEUDO;
+
+    selector_program_set_verdict(program, id, fail);
+  }
+
+  size_t attr_count = selector_program_attr_count(program);
   for (size_t i = 0; i < attr_count; i++) {
-    if (strcmp(match, used_attrs[i]) == 0) {
-      found = true;
-      break;
+    const selprog_attr_t *attr = selector_program_attr(program, i);
+    bool used = false;
+    if (attr->name != SYMBOL_NONE) {
+      const char *name = symtab_name(symbols, attr->name);
+      used = css_usage_match_attr(config->usage, name, strlen(name), attr->op,
+                                  attr->value, attr->value_len,
+                                  attr->ignore_case);
     }
+    selector_program_set_attr_verdict(program, i, !used);
   }
-  free(match);
-  return found;
 }
 
-// Helper: Check selector chain
+// Whether selectors with a universal compound are kept outright
+static bool universal_keeps(const OptimizerConfig *config) {
+  return config->mode == LXB_CSS_OPTIM_MODE_SAFE ||
+         config->mode == LXB_CSS_OPTIM_MODE_CONSERVATIVE;
+}
 
-static bool check_form_pseudo_removal(const char *name,
-                                      OptimizerConfig *config) {
-  if (!config->remove_form_pseudoelements)
-    return false;
+// Removes unused selectors, and style rules left without any, in one
+// sequential sweep over the compiled program. Returns whether it removed
+// anything.
+static bool filter_style_rules(selector_program_t *program,
+                               OptimizerConfig *config) {
+  bind_selector_program(program, config);
+  const uint8_t *keep =
+      selector_program_run(program, universal_keeps(config));
+
+  bool removed = false;
+  size_t rule_count = selector_program_rule_count(program);
+  for (size_t r = 0; r < rule_count; r++) {
+    lxb_css_rule_list_t *list;
+    size_t first, count;
+    lxb_css_rule_t *rule =
+        selector_program_rule(program, r, &list, &first, &count);
+    lxb_css_rule_style_t *style = lxb_css_rule_style(rule);
+    bool has_any_used = false;
 
-  typedef struct {
-    const char *pseudos[5];
-    const char *attrs[4];
-    const char *tags[4];
-  } pseudo_rule_t;
-
-  static const pseudo_rule_t rules[] = {
-      {// File input
-       .pseudos = {"file-selector-button", "-webkit-file-upload-button",
-                   "::file-selector-button", "::-webkit-file-upload-button",
-                   NULL},
-       .attrs = {"type=file", NULL},
-       .tags = {NULL}},
-      {// Number input
-       .pseudos = {"-webkit-inner-spin-button", "::-webkit-inner-spin-button",
-                   NULL},
-       .attrs = {"type=number", NULL},
-       .tags = {NULL}},
-      {// Date input
-       .pseudos = {"-webkit-calendar-picker-indicator",
-                   "-webkit-datetime-edit-day-field",
-                   "::-webkit-calendar-picker-indicator",
-                   "::-webkit-datetime-edit-day-field", NULL},
-       .attrs = {"type=date", "type=time", "type=datetime-local", NULL},
-       .tags = {NULL}},
-      {// Button or Input
-       .pseudos = {"::-moz-focus-inner", "-moz-focus-inner", NULL},
-       .attrs = {NULL},
-       .tags = {"button", "input", NULL}},
-      {// Search input
-       .pseudos = {"::-webkit-search-decoration", "-webkit-search-decoration",
-                   NULL},
-       .attrs = {"type=search", NULL},
-       .tags = {NULL}},
-      {// Color input
-       .pseudos = {"::-webkit-color-swatch-wrapper",
-                   "-webkit-color-swatch-wrapper", NULL},
-       .attrs = {"type=color", NULL},
-       .tags = {NULL}}};
-
-  size_t rule_count = sizeof(rules) / sizeof(rules[0]);
-
-  for (size_t i = 0; i < rule_count; i++) {
-    bool name_match = false;
-    for (size_t j = 0; rules[i].pseudos[j]; j++) {
-      if (strcasecmp(name, rules[i].pseudos[j]) == 0) {
-        name_match = true;
-        break;
+    for (size_t s = first; s < first + count; s++) {
+      if (keep[s]) {
+        has_any_used = true;
+        continue;
       }
+      removed = true;
+      lxb_css_selector_list_t *sel_list = selector_program_selector(program, s);
+      if (sel_list->prev)
+        sel_list->prev->next = sel_list->next;
+      else
+        style->selector = sel_list->next;
+      if (sel_list->next)
+        sel_list->next->prev = sel_list->prev;
+      lxb_css_selector_list_destroy(sel_list);
     }
 
-    if (name_match) {
-      // Check requirements
-      bool fulfilled = false;
-
-      // Check attributes
-      if (rules[i].attrs[0]) {
-        for (size_t k = 0; rules[i].attrs[k]; k++) {
-          for (size_t a = 0; a < config->attr_count; a++) {
-            if (strcmp(config->used_attrs[a], rules[i].attrs[k]) == 0) {
-              fulfilled = true;
-              goto check_done;
-            }
-          }
-        }
-      }
+    if (!has_any_used)
+      remove_rule(list, rule);
+  }
+  return removed;
+}
 
-      // Check tags
-      if (rules[i].tags[0]) {
-        for (size_t k = 0; rules[i].tags[k]; k++) {
-          for (size_t t = 0; t < config->tag_count; t++) {
-            if (strcasecmp(config->used_tags[t], rules[i].tags[k]) == 0) {
-              fulfilled = true;
-              goto check_done;
-            }
-          }
-        }
+// --- Lazy Parsing ---
+// With config->lazy_parse, the selectors of style rules are parsed from the
+// raw text on their own and evaluated like filter_style_rules() would. Rules
+// it would remove are cut from the text before lexbor parses it, so their
+// declaration blocks are never parsed. At-rules, statements and rules whose
+// selectors do not parse are left to the full parse.
+// With config->prefilter_rules, rules with simple selectors are decided from
+// their bytes first (see simple_selector.h), and only the rest are left to
+// the selector parser, or to the full parse without lazy_parse.
+
+static bool simple_name_used(css_usage_kind_t kind, const char *name,
+                             size_t len, void *ctx) {
+  const OptimizerConfig *config = ctx;
+  if (kind == CSS_USAGE_CLASS)
+    return is_class_used(name, len, config->usage);
+  // Tags only remove selectors once some are known, as in filter_style_rules()
+  return css_usage_count(config->usage, CSS_USAGE_TAG) == 0 ||
+         is_tag_used(name, len, config->usage);
+}
+
+// Returns the text without the rules dropped (in the run arena), or `data`
+// itself if none are.
+static const lxb_char_t *prune_unparsed_rules(optim_run_t *run,
+                                              const lxb_char_t *data,
+                                              size_t *length) {
+  css_optimizer_ctx_t *ctx = run->ctx;
+  OptimizerConfig *config = run->config;
+  const char *css = (const char *)data;
+  // Candidate rules, with a NULL selector list for those the prefilter
+  // already found unused
+  rule_span_t *spans = NULL;
+  lxb_css_selector_list_t **lists = NULL;
+  size_t count = 0;
+  size_t parsed = 0;
+  size_t capacity = 0;
+  if (config->lazy_parse && !ctx_prepare(ctx))
+    return data;
+
+  rule_span_t span;
+  for (size_t offset = 0; rule_split_span(css, *length, offset, &span);
+       offset = span.end) {
+    if (span.block == span.end || css[span.start] == '@')
+      continue;
+
+    simple_selector_verdict_t verdict =
+        config->prefilter_rules
+            ? simple_selector_match(css + span.start, span.block - span.start,
+                                    simple_name_used, config)
+            : SIMPLE_SELECTOR_UNKNOWN;
+    if (verdict == SIMPLE_SELECTOR_USED ||
+        (verdict == SIMPLE_SELECTOR_UNKNOWN && !config->lazy_parse))
+      continue;
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      rule_span_t *grown_spans = realloc(spans, capacity * sizeof(*spans));
+      if (grown_spans)
+        spans = grown_spans;
+      lxb_css_selector_list_t **grown_lists =
+          realloc(lists, capacity * sizeof(*lists));
+      if (grown_lists)
+        lists = grown_lists;
+      if (!grown_spans || !grown_lists) {
+        count = parsed = 0;
+        break;
       }
+    }
 
-    check_done:
-      if (!fulfilled)
-        return true; // Remove because context missing
-      // If fulfilled, we don't return false yet, because maybe there are other
-      // rules? No, specific pseudo matches one rule. If fulfilled, we keep it
-      // (return false).
-      return false;
+    lxb_css_selector_list_t *list = NULL;
+    if (verdict == SIMPLE_SELECTOR_UNKNOWN) {
+      // Selector lists stay in the pool until the end of the run
+      lxb_css_parser_clean(ctx->parser);
+      lxb_css_parser_memory_set(ctx->parser, ctx->memory);
+      list = lxb_css_selectors_parse(ctx->parser, data + span.start,
+                                     span.block - span.start);
+      lxb_css_parser_memory_set(ctx->parser, NULL);
+      if (!list)
+        continue;
+      parsed++;
     }
+    spans[count] = span;
+    lists[count] = list;
+    count++;
   }
 
-  return false;
-}
-
-static bool should_remove_pseudo_element(lxb_css_selector_t *sel,
-                                         OptimizerConfig *config) {
-  if (sel->name.length > 0) {
-    const char *name = (const char *)sel->name.data;
-    return check_form_pseudo_removal(name, config);
+  // Parsed selectors are evaluated in one program run. If it cannot be
+  // built, every rule is kept.
+  selector_program_t *program =
+      parsed ? selector_program_compile_lists(lists, count) : NULL;
+  const uint8_t *keep = NULL;
+  if (program) {
+    bind_selector_program(program, config);
+    keep = selector_program_run(program, universal_keeps(config));
   }
-  return false;
-}
 
-static bool should_keep_selector_node(lxb_css_selector_list_t *list,
-                                      OptimizerConfig *config) {
-  lxb_css_selector_t *sel = list->first;
-  while (sel) {
-    if (sel->type == LXB_CSS_SELECTOR_TYPE_CLASS) {
-      if (!is_class_used((const char *)sel->name.data, sel->name.length,
-                         config->used_classes, config->class_count)) {
-        return false;
-      }
-    } else if (sel->type == LXB_CSS_SELECTOR_TYPE_ELEMENT) {
-      // Check for universal selector '*'
-      if (sel->name.length == 1 && sel->name.data[0] == '*') {
-        if (config->mode == LXB_CSS_OPTIM_MODE_SAFE ||
-            config->mode == LXB_CSS_OPTIM_MODE_CONSERVATIVE) {
-          // SAFE and CONSERVATIVE always keep universal selectors
-          return true;
-        }
-      }
+  const lxb_char_t *result = data;
+  char *pruned = count && (!parsed || keep) ? arena_alloc(run->arena, *length)
+                                            : NULL;
+  size_t pruned_len = 0;
+  size_t cursor = 0;
+  for (size_t r = 0; pruned && r < count; r++) {
+    bool used = false;
+    if (lists[r]) {
+      lxb_css_rule_list_t *parent;
+      size_t first, selector_count;
+      selector_program_rule(program, r, &parent, &first, &selector_count);
+      for (size_t s = first; s < first + selector_count && !used; s++)
+        used = keep[s];
+    }
+    if (used)
+      continue;
 
-      if (config->tag_count > 0 && sel->name.length > 0) {
-        bool is_universal = (sel->name.length == 1 && sel->name.data[0] == '*');
-        if (!is_universal &&
-            !is_tag_used((const char *)sel->name.data, sel->name.length,
-                         config->used_tags, config->tag_count)) {
-          return false;
-        }
-      }
-    } else if (sel->type == LXB_CSS_SELECTOR_TYPE_ATTRIBUTE) {
-      if (!is_attr_used(sel, config->used_attrs, config->attr_count)) {
-        return false;
-      }
-    } else if (sel->type == LXB_CSS_SELECTOR_TYPE_PSEUDO_ELEMENT) {
-      if (should_remove_pseudo_element(sel, config)) {
-        return false;
-      }
+    memcpy(pruned + pruned_len, css + cursor, spans[r].start - cursor);
+    pruned_len += spans[r].start - cursor;
+    cursor = spans[r].end;
+  }
+  if (pruned && cursor > 0) {
+    memcpy(pruned + pruned_len, css + cursor, *length - cursor);
+    pruned_len += *length - cursor;
+    result = (const lxb_char_t *)pruned;
+    *length = pruned_len;
+  }
 
-      // Conservative mode keeps browser-specific pseudo-elements
-      if (config->mode == LXB_CSS_OPTIM_MODE_CONSERVATIVE) {
-        if (sel->name.length > 5 &&
-            (strncasecmp((const char *)sel->name.data, "-webkit-", 8) == 0 ||
-             strncasecmp((const char *)sel->name.data, "-moz-", 5) == 0)) {
-          // Keep browser-prefixed pseudo-elements if not explicitly removed by
-          // above check
-        }
-      }
-    }
-    sel = sel->next;
+  selector_program_destroy(program);
+  free(spans);
+  free(lists);
+  return result;
+}
+
+static lxb_css_stylesheet_t *parse_rules(optim_run_t *run,
+                                         const lxb_char_t *data, size_t length,
+                                         css_mem_phase_t phase) {
+  if (run->config->lazy_parse || run->config->prefilter_rules) {
+    css_mem_phase_t previous = css_mem_phase_enter(phase);
+    const lxb_char_t *pruned = prune_unparsed_rules(run, data, &length);
+    css_mem_phase_enter(previous);
+    if (pruned != data)
+      run->edits++;
+    data = pruned;
   }
-  return true;
+  return parse_stylesheet(run->ctx, data, length, phase);
 }
 
 // --- Implementations ---
@@ -404,41 +678,24 @@ static bool should_keep_selector_node(lxb_css_selector_list_t *list,
 // Helper: Check if a bad style rule (raw string) should be kept
 static bool should_keep_bad_style(const lxb_char_t *data, size_t len,
                                   OptimizerConfig *config) {
-  (void)config;
   if (!data || len == 0)
     return false;
 
   // Check if this BAD_STYLE rule contains any form pseudo-elements we want to
   // remove
   if (config->remove_form_pseudoelements) {
-    // Quick string search for known pseudos
-    // Ensure to handle potential overlaps or simple inclusion
-    // Since these are specific names, strstr is okay if we verify full name or
-    // prefix/suffix.
-    char *copy = malloc(len + 1);
-    if (copy) {
-      memcpy(copy, data, len);
-      copy[len] = '\0';
-
-      // Removing :: is cleaner for checking vs our helper
-      char *p = copy;
-      while ((p = strstr(p, "::"))) {
-        char *pseudo = p; // Starts with ::
-        // Find end of identifier
-        char *end = pseudo + 2;
-        while (*end && (isalnum(*end) || *end == '-' || *end == '_'))
-          end++;
-
-        char saved = *end;
-        *end = '\0';
-        if (check_form_pseudo_removal(pseudo, config)) {
-          free(copy);
-          return false; // Remove this rule
-        }
-        *end = saved;
-        p = end;
-      }
-      free(copy);
+    // Each "::name" is looked up in place in the generated pseudo table
+    for (size_t i = 0; i + 1 < len; i++) {
+      if (data[i] != ':' || data[i + 1] != ':')
+        continue;
+      size_t end = i + 2;
+      while (end < len &&
+             (isalnum(data[end]) || data[end] == '-' || data[end] == '_'))
+        end++;
+      const char *pseudo = (const char *)data + i;
+      if (check_form_pseudo_removal(pseudo, end - i, config))
+        return false; // Remove this rule
+      i = end - 1;
     }
   }
 
@@ -466,7 +723,7 @@ static bool should_keep_bad_style(const lxb_char_t *data, size_t len,
         size_t name_len = i - start;
 
         if (is_class_used((const char *)(data + start), name_len,
-                          config->used_classes, config->class_count)) {
+                          config->usage)) {
           has_used_class = true;
         }
         continue;
@@ -490,9 +747,8 @@ static bool should_keep_bad_style(const lxb_char_t *data, size_t len,
           size_t name_len = i - start;
           has_tags = true;
 
-          if (config->tag_count > 0 &&
-              is_tag_used((const char *)(data + start), name_len,
-                          config->used_tags, config->tag_count)) {
+          if (is_tag_used((const char *)(data + start), name_len,
+                          config->usage)) {
             has_used_tag = true;
           }
         }
@@ -510,7 +766,8 @@ static bool should_keep_bad_style(const lxb_char_t *data, size_t len,
 
   // If it has tags (e.g., "span::after"), it MUST have at least one used tag to
   // be kept.
-  if (has_tags && config->tag_count > 0 && !has_used_tag) {
+  if (has_tags && css_usage_count(config->usage, CSS_USAGE_TAG) > 0 &&
+      !has_used_tag) {
     return false;
   }
 
@@ -518,395 +775,1447 @@ static bool should_keep_bad_style(const lxb_char_t *data, size_t len,
   return true;
 }
 
-// PASS 1
-static void pass1_filter_rules(lxb_css_rule_t *rule, OptimizerConfig *config) {
-  if (rule == NULL)
-    return;
+// Helper: Finds the next token in [*cursor, end) separated by any of delims,
+// like strtok but without copying or modifying the input. Returns NULL when
+// no token is left.
+static const char *next_token(const char **cursor, const char *end,
+                              const char *delims, size_t *len) {
+  const char *p = *cursor;
+  while (p < end && strchr(delims, *p))
+    p++;
+  if (p == end) {
+    *cursor = end;
+    return NULL;
+  }
+  const char *start = p;
+  while (p < end && !strchr(delims, *p))
+    p++;
+  *len = (size_t)(p - start);
+  *cursor = p;
+  return start;
+}
 
-  if (rule->type == LXB_CSS_RULE_LIST ||
-      rule->type == LXB_CSS_RULE_STYLESHEET) {
-    lxb_css_rule_list_t *list = (lxb_css_rule_list_t *)rule;
-    lxb_css_rule_t *current = list->first;
-
-    while (current) {
-      bool remove = false;
-      lxb_css_rule_t *next = current->next;
-
-      if (current->type == LXB_CSS_RULE_STYLE) {
-        lxb_css_rule_style_t *style = lxb_css_rule_style(current);
-        lxb_css_selector_list_t *sel_list = style->selector;
-        lxb_css_selector_list_t *prev = NULL;
-        bool has_any_used = false;
-
-        while (sel_list) {
-          lxb_css_selector_list_t *next_node = sel_list->next;
-
-          if (should_keep_selector_node(sel_list, config)) {
-            has_any_used = true;
-            prev = sel_list;
-          } else {
-            if (prev)
-              prev->next = next_node;
-            else
-              style->selector = next_node;
-
-            if (next_node)
-              next_node->prev = prev;
-
-            lxb_css_selector_list_destroy(sel_list);
-          }
-          sel_list = next_node;
-        }
+// --- Declaration Access ---
+// Names and values are read from the parsed declarations in place. Custom
+// properties, unknown properties and values lexbor could not parse all keep
+// their raw text, which is where every var() ends up.
+
+// Returns the property name of a declaration, or NULL if it has none.
+static const char *declaration_name(const lxb_css_rule_declaration_t *decl,
+                                    size_t *len) {
+  if (decl->type == LXB_CSS_PROPERTY__CUSTOM) {
+    *len = decl->u.custom->name.length;
+    return (const char *)decl->u.custom->name.data;
+  }
+  uintptr_t id =
+      decl->type == LXB_CSS_PROPERTY__UNDEF ? decl->u.undef->type : decl->type;
+  const lxb_css_entry_data_t *entry = lxb_css_property_by_id(id);
+  if (!entry)
+    return NULL;
+  *len = entry->length;
+  return (const char *)entry->name;
+}
 
-        if (!has_any_used) {
-          remove = true;
-        }
-      } else if (current->type == LXB_CSS_RULE_AT_RULE) {
-        lxb_css_rule_at_t *at = (lxb_css_rule_at_t *)current;
+// Returns the raw value text of a declaration, or NULL if lexbor parsed the
+// value into typed fields.
+static const lexbor_str_t *
+declaration_raw_value(const lxb_css_rule_declaration_t *decl) {
+  if (decl->type == LXB_CSS_PROPERTY__CUSTOM)
+    return &decl->u.custom->value;
+  if (decl->type == LXB_CSS_PROPERTY__UNDEF)
+    return &decl->u.undef->value;
+  return NULL;
+}
 
-        if (at->type == LXB_CSS_AT_RULE__UNDEF) {
-          struct pass1_ctx ctx = {.config = config};
-          process_nested_block(at->u.undef, pass1_cb, &ctx);
+static bool is_animation_property(const char *name, size_t len) {
+  return (len == 9 && strncasecmp(name, "animation", 9) == 0) ||
+         (len == 14 && strncasecmp(name, "animation-name", 14) == 0);
+}
 
-          if (at->u.undef->block.length == 0) {
-            remove = true;
-          }
-        }
-      } else if (current->type == LXB_CSS_RULE_LIST) {
-        pass1_filter_rules(current, config);
-      } else if (current->type == LXB_CSS_RULE_BAD_STYLE) {
-        // Handle BAD_STYLE (rules that failed full parsing, e.g. due to complex
-        // pseudo-classes) Filter them by checking if they contain unused
-        // classes in their raw selector string.
-        lxb_css_rule_bad_style_t *bad = (lxb_css_rule_bad_style_t *)current;
-        if (!should_keep_bad_style(bad->selectors.data, bad->selectors.length,
-                                   config)) {
-          remove = true;
-        }
-      }
+// Records the custom property of every var(--name) in a value as referenced
+// from `from`. Returns false on allocation failure.
+static bool collect_var_refs(dep_graph_t *graph, dep_node_t from,
+                             const char *value, size_t len) {
+  bool ok = true;
+  const char *end = value + len;
+  const char *p = value;
+  while (end - p > 4 && (p = memchr(p, 'v', (size_t)(end - p) - 4))) {
+    if (memcmp(p, "var(", 4) != 0) {
+      p++;
+      continue;
+    }
+    p += 4;
+    while (p < end && isspace((unsigned char)*p))
+      p++;
+    if (end - p < 2 || p[0] != '-' || p[1] != '-')
+      continue;
+    const char *name = p + 2;
+    for (p = name; p < end && *p != ')' && *p != ',' &&
+                   !isspace((unsigned char)*p);
+         p++)
+      ;
+    if (p > name)
+      ok = dep_graph_add_ref(graph, from, DEP_VAR, name, (size_t)(p - name)) &&
+           ok;
+  }
+  return ok;
+}
 
-      if (remove) {
-        if (current->prev)
-          current->prev->next = current->next;
-        else
-          list->first = current->next;
+// Records every word of an animation value as a keyframes name; durations
+// and timing keywords never match one.
+static bool collect_anim_names(dep_graph_t *graph, dep_node_t from,
+                               const char *value, size_t len) {
+  bool ok = true;
+  const char *cursor = value;
+  const char *tok;
+  size_t tok_len;
+  while ((tok = next_token(&cursor, value + len, " \t\n\r\f,;", &tok_len)))
+    ok = dep_graph_add_ref(graph, from, DEP_ANIM, tok, tok_len) && ok;
+  return ok;
+}
 
-        if (current->next)
-          current->next->prev = current->prev;
-        else
-          list->last = current->prev;
+// --- Single Traversal ---
+// One walk over the tree filters style rules by selector, records in the
+// dependency graph what the surviving rules reference, and notes where each
+// custom property and keyframes block is defined. Unused definitions are then
+// found by a fixpoint over the graph (dep_graph_resolve()) and removed from
+// the notes, without visiting the tree again.
 
-        lxb_css_rule_destroy(current, true);
-      }
-      current = next;
+#define NO_BLOCK ((size_t)-1)
+
+// A rule list the walk went through: the stylesheet, a nested rule list or
+// the parsed block of an at-rule. Once its last rule is removed, `owner`
+// goes from the parent block too.
+typedef struct {
+  lxb_css_rule_list_t *list;
+  lxb_css_rule_t *owner; // NULL for the top block
+  size_t parent;
+  bool removed;
+  bool edited; // top block: a definition was removed somewhere below
+} walk_block_t;
+
+// A custom property declaration or keyframes at-rule. Names point into the
+// parse tree.
+typedef struct {
+  dep_kind_t kind;
+  const char *name;
+  size_t len;
+  lxb_css_rule_t *rule;  // the declaration or at-rule
+  lxb_css_rule_t *style; // DEP_VAR: the style rule holding the declaration
+  size_t block;          // the block holding the style rule or at-rule
+  size_t inner;          // DEP_ANIM: the at-rule's own block, if parsed
+} walk_def_t;
+
+typedef struct {
+  walk_block_t *blocks;
+  size_t block_count;
+  size_t block_capacity;
+
+  walk_def_t *defs;
+  size_t def_count;
+  size_t def_capacity;
+
+  bool failed; // incomplete, so nothing may be removed
+} definitions_t;
+
+// Either the graph or the definitions may be NULL when a caller only needs
+// the other one.
+typedef struct {
+  optim_run_t *run;
+  dep_graph_t *graph;
+  definitions_t *defs;
+  bool failed;
+} walk_t;
+
+static size_t add_block(walk_t *walk, lxb_css_rule_list_t *list,
+                        lxb_css_rule_t *owner, size_t parent) {
+  definitions_t *defs = walk->defs;
+  if (!defs)
+    return NO_BLOCK;
+  if (defs->block_count == defs->block_capacity) {
+    size_t capacity = defs->block_capacity ? defs->block_capacity * 2 : 16;
+    walk_block_t *blocks = realloc(defs->blocks, capacity * sizeof(*blocks));
+    if (!blocks) {
+      walk->failed = true;
+      return NO_BLOCK;
     }
+    defs->blocks = blocks;
+    defs->block_capacity = capacity;
   }
+  defs->blocks[defs->block_count] =
+      (walk_block_t){.list = list, .owner = owner, .parent = parent};
+  return defs->block_count++;
 }
 
-// PASS 2
-static void pass2_collect_deps(lxb_css_rule_t *rule, dep_list_t *vars,
-                               dep_list_t *anims) {
-  if (rule->type == LXB_CSS_RULE_STYLE) {
-    lxb_css_rule_style_t *style = lxb_css_rule_style(rule);
-    if (style->declarations) {
-      lxb_css_rule_t *decl_rule = style->declarations->first;
-      while (decl_rule) {
-        if (decl_rule->type == LXB_CSS_RULE_DECLARATION) {
-          lxb_css_rule_declaration_t *decl =
-              (lxb_css_rule_declaration_t *)decl_rule;
-          char *name = NULL;
-          char *value = NULL;
-          lxb_css_rule_declaration_serialize_name(decl, string_serializer_cb,
-                                                  &name);
-          lxb_css_rule_declaration_serialize(decl, string_serializer_cb,
-                                             &value);
-
-          if (value) {
-            char *p = value;
-            while ((p = strstr(p, "var(--"))) {
-              p += 6;
-              char *end = strchr(p, ')');
-              if (end) {
-                add_dep(vars, p, end - p);
-              }
-            }
-
-            if (name && (strcmp(name, "animation") == 0 ||
-                         strcmp(name, "animation-name") == 0)) {
-              size_t vlen = strlen(value);
-              char *vcopy = malloc(vlen + 1);
-              if (vcopy) {
-                memcpy(vcopy, value, vlen + 1);
-                char *val_start = strchr(vcopy, ':');
-                if (val_start)
-                  val_start++;
-                else
-                  val_start = vcopy;
-
-                char *tok = strtok(val_start, " ,;");
-                while (tok) {
-                  add_dep(anims, tok, strlen(tok));
-                  tok = strtok(NULL, " ,;");
-                }
-                free(vcopy);
-              }
-            }
-          }
-          if (name)
-            free(name);
-          if (value)
-            free(value);
-        }
-        decl_rule = decl_rule->next;
-      }
-    }
-  } else if (rule->type == LXB_CSS_RULE_LIST) {
-    lxb_css_rule_list_t *l = lxb_css_rule_list(rule);
-    lxb_css_rule_t *child = l->first;
-    while (child) {
-      pass2_collect_deps(child, vars, anims);
-      child = child->next;
-    }
-  } else if (rule->type == LXB_CSS_RULE_AT_RULE) {
-    lxb_css_rule_at_t *at = (lxb_css_rule_at_t *)rule;
-    if (at->type == LXB_CSS_AT_RULE__UNDEF) {
-      struct pass2_ctx ctx = {.vars = vars, .anims = anims};
-      process_nested_block(at->u.undef, pass2_cb, &ctx);
-    } else if (at->type == LXB_CSS_AT_RULE_MEDIA) {
-      // Media rule handled implicitly if it was parsed as such?
-      // Actually, Lexbor might not recurse into MEDIA automatically??
-      // If I see it here, I should try to check if it has children?
-      // But my current code does nothing here, yet test_complex_filtering
-      // passed? Wait, test_complex_filtering passed because I fixed the flag!
+static void add_def(walk_t *walk, dep_kind_t kind, const char *name,
+                    size_t len, lxb_css_rule_t *rule, lxb_css_rule_t *style,
+                    size_t block, size_t inner) {
+  definitions_t *defs = walk->defs;
+  if (!defs)
+    return;
+  if (defs->def_count == defs->def_capacity) {
+    size_t capacity = defs->def_capacity ? defs->def_capacity * 2 : 64;
+    walk_def_t *grown = realloc(defs->defs, capacity * sizeof(*grown));
+    if (!grown) {
+      walk->failed = true;
+      return;
     }
+    defs->defs = grown;
+    defs->def_capacity = capacity;
   }
+  defs->defs[defs->def_count++] =
+      (walk_def_t){.kind = kind,
+                   .name = name,
+                   .len = len,
+                   .rule = rule,
+                   .style = style,
+                   .block = block,
+                   .inner = inner};
 }
 
-// PASS 3
-static bool pass3_refine_rules(lxb_css_rule_t *rule, dep_list_t *used_vars,
-                               dep_list_t *used_anims,
-                               OptimizerConfig *config) {
-  if (rule->type == LXB_CSS_RULE_STYLE) {
-    lxb_css_rule_style_t *style = lxb_css_rule_style(rule);
-    if (style->declarations) {
-      lxb_css_rule_t *decl_rule = style->declarations->first;
-      lxb_css_rule_t *next_decl = NULL;
-      while (decl_rule) {
-        next_decl = decl_rule->next;
-        if (decl_rule->type == LXB_CSS_RULE_DECLARATION) {
-          lxb_css_rule_declaration_t *decl =
-              (lxb_css_rule_declaration_t *)decl_rule;
-          char *name = NULL;
-          lxb_css_rule_declaration_serialize_name(decl, string_serializer_cb,
-                                                  &name);
-
-          if (name && strncmp(name, "--", 2) == 0) {
-            if (!is_dep_used(used_vars, name + 2, strlen(name) - 2)) {
-              if (decl_rule->prev)
-                decl_rule->prev->next = decl_rule->next;
-              else
-                style->declarations->first = decl_rule->next;
-
-              if (decl_rule->next)
-                decl_rule->next->prev = decl_rule->prev;
-              else
-                style->declarations->last = decl_rule->prev;
-
-              style->declarations->count--;
-              lxb_css_rule_destroy(decl_rule, true);
-            }
-          }
-          if (name)
-            free(name);
-        }
-        decl_rule = next_decl;
-      }
-    }
-    return (style->selector != NULL &&
-            (style->declarations == NULL || style->declarations->count > 0));
-  } else if (rule->type == LXB_CSS_RULE_LIST) {
-    lxb_css_rule_list_t *l = lxb_css_rule_list(rule);
-    lxb_css_rule_t *child = l->first;
-    lxb_css_rule_t *next_child = NULL;
-    while (child) {
-      next_child = child->next;
-      if (!pass3_refine_rules(child, used_vars, used_anims, config)) {
-        if (child->prev)
-          child->prev->next = child->next;
-        else
-          l->first = child->next;
-        if (child->next)
-          child->next->prev = child->prev;
-        else
-          l->last = child->prev;
-        lxb_css_rule_destroy(child, true);
+static void mark_removed(walk_t *walk, size_t block) {
+  if (block != NO_BLOCK)
+    walk->defs->blocks[block].removed = true;
+}
+
+// Returns the graph node of a definition, or DEP_NONE without a graph
+static dep_node_t definition_node(walk_t *walk, dep_kind_t kind,
+                                  const char *name, size_t len) {
+  if (!walk->graph)
+    return DEP_NONE;
+  dep_node_t node = dep_graph_node(walk->graph, kind, name, len);
+  if (node == DEP_NONE)
+    walk->failed = true;
+  return node;
+}
+
+// Records the custom properties and keyframes a declaration references
+static void record_refs(walk_t *walk, lxb_css_rule_declaration_t *decl,
+                        const char *name, size_t name_len, dep_node_t from) {
+  optim_run_t *run = walk->run;
+  const lexbor_str_t *raw = declaration_raw_value(decl);
+  bool ok = true;
+  if (raw && raw->data)
+    ok = collect_var_refs(walk->graph, from, (const char *)raw->data,
+                          raw->length);
+
+  if (name && is_animation_property(name, name_len)) {
+    if (raw) {
+      if (raw->data)
+        ok = collect_anim_names(walk->graph, from, (const char *)raw->data,
+                                raw->length) &&
+             ok;
+    } else {
+      // A typed value only gives up its names when serialized
+      arena_mark_t mark = arena_mark(run->arena);
+      scratch_str_t value = {.arena = run->arena};
+      lxb_css_rule_declaration_serialize(decl, scratch_serializer_cb, &value);
+      if (value.data) {
+        const char *colon = memchr(value.data, ':', value.len);
+        const char *start = colon ? colon + 1 : value.data;
+        ok = collect_anim_names(walk->graph, from, start,
+                                (size_t)(value.data + value.len - start)) &&
+             ok;
       }
-      child = next_child;
+      arena_rewind(run->arena, mark);
     }
-    return l->first != NULL;
-  } else if (rule->type == LXB_CSS_RULE_AT_RULE) {
-    lxb_css_rule_at_t *at = (lxb_css_rule_at_t *)rule;
+  }
+  if (!ok)
+    walk->failed = true;
+}
 
-    if (at->type == LXB_CSS_AT_RULE__UNDEF) {
-      struct pass3_ctx ctx = {
-          .vars = used_vars, .anims = used_anims, .config = config};
-      process_nested_block(at->u.undef, pass3_cb, &ctx);
-      if (at->u.undef->block.length == 0) {
-        return false;
-      }
+// Returns false if the style rule can go. References of a custom property
+// count from that property, the others from `from`.
+static bool walk_style(walk_t *walk, lxb_css_rule_t *rule, size_t block,
+                       dep_node_t from) {
+  lxb_css_rule_style_t *style = lxb_css_rule_style(rule);
+  if (!style->selector)
+    return false;
+  if (!style->declarations)
+    return true;
+  if (style->declarations->count == 0)
+    return false;
+
+  for (lxb_css_rule_t *decl_rule = style->declarations->first; decl_rule;
+       decl_rule = decl_rule->next) {
+    if (decl_rule->type != LXB_CSS_RULE_DECLARATION)
+      continue;
+    lxb_css_rule_declaration_t *decl = (lxb_css_rule_declaration_t *)decl_rule;
+    size_t name_len = 0;
+    const char *name = declaration_name(decl, &name_len);
+    dep_node_t refs_from = from;
+
+    // Custom properties always parse as LXB_CSS_PROPERTY__CUSTOM
+    if (decl->type == LXB_CSS_PROPERTY__CUSTOM && name_len >= 2 &&
+        name[0] == '-' && name[1] == '-') {
+      add_def(walk, DEP_VAR, name + 2, name_len - 2, decl_rule, rule, block,
+              NO_BLOCK);
+      refs_from = definition_node(walk, DEP_VAR, name + 2, name_len - 2);
     }
+    if (walk->graph)
+      record_refs(walk, decl, name, name_len, refs_from);
+  }
+  return true;
+}
 
-    // Handle Keyframes (standard and vendor prefixed)
-    char *name = NULL;
-    lxb_css_rule_at_serialize_name(at, string_serializer_cb, &name);
-
-    bool keep = true;
-    if (name) {
-      size_t len = strlen(name);
-      const char *suffix = "keyframes";
-      size_t suffix_len = strlen(suffix);
-
-      // Check if name ends with "keyframes" (case insensitive)
-      if (len >= suffix_len &&
-          strcasecmp(name + len - suffix_len, suffix) == 0) {
-        if (config->remove_unused_keyframes) {
-          keep = false;
-
-          // Extract animation name from prelude
-          // Access prelude based on internal type storage
-          if (at->type == LXB_CSS_AT_RULE__UNDEF ||
-              at->type == LXB_CSS_AT_RULE__CUSTOM) {
-            lexbor_str_t *prelude = (at->type == LXB_CSS_AT_RULE__UNDEF)
-                                        ? &at->u.undef->prelude
-                                        : &at->u.custom->prelude;
-            if (prelude && prelude->data) {
-              char *temp = malloc(prelude->length + 1);
-              if (temp) {
-                memcpy(temp, prelude->data, prelude->length);
-                temp[prelude->length] = '\0';
-                char *clean_name = strtok(temp, " \t\n\r");
-                if (clean_name &&
-                    is_dep_used(used_anims, clean_name, strlen(clean_name))) {
-                  keep = true;
-                }
-                free(temp);
-              }
-            }
-          }
-        }
-      }
+// Whether an at-rule is @keyframes, vendor prefixed or not
+static bool is_keyframes(optim_run_t *run, lxb_css_rule_at_t *at) {
+  arena_mark_t mark = arena_mark(run->arena);
+  scratch_str_t name = {.arena = run->arena};
+  lxb_css_rule_at_serialize_name(at, scratch_serializer_cb, &name);
+
+  const char *suffix = "keyframes";
+  size_t suffix_len = strlen(suffix);
+  bool keyframes = name.data && name.len >= suffix_len &&
+                   strcasecmp(name.data + name.len - suffix_len, suffix) == 0;
+  arena_rewind(run->arena, mark);
+  return keyframes;
+}
+
+// Returns the animation name of a keyframes at-rule, the first word of its
+// prelude, or NULL if it has none.
+static const char *keyframes_name(lxb_css_rule_at_t *at, size_t *len) {
+  if (at->type != LXB_CSS_AT_RULE__UNDEF &&
+      at->type != LXB_CSS_AT_RULE__CUSTOM)
+    return NULL;
+  lexbor_str_t *prelude = at->type == LXB_CSS_AT_RULE__UNDEF
+                              ? &at->u.undef->prelude
+                              : &at->u.custom->prelude;
+  if (!prelude->data)
+    return NULL;
+  const char *cursor = (const char *)prelude->data;
+  return next_token(&cursor, cursor + prelude->length, " \t\n\r", len);
+}
+
+static void walk_root(walk_t *walk, lxb_css_rule_t *root, size_t block,
+                      dep_node_t from);
+
+// Returns false if the at-rule can go: its block was left empty, or it is a
+// keyframes block without a name. References inside keyframes count from
+// their animation name.
+static bool walk_at_rule(walk_t *walk, lxb_css_rule_t *rule, size_t block,
+                         dep_node_t from) {
+  lxb_css_rule_at_t *at = (lxb_css_rule_at_t *)rule;
+  const char *name = NULL;
+  size_t name_len = 0;
+  if (walk->run->config->remove_unused_keyframes &&
+      is_keyframes(walk->run, at)) {
+    name = keyframes_name(at, &name_len);
+    if (!name)
+      return false;
+    from = definition_node(walk, DEP_ANIM, name, name_len);
+  }
+
+  // Blocks lexbor leaves unparsed are parsed here once for the run
+  lxb_css_at_rule__undef_t *undef =
+      at->type == LXB_CSS_AT_RULE__UNDEF ? at->u.undef : NULL;
+  lxb_css_rule_t *root =
+      undef && undef->block.data ? nested_root(walk->run, undef) : NULL;
+  bool is_list = root && (root->type == LXB_CSS_RULE_LIST ||
+                          root->type == LXB_CSS_RULE_STYLESHEET);
+  size_t inner = is_list ? add_block(walk, (lxb_css_rule_list_t *)root, rule,
+                                     block)
+                         : NO_BLOCK;
+  if (name)
+    add_def(walk, DEP_ANIM, name, name_len, rule, NULL, block, inner);
+
+  // Blocks that do not parse are kept as is
+  if (!root)
+    return !undef || undef->block.length > 0;
+  walk_root(walk, root, inner, from);
+  if (!is_list || ((lxb_css_rule_list_t *)root)->first)
+    return true;
+  mark_removed(walk, inner);
+  return false;
+}
+
+static void walk_list(walk_t *walk, lxb_css_rule_list_t *list, size_t block,
+                      dep_node_t from);
+
+// Returns false if the rule should be removed from its list
+static bool walk_rule(walk_t *walk, lxb_css_rule_t *rule, size_t block,
+                      dep_node_t from) {
+  switch (rule->type) {
+  case LXB_CSS_RULE_STYLE:
+    return walk_style(walk, rule, block, from);
+
+  case LXB_CSS_RULE_LIST: {
+    lxb_css_rule_list_t *list = lxb_css_rule_list(rule);
+    size_t inner = add_block(walk, list, rule, block);
+    walk_list(walk, list, inner, from);
+    if (list->first)
+      return true;
+    mark_removed(walk, inner);
+    return false;
+  }
+
+  case LXB_CSS_RULE_AT_RULE:
+    return walk_at_rule(walk, rule, block, from);
+
+  case LXB_CSS_RULE_BAD_STYLE: {
+    // Rules that failed full parsing, e.g. due to complex pseudo-classes,
+    // are filtered by the unused classes in their raw selector string
+    lxb_css_rule_bad_style_t *bad = (lxb_css_rule_bad_style_t *)rule;
+    return should_keep_bad_style(bad->selectors.data, bad->selectors.length,
+                                 walk->run->config);
+  }
+
+  default:
+    return true;
+  }
+}
+
+static void walk_list(walk_t *walk, lxb_css_rule_list_t *list, size_t block,
+                      dep_node_t from) {
+  lxb_css_rule_t *rule = list->first;
+  while (rule) {
+    lxb_css_rule_t *next = rule->next;
+    if (!walk_rule(walk, rule, block, from)) {
+      remove_rule(list, rule);
+      walk->run->edits++;
     }
-    if (name)
-      free(name);
-    return keep;
+    rule = next;
+  }
+}
+
+// Walks a stylesheet or parsed block. Its style rules are compiled and
+// filtered by selector in one sweep first; if compilation fails they are all
+// kept.
+static void walk_root(walk_t *walk, lxb_css_rule_t *root, size_t block,
+                      dep_node_t from) {
+  if (root->type != LXB_CSS_RULE_LIST &&
+      root->type != LXB_CSS_RULE_STYLESHEET) {
+    walk_rule(walk, root, NO_BLOCK, from);
+    return;
+  }
+
+  selector_program_t *program = selector_program_compile(root);
+  if (program) {
+    if (filter_style_rules(program, walk->run->config))
+      walk->run->edits++;
+    selector_program_destroy(program);
+  }
+  walk_list(walk, (lxb_css_rule_list_t *)root, block, from);
+}
+
+// Filters a parse tree by selector in one walk, adding what its surviving
+// rules reference to `graph` and their definitions to `defs`. Either can be
+// NULL. Returns false on allocation failure.
+static bool walk_tree(optim_run_t *run, lxb_css_rule_t *root,
+                      dep_graph_t *graph, definitions_t *defs) {
+  walk_t walk = {.run = run, .graph = graph, .defs = defs};
+  if (root) {
+    bool is_list = root->type == LXB_CSS_RULE_LIST ||
+                   root->type == LXB_CSS_RULE_STYLESHEET;
+    size_t block = is_list ? add_block(&walk, (lxb_css_rule_list_t *)root,
+                                       NULL, NO_BLOCK)
+                           : NO_BLOCK;
+    walk_root(&walk, root, block, DEP_NONE);
+  }
+  if (walk.failed && defs)
+    defs->failed = true;
+  return !walk.failed;
+}
+
+static bool block_in_tree(const definitions_t *defs, size_t block) {
+  for (; block != NO_BLOCK; block = defs->blocks[block].parent) {
+    if (defs->blocks[block].removed)
+      return false;
   }
   return true;
 }
 
+static void mark_edited(definitions_t *defs, size_t block) {
+  while (defs->blocks[block].parent != NO_BLOCK)
+    block = defs->blocks[block].parent;
+  defs->blocks[block].edited = true;
+}
+
+// Removes a rule from a block, and every block left empty by it from its
+// parent in turn.
+static void remove_from_block(definitions_t *defs, size_t block,
+                              lxb_css_rule_t *rule) {
+  while (block != NO_BLOCK) {
+    walk_block_t *b = &defs->blocks[block];
+    remove_rule(b->list, rule);
+    if (b->list->first || !b->owner)
+      return;
+    b->removed = true;
+    rule = b->owner;
+    block = b->parent;
+  }
+}
+
+// Removes the definitions `graph` did not find used. Definitions inside
+// blocks already removed are skipped before anything of theirs is read.
+static void remove_unused_definitions(definitions_t *defs,
+                                      const dep_graph_t *graph) {
+  if (defs->failed)
+    return;
+
+  for (size_t i = 0; i < defs->def_count; i++) {
+    walk_def_t *def = &defs->defs[i];
+    if (def->block == NO_BLOCK || !block_in_tree(defs, def->block) ||
+        (def->inner != NO_BLOCK && defs->blocks[def->inner].removed) ||
+        dep_graph_is_used(graph, def->kind, def->name, def->len))
+      continue;
+
+    mark_edited(defs, def->block);
+    if (def->kind == DEP_ANIM) {
+      if (def->inner != NO_BLOCK)
+        defs->blocks[def->inner].removed = true;
+      remove_from_block(defs, def->block, def->rule);
+      continue;
+    }
+
+    lxb_css_rule_t *decl_rule = def->rule;
+    lxb_css_rule_style_t *style = lxb_css_rule_style(def->style);
+    if (decl_rule->prev)
+      decl_rule->prev->next = decl_rule->next;
+    else
+      style->declarations->first = decl_rule->next;
+
+    if (decl_rule->next)
+      decl_rule->next->prev = decl_rule->prev;
+    else
+      style->declarations->last = decl_rule->prev;
+
+    style->declarations->count--;
+    lxb_css_rule_destroy(decl_rule, true);
+    if (style->declarations->count == 0)
+      remove_from_block(defs, def->block, def->style);
+  }
+}
+
+// Forgets the definitions of a parse tree about to be destroyed
+static void definitions_clear(definitions_t *defs) {
+  defs->block_count = 0;
+  defs->def_count = 0;
+  defs->failed = false;
+}
+
+static void definitions_free(definitions_t *defs) {
+  free(defs->blocks);
+  free(defs->defs);
+}
+
 // --- Main API ---
 
-bool css_validate(const char *css_content, size_t length) {
-  if (!css_content || length == 0)
+// Indexes the legacy usage arrays of a config into a usage set.
+static css_usage_t *usage_from_arrays(const OptimizerConfig *config) {
+  css_usage_t *usage = css_usage_create();
+  if (!usage)
+    return NULL;
+  for (size_t i = 0; config->used_classes && i < config->class_count; i++)
+    css_usage_add(usage, CSS_USAGE_CLASS, config->used_classes[i],
+                  strlen(config->used_classes[i]));
+  for (size_t i = 0; config->used_tags && i < config->tag_count; i++)
+    css_usage_add(usage, CSS_USAGE_TAG, config->used_tags[i],
+                  strlen(config->used_tags[i]));
+  for (size_t i = 0; config->used_attrs && i < config->attr_count; i++)
+    css_usage_add(usage, CSS_USAGE_ATTR, config->used_attrs[i],
+                  strlen(config->used_attrs[i]));
+  return usage;
+}
+
+// All usage checks go through a usage set; copies the config into `local`
+// with one built from the arrays if the caller did not scan into one
+// directly. The set built, if any, is returned in `owned` for destruction.
+static bool localize_config(const OptimizerConfig *config,
+                            OptimizerConfig *local, css_usage_t **owned) {
+  *local = *config;
+  *owned = NULL;
+  if (!local->usage) {
+    *owned = usage_from_arrays(config);
+    if (!*owned)
+      return false;
+    local->usage = *owned;
+  }
+  return true;
+}
+
+// Serializer callback for a top-level rule, held in the buffer until it is
+// known not to be @charset
+static lxb_status_t rule_serializer_cb(const lxb_char_t *data, size_t len,
+                                       void *ctx) {
+  out_buf_t *out = ctx;
+  if (!out_buf_append(out, (const char *)data, len))
+    return LXB_STATUS_ERROR;
+  if (out->holding && out->len - out->hold >= 8 &&
+      strncmp(out->data + out->hold, "@charset", 8) != 0)
+    out->holding = false;
+  return LXB_STATUS_OK;
+}
+
+// Inserts the semicolon lexbor leaves out after @charset "..." into the
+// held rule, if it is missing.
+static void fix_charset(out_buf_t *out) {
+  char *text = out->data + out->hold;
+  size_t len = out->len - out->hold;
+  if (len < 8 || strncmp(text, "@charset", 8) != 0)
+    return;
+
+  // Find the closing quote
+  char *quote_start = memchr(text, '"', len);
+  char *quote_end =
+      quote_start ? memchr(quote_start + 1, '"',
+                           (size_t)(text + len - quote_start - 1))
+                  : NULL;
+  if (!quote_end)
+    return;
+
+  // Check if there's already a semicolon after the quote
+  char *next_char = quote_end + 1;
+  while (next_char < text + len && (*next_char == ' ' || *next_char == '\t'))
+    next_char++;
+  if (next_char < text + len && *next_char == ';')
+    return;
+
+  // The append may pass earlier text on, which moves the held rule
+  size_t offset = (size_t)(quote_end + 1 - text);
+  size_t tail = len - offset;
+  if (!out_buf_append(out, ";", 1))
+    return;
+  char *insert = out->data + out->hold + offset;
+  memmove(insert + 1, insert, tail);
+  *insert = ';';
+}
+
+// Appends one top-level rule to the output. The rule is held in the buffer
+// while it might be @charset, so its semicolon is fixed as it is written;
+// only the rule's own bytes are looked at or moved.
+static bool serialize_rule(lxb_css_rule_t *rule, out_buf_t *out) {
+  out->hold = out->len;
+  out->holding = true;
+  lxb_css_rule_serialize(rule, rule_serializer_cb, out);
+  if (out->holding && !out->failed)
+    fix_charset(out);
+  out->holding = false;
+  return !out->failed;
+}
+
+// Appends the optimized rules to the output. Top-level rules are written one
+// by one and separated by newlines, as lexbor's list serializer does, so
+// consecutive pieces of a stylesheet appended to the same buffer give the
+// same text as the whole. Returns false if an append failed.
+static bool serialize_output(lxb_css_rule_t *root, out_buf_t *out) {
+  if (root && root->type == LXB_CSS_RULE_LIST) {
+    lxb_css_rule_list_t *list = lxb_css_rule_list(root);
+    for (lxb_css_rule_t *rule = list->first; rule; rule = rule->next) {
+      if (out_buf_size(out) > 0)
+        out_buf_append(out, "\n", 1);
+      serialize_rule(rule, out);
+    }
+  } else if (root) {
+    if (out_buf_size(out) > 0)
+      out_buf_append(out, "\n", 1);
+    serialize_rule(root, out);
+  }
+  return !out->failed;
+}
+
+// A job run by run_jobs(), with the caller's memory job
+typedef struct {
+  void *(*fn)(void *);
+  void *arg;
+  css_mem_job_t *mem_job;
+} job_thread_t;
+
+// Runs a job with the caller's memory job entered, so lexbor allocations on
+// the thread count against its limit and come from its region
+static void *job_thread(void *arg) {
+  job_thread_t *thread = arg;
+  css_mem_job_t *previous = css_mem_job_enter(thread->mem_job);
+  thread->fn(thread->arg);
+  css_mem_job_enter(previous);
+  return NULL;
+}
+
+// Runs fn over every job of an array on a thread of its own. A job whose
+// thread cannot be started runs on the caller instead.
+static void run_jobs(void *(*fn)(void *), void *jobs, size_t job_size,
+                     size_t count) {
+  pthread_t threads[MAX_THREADS];
+  job_thread_t runs[MAX_THREADS];
+  bool started[MAX_THREADS];
+  css_mem_job_t *mem_job = css_mem_job_current();
+  for (size_t i = 0; i < count; i++) {
+    void *job = (char *)jobs + i * job_size;
+    runs[i] = (job_thread_t){.fn = fn, .arg = job, .mem_job = mem_job};
+    started[i] = pthread_create(&threads[i], NULL, job_thread, &runs[i]) == 0;
+    if (!started[i])
+      fn(job);
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+}
+
+// A run of consecutive top-level rules serialized on a thread of its own
+typedef struct {
+  lxb_css_rule_t *first;
+  size_t count;
+  out_buf_t output;
+  size_t text; // where the first rule written as anything starts in output
+} serialize_job_t;
+
+// Rough size of a rule's serialized text, to balance the runs. Nested blocks
+// written back by flush_nested_blocks() count with their length.
+static size_t estimate_rule_size(const lxb_css_rule_t *rule) {
+  if (rule->type == LXB_CSS_RULE_STYLE) {
+    const lxb_css_rule_style_t *style = (const lxb_css_rule_style_t *)rule;
+    return 32 + (style->declarations ? style->declarations->count * 24 : 0);
+  }
+  if (rule->type == LXB_CSS_RULE_AT_RULE) {
+    const lxb_css_rule_at_t *at = (const lxb_css_rule_at_t *)rule;
+    if (at->type == LXB_CSS_AT_RULE__UNDEF)
+      return 32 + at->u.undef->prelude.length + at->u.undef->block.length;
+  }
+  return 32;
+}
+
+// Writes a run as serialize_output() would after earlier output: every rule
+// with a newline in front. Whether there was any is only known once the
+// runs before are done, so `text` marks where the newlines a run at the
+// start of the output would not have written end.
+static void *serialize_chunk(void *arg) {
+  serialize_job_t *job = arg;
+  lxb_css_rule_t *rule = job->first;
+  bool written = false;
+  for (size_t i = 0; i < job->count; i++, rule = rule->next) {
+    out_buf_append(&job->output, "\n", 1);
+    size_t start = job->output.len;
+    serialize_rule(rule, &job->output);
+    if (!written && job->output.len > start) {
+      job->text = start;
+      written = true;
+    }
+  }
+  if (!written)
+    job->text = job->output.len;
+  return NULL;
+}
+
+// serialize_output() on up to `threads` threads. The top-level rules are cut
+// into runs of about the same estimated size, each serialized into a buffer
+// of its own, and the buffers are appended in order. Only reads the tree, so
+// nested blocks must be flushed first.
+static bool serialize_output_threaded(lxb_css_rule_t *root, out_buf_t *out,
+                                      unsigned threads) {
+  if (threads <= 1 || !root || root->type != LXB_CSS_RULE_LIST)
+    return serialize_output(root, out);
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+
+  lxb_css_rule_list_t *list = lxb_css_rule_list(root);
+  size_t total = 0;
+  for (lxb_css_rule_t *rule = list->first; rule; rule = rule->next)
+    total += estimate_rule_size(rule);
+  size_t count = total / SERIALIZE_CHUNK_MIN;
+  if (count > threads)
+    count = threads;
+  if (count <= 1)
+    return serialize_output(root, out);
+
+  // A run ends once the runs so far hold their share of the total
+  serialize_job_t jobs[MAX_THREADS];
+  memset(jobs, 0, count * sizeof(serialize_job_t));
+  size_t n = 0;
+  size_t size = 0;
+  jobs[0].first = list->first;
+  for (lxb_css_rule_t *rule = list->first; rule; rule = rule->next) {
+    if (jobs[n].count > 0 && n + 1 < count && size >= total / count * (n + 1))
+      jobs[++n].first = rule;
+    jobs[n].count++;
+    size += estimate_rule_size(rule);
+  }
+  run_jobs(serialize_chunk, jobs, sizeof(serialize_job_t), n + 1);
+
+  for (size_t i = 0; i <= n; i++) {
+    out_buf_t *chunk = &jobs[i].output;
+    if (chunk->failed)
+      out->failed = true;
+    size_t from = out_buf_size(out) > 0 ? 0 : jobs[i].text;
+    if (chunk->len > from)
+      out_buf_put(out, chunk->data + from, chunk->len - from);
+    free(chunk->data);
+  }
+  return !out->failed;
+}
+
+css_optimizer_ctx_t *css_optimizer_ctx_create(void) {
+  css_optimizer_ctx_t *ctx = calloc(1, sizeof(css_optimizer_ctx_t));
+  if (ctx)
+    arena_init(&ctx->arena, 0);
+  return ctx;
+}
+
+void css_optimizer_ctx_destroy(css_optimizer_ctx_t *ctx) {
+  if (!ctx)
+    return;
+  if (ctx->parser)
+    lxb_css_parser_destroy(ctx->parser, true);
+  if (ctx->memory)
+    lxb_css_memory_destroy(ctx->memory, true);
+  free(ctx->nested);
+  arena_release(&ctx->arena);
+  free(ctx);
+}
+
+bool css_validate_ctx(css_optimizer_ctx_t *ctx, const char *css_content,
+                      size_t length) {
+  if (!ctx || !css_content || length == 0)
     return false;
-  lxb_css_parser_t *parser = lxb_css_parser_create();
-  lxb_css_parser_init(parser, NULL);
   lxb_css_stylesheet_t *stylesheet =
-      lxb_css_stylesheet_parse(parser, (const lxb_char_t *)css_content, length);
+      parse_stylesheet(ctx, (const lxb_char_t *)css_content, length,
+                       CSS_MEM_PHASE_CSS_PARSE);
   bool success = (stylesheet != NULL);
-  lxb_css_stylesheet_destroy(stylesheet, true);
-  lxb_css_parser_destroy(parser, true);
+  lxb_css_stylesheet_destroy(stylesheet, false);
+  end_run(ctx);
+  return success;
+}
+
+bool css_validate(const char *css_content, size_t length) {
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  if (!ctx)
+    return false;
+  bool success = css_validate_ctx(ctx, css_content, length);
+  css_optimizer_ctx_destroy(ctx);
   return success;
 }
 
 char *css_optimize(const char *css_content, size_t length,
                    OptimizerConfig *config) {
-  if (!css_content || length == 0)
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  if (!ctx)
     return NULL;
+  char *output = css_optimize_ctx(ctx, css_content, length, config);
+  css_optimizer_ctx_destroy(ctx);
+  return output;
+}
 
-  lxb_css_parser_t *parser = lxb_css_parser_create();
-  lxb_css_parser_init(parser, NULL);
-  lxb_css_stylesheet_t *stylesheet =
-      lxb_css_stylesheet_parse(parser, (const lxb_char_t *)css_content, length);
+// Optimizes a whole stylesheet into `out`. Returns false if it does not
+// parse or an append fails.
+static bool optimize_into(css_optimizer_ctx_t *ctx, const char *css_content,
+                          size_t length, OptimizerConfig *config,
+                          out_buf_t *out) {
+  OptimizerConfig local;
+  css_usage_t *owned_usage = NULL;
+  if (!localize_config(config, &local, &owned_usage))
+    return false;
+  config = &local;
+
+  optim_run_t run = {.config = config, .ctx = ctx, .arena = &ctx->arena};
+  ctx->arena.peak = ctx->arena.reserved;
 
+  lxb_css_stylesheet_t *stylesheet =
+      parse_rules(&run, (const lxb_char_t *)css_content, length,
+                  CSS_MEM_PHASE_CSS_PARSE);
   if (!stylesheet) {
-    lxb_css_parser_destroy(parser, true);
+    end_run(ctx);
+    css_usage_destroy(owned_usage);
+    return false;
+  }
+
+  // Filter by selector and collect references in one walk, then drop the
+  // custom properties and keyframes nothing kept reaches
+  dep_graph_t *graph = dep_graph_create();
+  definitions_t defs = {0};
+  if (walk_tree(&run, stylesheet->root, graph, &defs) && graph &&
+      dep_graph_resolve(graph))
+    remove_unused_definitions(&defs, graph);
+
+  flush_nested_blocks(&run, stylesheet->root);
+  bool ok = serialize_output_threaded(stylesheet->root, out,
+                                      config->serialize_threads);
+
+  definitions_free(&defs);
+  dep_graph_destroy(graph);
+
+  lxb_css_stylesheet_destroy(stylesheet, false);
+  end_run(ctx);
+  if (config->stats)
+    config->stats->scratch_peak = ctx->arena.peak;
+  css_usage_destroy(owned_usage);
+  return ok;
+}
+
+char *css_optimize_ctx(css_optimizer_ctx_t *ctx, const char *css_content,
+                       size_t length, OptimizerConfig *config) {
+  if (!ctx || !css_content || length == 0)
+    return NULL;
+
+  out_buf_t out = {0};
+  if (!optimize_into(ctx, css_content, length, config, &out))
+    out.failed = true;
+  return out_buf_finish(&out);
+}
+
+bool css_optimize_to_sink(css_optimizer_ctx_t *ctx, const char *css_content,
+                          size_t length, OptimizerConfig *config,
+                          css_write_cb_t write, void *user) {
+  if (!ctx || !css_content || length == 0 || !write)
+    return false;
+
+  out_buf_t out = {.write = write, .user = user};
+  bool ok = optimize_into(ctx, css_content, length, config, &out);
+  return out_buf_close(&out) && ok;
+}
+
+// Joins the outputs of consecutive pieces of a stylesheet the way
+// serialize_output() joins top-level rules.
+static char *join_outputs(const out_buf_t *outputs, size_t count) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++)
+    total += outputs[i].len + 1;
+
+  char *output = malloc(total + 1);
+  if (!output)
     return NULL;
+  size_t len = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (outputs[i].len == 0)
+      continue;
+    if (len > 0)
+      output[len++] = '\n';
+    memcpy(output + len, outputs[i].data, outputs[i].len);
+    len += outputs[i].len;
   }
+  output[len] = '\0';
+  return output;
+}
+
+// --- Streaming Input ---
+// Input is buffered until it holds a batch of complete top-level rules, which
+// is parsed and walked like a window while more input arrives. Every batch's
+// stylesheet is kept until the input ends, so definitions in any batch are
+// removed against the references of all of them, and their outputs are
+// joined in order.
 
-  if (stylesheet->root) {
-    // PASS 1: Filter rules by selector (classes, tags, attrs, and mode)
-    pass1_filter_rules(stylesheet->root, config);
+// Bytes asked for per read, and buffered complete rules that make a batch
+#define STREAM_READ_SIZE 65536
+#define STREAM_BATCH_SIZE 262144
+
+typedef struct {
+  optim_run_t run;
+  dep_graph_t *graph;
+  definitions_t defs; // of every batch
+  lxb_css_stylesheet_t **sheets;
+  size_t count;
+  size_t capacity;
+} css_stream_t;
+
+static bool stream_batch(css_stream_t *stream, const char *data,
+                         size_t length) {
+  if (stream->count == stream->capacity) {
+    size_t capacity = stream->capacity ? stream->capacity * 2 : 16;
+    lxb_css_stylesheet_t **grown =
+        realloc(stream->sheets, capacity * sizeof(*grown));
+    if (!grown)
+      return false;
+    stream->sheets = grown;
+    stream->capacity = capacity;
   }
+  // The parse tree copies what it needs, so the buffer can be reused
+  lxb_css_stylesheet_t *stylesheet =
+      parse_rules(&stream->run, (const lxb_char_t *)data, length,
+                  CSS_MEM_PHASE_CSS_PARSE);
+  if (!stylesheet)
+    return false;
+  stream->sheets[stream->count++] = stylesheet;
+  return walk_tree(&stream->run, stylesheet->root, stream->graph,
+                   &stream->defs);
+}
 
-  dep_list_t *used_vars = malloc(sizeof(dep_list_t));
-  dep_list_t *used_anims = malloc(sizeof(dep_list_t));
-  if (used_vars)
-    memset(used_vars, 0, sizeof(dep_list_t));
-  if (used_anims)
-    memset(used_anims, 0, sizeof(dep_list_t));
+// Reads the whole input, parsing each batch as soon as it is complete
+static bool stream_read(css_stream_t *stream, css_read_cb_t read, void *user) {
+  char *buffer = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  size_t complete = 0;
+  bool ok = true;
+  bool ended = false;
+  // Kept across reads, so a rule arriving over many reads is scanned once
+  rule_scan_t scan;
+  rule_scan_init(&scan, 0);
+
+  while (ok && !ended) {
+    if (capacity - length < STREAM_READ_SIZE) {
+      size_t grown_capacity = capacity ? capacity * 2 : STREAM_READ_SIZE;
+      while (grown_capacity - length < STREAM_READ_SIZE)
+        grown_capacity *= 2;
+      char *grown = realloc(buffer, grown_capacity);
+      if (!grown) {
+        ok = false;
+        break;
+      }
+      buffer = grown;
+      capacity = grown_capacity;
+    }
 
-  if (stylesheet->root && used_vars && used_anims) {
-    pass2_collect_deps(stylesheet->root, used_vars, used_anims);
+    size_t len = 0;
+    ok = read(buffer + length, capacity - length, &len, user);
+    ended = len == 0;
+    length += len;
+    rule_span_t span;
+    while (rule_scan_next(&scan, buffer, length, ended, &span))
+      complete = span.end;
+    if (ended)
+      complete = length;
+    if (ok && complete > 0 && (ended || complete >= STREAM_BATCH_SIZE)) {
+      ok = stream_batch(stream, buffer, complete);
+      memmove(buffer, buffer + complete, length - complete);
+      length -= complete;
+      rule_scan_shift(&scan, complete);
+      complete = 0;
+    }
   }
 
-  if (stylesheet->root && used_vars && used_anims) {
-    pass3_refine_rules(stylesheet->root, used_vars, used_anims, config);
+  free(buffer);
+  return ok;
+}
+
+char *css_optimize_stream(css_optimizer_ctx_t *ctx, css_read_cb_t read,
+                          void *user, OptimizerConfig *config) {
+  if (!ctx || !read)
+    return NULL;
+
+  OptimizerConfig local;
+  css_usage_t *owned_usage = NULL;
+  if (!localize_config(config, &local, &owned_usage))
+    return NULL;
+  config = &local;
+
+  css_stream_t stream = {
+      .run = {.config = config, .ctx = ctx, .arena = &ctx->arena},
+      .graph = dep_graph_create()};
+  ctx->arena.peak = ctx->arena.reserved;
+
+  bool ok = stream.graph && stream_read(&stream, read, user) &&
+            dep_graph_resolve(stream.graph);
+  if (ok)
+    remove_unused_definitions(&stream.defs, stream.graph);
+
+  // Batches append to one buffer the way their rules would have been
+  out_buf_t out = {0};
+  for (size_t i = 0; ok && i < stream.count; i++) {
+    lxb_css_rule_t *root = stream.sheets[i]->root;
+    flush_nested_blocks(&stream.run, root);
+    ok = serialize_output_threaded(root, &out, config->serialize_threads);
   }
+  if (!ok)
+    out.failed = true;
+  char *output = out_buf_finish(&out);
+
+  for (size_t i = 0; i < stream.count; i++)
+    lxb_css_stylesheet_destroy(stream.sheets[i], false);
+  free(stream.sheets);
+  definitions_free(&stream.defs);
+  dep_graph_destroy(stream.graph);
+
+  end_run(ctx);
+  if (config->stats)
+    config->stats->scratch_peak = ctx->arena.peak;
+  css_usage_destroy(owned_usage);
+  return output;
+}
 
-  char *output = NULL;
-  if (stylesheet->root) {
-    lxb_css_rule_serialize(stylesheet->root, string_serializer_cb, &output);
+bool css_optimize_windowed(css_optimizer_ctx_t *ctx, const char *css_content,
+                           size_t length, size_t max_memory,
+                           OptimizerConfig *config, css_write_cb_t write,
+                           void *user) {
+  if (!ctx || !css_content || length == 0 || !write)
+    return false;
+
+  OptimizerConfig local;
+  css_usage_t *owned_usage = NULL;
+  if (!localize_config(config, &local, &owned_usage))
+    return false;
+  config = &local;
+
+  optim_run_t run = {.config = config, .ctx = ctx, .arena = &ctx->arena};
+  ctx->arena.peak = ctx->arena.reserved;
+
+  size_t window = max_memory / WINDOW_EXPANSION;
+  if (window == 0)
+    window = 1;
+
+  dep_graph_t *graph = dep_graph_create();
+  definitions_t defs = {0};
+  bool ok = graph != NULL;
+
+  // Sweep 1: references of the rules that survive, across every window,
+  // since a variable or keyframes block may be used anywhere. Only names go
+  // into the graph, so it outlives each window's parse tree.
+  for (size_t start = 0; ok && start < length;) {
+    size_t end = rule_split_next(css_content, length, start, window);
+    lxb_css_stylesheet_t *stylesheet =
+        parse_rules(&run, (const lxb_char_t *)css_content + start,
+                    end - start, CSS_MEM_PHASE_CSS_PARSE);
+    if (!stylesheet) {
+      ok = false;
+      break;
+    }
+    ok = walk_tree(&run, stylesheet->root, graph, NULL);
+    lxb_css_stylesheet_destroy(stylesheet, false);
+    end_run(ctx);
+    start = end;
+  }
+  ok = ok && dep_graph_resolve(graph);
+
+  // Sweep 2: prune each window against the complete graph and emit it. The
+  // windows go through one sink buffer, separated the way the serializer
+  // separates top-level rules.
+  out_buf_t out = {.write = write, .user = user};
+  for (size_t start = 0; ok && start < length;) {
+    size_t end = rule_split_next(css_content, length, start, window);
+    lxb_css_stylesheet_t *stylesheet =
+        parse_rules(&run, (const lxb_char_t *)css_content + start,
+                    end - start, CSS_MEM_PHASE_CSS_PARSE);
+    if (!stylesheet) {
+      ok = false;
+      break;
+    }
+    definitions_clear(&defs);
+    walk_tree(&run, stylesheet->root, NULL, &defs);
+    remove_unused_definitions(&defs, graph);
+    flush_nested_blocks(&run, stylesheet->root);
+    ok = serialize_output(stylesheet->root, &out);
+    lxb_css_stylesheet_destroy(stylesheet, false);
+    end_run(ctx);
+    start = end;
   }
 
-  if (!output) {
-    output = calloc(1, 1);
-  } else {
-    // Fix @charset serialization: Lexbor doesn't add semicolon after @charset
-    // Look for pattern: @charset "..." and add semicolon if missing
-    char *charset_pos = strstr(output, "@charset");
-    if (charset_pos) {
-      // Find the closing quote
-      char *quote_start = strchr(charset_pos, '"');
-      if (quote_start) {
-        char *quote_end = strchr(quote_start + 1, '"');
-        if (quote_end) {
-          // Check if there's already a semicolon after the quote
-          char *next_char = quote_end + 1;
-          while (*next_char == ' ' || *next_char == '\t')
-            next_char++;
-
-          if (*next_char != ';') {
-            // Need to insert semicolon
-            size_t old_len = strlen(output);
-            size_t insert_pos = quote_end + 1 - output;
-            char *new_output = malloc(old_len + 2); // +1 for ';', +1 for '\0'
-            if (new_output) {
-              memcpy(new_output, output, insert_pos);
-              new_output[insert_pos] = ';';
-              memcpy(new_output + insert_pos + 1, output + insert_pos,
-                     old_len - insert_pos + 1);
-              free(output);
-              output = new_output;
-            }
-          }
-        }
-      }
+  if (!ok)
+    end_run(ctx);
+  ok = out_buf_close(&out) && ok;
+  definitions_free(&defs);
+  dep_graph_destroy(graph);
+
+  if (config->stats)
+    config->stats->scratch_peak = ctx->arena.peak;
+  css_usage_destroy(owned_usage);
+  return ok;
+}
+
+// --- Splice Output ---
+// Every top-level rule is parsed on its own, so once the walk and the removal
+// of unused definitions are done, each one is known to be dropped, kept as it
+// was, kept with fewer selectors, or edited otherwise. Rules kept as they
+// were are copied from the input along with the whitespace and comments
+// before them; of those with fewer selectors only the selector list is
+// rewritten. Nested blocks are not spliced: an at-rule edited anywhere inside
+// is re-serialized whole.
+
+typedef struct {
+  rule_span_t span;
+  lxb_css_stylesheet_t *stylesheet;
+  size_t top;   // its top block in the definitions, or NO_BLOCK
+  size_t edits; // made by the walk or the lazy parse
+} splice_rule_t;
+
+typedef struct {
+  optim_run_t run;
+  const char *css;
+  dep_graph_t *graph;
+  definitions_t defs;
+  splice_rule_t *rules;
+  size_t count;
+  size_t capacity;
+} splice_run_t;
+
+// Parses and walks every top-level rule
+static bool splice_parse(splice_run_t *sp, size_t length) {
+  const char *css = sp->css;
+  rule_span_t span;
+  for (size_t offset = 0; rule_split_span(css, length, offset, &span);
+       offset = span.end) {
+    if (sp->count == sp->capacity) {
+      size_t capacity = sp->capacity ? sp->capacity * 2 : 256;
+      splice_rule_t *grown = realloc(sp->rules, capacity * sizeof(*grown));
+      if (!grown)
+        return false;
+      sp->rules = grown;
+      sp->capacity = capacity;
     }
+
+    splice_rule_t *rule = &sp->rules[sp->count];
+    size_t edits = sp->run.edits;
+    size_t top = sp->defs.block_count;
+    rule->span = span;
+    rule->stylesheet =
+        parse_rules(&sp->run, (const lxb_char_t *)css + span.start,
+                    span.end - span.start, CSS_MEM_PHASE_CSS_PARSE);
+    if (!rule->stylesheet)
+      return false;
+    sp->count++;
+    if (!walk_tree(&sp->run, rule->stylesheet->root, sp->graph, &sp->defs))
+      return false;
+    rule->edits = sp->run.edits - edits;
+    rule->top = top < sp->defs.block_count && !sp->defs.blocks[top].owner
+                    ? top
+                    : NO_BLOCK;
+  }
+  return true;
+}
+
+static bool is_empty_root(const lxb_css_rule_t *root) {
+  return !root || ((root->type == LXB_CSS_RULE_LIST ||
+                    root->type == LXB_CSS_RULE_STYLESHEET) &&
+                   !((const lxb_css_rule_list_t *)root)->first);
+}
+
+// Adds a kept rule to the plan, from `from` on: the input up to the rule
+// start is the whitespace and comments that go with it.
+static bool splice_rule(splice_run_t *sp, const splice_rule_t *rule,
+                        size_t from, splice_plan_t *plan, out_buf_t *text) {
+  const rule_span_t *span = &rule->span;
+  lxb_css_rule_t *root = rule->stylesheet->root;
+  bool edited = rule->top != NO_BLOCK && sp->defs.blocks[rule->top].edited;
+  if (!edited && rule->edits == 0)
+    return splice_add_input(plan, from, span->end - from);
+  if (!splice_add_input(plan, from, span->start - from))
+    return false;
+
+  // A style rule the walk only took selectors from keeps its block
+  lxb_css_rule_t *only = root->type == LXB_CSS_RULE_LIST
+                             ? lxb_css_rule_list(root)->first
+                             : NULL;
+  if (!edited && only && !only->next && only->type == LXB_CSS_RULE_STYLE) {
+    size_t start = text->len;
+    lxb_css_selector_serialize_list_chain(lxb_css_rule_style(only)->selector,
+                                          out_buf_serializer_cb, text);
+    // Keep the whitespace between the selectors and the block
+    size_t block = span->block;
+    while (block > span->start && isspace((unsigned char)sp->css[block - 1]))
+      block--;
+    return !text->failed &&
+           splice_add_text(plan, start, text->len - start) &&
+           splice_add_input(plan, block, span->end - block);
+  }
+
+  size_t start = text->len;
+  flush_nested_blocks(&sp->run, root);
+  if (root->type == LXB_CSS_RULE_LIST) {
+    for (lxb_css_rule_t *r = lxb_css_rule_list(root)->first; r; r = r->next) {
+      if (r != lxb_css_rule_list(root)->first)
+        out_buf_append(text, "\n", 1);
+      serialize_rule(r, text);
+    }
+  } else {
+    serialize_rule(root, text);
+  }
+  return !text->failed && splice_add_text(plan, start, text->len - start);
+}
+
+// Plans the output of a stylesheet in splice mode, synthesized parts going to
+// `text`.
+static bool splice_build(css_optimizer_ctx_t *ctx, const char *css_content,
+                         size_t length, OptimizerConfig *config,
+                         splice_plan_t *plan, out_buf_t *text) {
+  OptimizerConfig local;
+  css_usage_t *owned_usage = NULL;
+  if (!localize_config(config, &local, &owned_usage))
+    return false;
+  config = &local;
+
+  splice_run_t sp = {
+      .run = {.config = config, .ctx = ctx, .arena = &ctx->arena},
+      .css = css_content,
+      .graph = dep_graph_create()};
+  ctx->arena.peak = ctx->arena.reserved;
+
+  bool ok = sp.graph && splice_parse(&sp, length) &&
+            dep_graph_resolve(sp.graph);
+  if (ok)
+    remove_unused_definitions(&sp.defs, sp.graph);
+
+  // Text after the last rule stays, as the end of the file
+  size_t from = 0;
+  for (size_t i = 0; ok && i < sp.count; i++) {
+    if (!is_empty_root(sp.rules[i].stylesheet->root))
+      ok = splice_rule(&sp, &sp.rules[i], from, plan, text);
+    from = sp.rules[i].span.end;
   }
+  ok = ok && splice_add_input(plan, from, length - from);
+
+  for (size_t i = 0; i < sp.count; i++)
+    lxb_css_stylesheet_destroy(sp.rules[i].stylesheet, false);
+  free(sp.rules);
+  definitions_free(&sp.defs);
+  dep_graph_destroy(sp.graph);
+
+  end_run(ctx);
+  if (config->stats)
+    config->stats->scratch_peak = ctx->arena.peak;
+  css_usage_destroy(owned_usage);
+  return ok;
+}
+
+bool css_optimize_splice(css_optimizer_ctx_t *ctx, const char *css_content,
+                         size_t length, OptimizerConfig *config,
+                         css_write_cb_t write, void *user) {
+  if (!ctx || !css_content || length == 0 || !write)
+    return false;
+
+  splice_plan_t plan = {0};
+  out_buf_t text = {0};
+  bool ok = splice_build(ctx, css_content, length, config, &plan, &text) &&
+            splice_write(&plan, css_content, text.data, write, user);
+  splice_plan_free(&plan);
+  free(text.data);
+  return ok;
+}
 
-  if (used_vars) {
-    free_deps(used_vars);
-    free(used_vars);
+bool css_optimize_splice_fd(css_optimizer_ctx_t *ctx, const char *css_content,
+                            size_t length, OptimizerConfig *config, int in_fd,
+                            int out_fd) {
+  if (!ctx || !css_content || length == 0 || out_fd < 0)
+    return false;
+
+  splice_plan_t plan = {0};
+  out_buf_t text = {0};
+  bool ok =
+      splice_build(ctx, css_content, length, config, &plan, &text) &&
+      splice_write_fd(&plan, css_content, text.data, in_fd, out_fd);
+  splice_plan_free(&plan);
+  free(text.data);
+  return ok;
+}
+
+// --- Parallel Optimization ---
+// One contiguous chunk of the stylesheet, with the context that holds its
+// parse tree between the two rounds.
+typedef struct {
+  const char *data;
+  size_t length;
+  OptimizerConfig *config;
+  css_optimizer_ctx_t *ctx;
+  lxb_css_stylesheet_t *stylesheet;
+
+  dep_graph_t *graph; // references of the chunk's surviving rules
+  definitions_t defs;
+  const dep_graph_t *used; // merged over all chunks for round 2
+
+  out_buf_t output;
+  size_t scratch_peak;
+  bool ok;
+} chunk_job_t;
+
+// Round 1: parse, then filter by selector and collect references and
+// definitions in one walk.
+static void *chunk_collect(void *arg) {
+  chunk_job_t *job = arg;
+  optim_run_t run = {
+      .config = job->config, .ctx = job->ctx, .arena = &job->ctx->arena};
+  job->stylesheet = parse_rules(&run, (const lxb_char_t *)job->data,
+                                job->length, CSS_MEM_PHASE_CSS_PARSE);
+  job->graph = dep_graph_create();
+  job->ok = job->stylesheet && job->graph &&
+            walk_tree(&run, job->stylesheet->root, job->graph, &job->defs);
+  return NULL;
+}
+
+// Round 2: prune against the graph of every chunk, serialize, and release
+// the chunk's context on the thread that filled it.
+static void *chunk_emit(void *arg) {
+  chunk_job_t *job = arg;
+  optim_run_t run = {
+      .config = job->config, .ctx = job->ctx, .arena = &job->ctx->arena};
+  if (job->ok) {
+    lxb_css_rule_t *root = job->stylesheet->root;
+    remove_unused_definitions(&job->defs, job->used);
+    flush_nested_blocks(&run, root);
+    job->ok = serialize_output(root, &job->output);
   }
-  if (used_anims) {
-    free_deps(used_anims);
-    free(used_anims);
+  if (job->stylesheet)
+    lxb_css_stylesheet_destroy(job->stylesheet, false);
+  job->stylesheet = NULL;
+  job->scratch_peak = job->ctx->arena.peak;
+  css_optimizer_ctx_destroy(job->ctx);
+  job->ctx = NULL;
+  return NULL;
+}
+
+char *css_optimize_parallel(const char *css_content, size_t length,
+                            OptimizerConfig *config, unsigned threads) {
+  if (!css_content || length == 0)
+    return NULL;
+  if (threads <= 1)
+    return css_optimize(css_content, length, config);
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+
+  OptimizerConfig local;
+  css_usage_t *owned_usage = NULL;
+  if (!localize_config(config, &local, &owned_usage))
+    return NULL;
+  config = &local;
+
+  // One chunk per thread, cut at top-level rule boundaries
+  chunk_job_t jobs[MAX_THREADS];
+  size_t count = 0;
+  bool ok = true;
+  for (size_t start = 0; start < length && count < threads; count++) {
+    size_t end = count + 1 == threads
+                     ? length
+                     : rule_split_next(css_content, length, start,
+                                       length / threads + 1);
+    memset(&jobs[count], 0, sizeof(chunk_job_t));
+    jobs[count].data = css_content + start;
+    jobs[count].length = end - start;
+    jobs[count].config = config;
+    jobs[count].ctx = css_optimizer_ctx_create();
+    ok = ok && jobs[count].ctx;
+    start = end;
   }
 
-  lxb_css_stylesheet_destroy(stylesheet, true);
-  lxb_css_parser_destroy(parser, true);
+  if (ok)
+    run_jobs(chunk_collect, jobs, sizeof(chunk_job_t), count);
+
+  // A definition reached from any chunk is kept in every chunk
+  dep_graph_t *used = dep_graph_create();
+  ok = ok && used;
+  for (size_t i = 0; ok && i < count; i++)
+    ok = jobs[i].ok && dep_graph_merge(used, jobs[i].graph);
+  ok = ok && dep_graph_resolve(used);
+  for (size_t i = 0; i < count; i++) {
+    jobs[i].used = used;
+    jobs[i].ok = ok;
+  }
 
-  clear_garbage();
+  // Round 2 also releases every context, so it runs even after a failure
+  bool have_contexts = true;
+  for (size_t i = 0; i < count; i++)
+    have_contexts = have_contexts && jobs[i].ctx;
+  if (have_contexts) {
+    run_jobs(chunk_emit, jobs, sizeof(chunk_job_t), count);
+  } else {
+    for (size_t i = 0; i < count; i++)
+      css_optimizer_ctx_destroy(jobs[i].ctx);
+  }
+
+  char *output = NULL;
+  out_buf_t outputs[MAX_THREADS];
+  size_t scratch_peak = 0;
+  for (size_t i = 0; i < count; i++) {
+    ok = ok && jobs[i].ok;
+    outputs[i] = jobs[i].output;
+  }
+  if (ok)
+    output = join_outputs(outputs, count);
+
+  for (size_t i = 0; i < count; i++) {
+    scratch_peak += jobs[i].scratch_peak;
+    free(jobs[i].output.data);
+    definitions_free(&jobs[i].defs);
+    dep_graph_destroy(jobs[i].graph);
+  }
+  dep_graph_destroy(used);
 
+  if (config->stats)
+    config->stats->scratch_peak = scratch_peak;
+  css_usage_destroy(owned_usage);
   return output;
 }
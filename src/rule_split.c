@@ -0,0 +1,224 @@
+#include "rule_split.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NO_BLOCK ((size_t)-1)
+
+static bool is_name_char(char c) {
+  return isalnum((unsigned char)c) || c == '-' || c == '_' ||
+         (unsigned char)c >= 0x80;
+}
+
+enum { SCAN_CODE, SCAN_STRING, SCAN_COMMENT, SCAN_URL };
+
+// Whether `i` starts an unquoted url(), whose body is raw text: 1 with
+// `*body` after `url(` and any whitespace, 0 if not, or -1 if the input
+// ends before that can be told.
+static int unquoted_url_body(const char *css, size_t length, size_t start,
+                             size_t i, size_t *body) {
+  if (i > start && is_name_char(css[i - 1]))
+    return 0;
+  static const char url[] = "url(";
+  for (size_t k = 0; k < 4; k++) {
+    if (i + k >= length)
+      return -1;
+    if (tolower((unsigned char)css[i + k]) != url[k])
+      return 0;
+  }
+  size_t b = i + 4;
+  while (b < length && isspace((unsigned char)css[b]))
+    b++;
+  if (b == length)
+    return -1;
+  if (css[b] == '"' || css[b] == '\'')
+    return 0;
+  *body = b;
+  return 1;
+}
+
+static void scan_begin(rule_scan_t *scan, size_t i) {
+  scan->pos = i;
+  scan->start = i;
+  scan->open = NO_BLOCK;
+  scan->depth = 0;
+  scan->in_rule = true;
+  scan->state = SCAN_CODE;
+  scan->escape = false;
+}
+
+// Scans on from scan->pos, first past whitespace and comments if no rule has
+// started. Returns true once the rule ends, with scan->pos after its closing
+// `}` or `;`, or with `ended` at the end of the input. Otherwise returns
+// false with scan->pos where the scan goes on, never inside a token it cannot
+// tell yet. (), [] and {} nest as in the CSS tokenizer: a closer only ends
+// the innermost open bracket of its kind and is ignored otherwise.
+static bool scan_on(rule_scan_t *scan, const char *css, size_t length,
+                    bool ended) {
+  size_t i = scan->pos;
+  while (i < length) {
+    char c = css[i];
+    if (scan->state == SCAN_STRING) {
+      // An unescaped newline ends it like the tokenizer's bad-string
+      i++;
+      if (scan->escape)
+        scan->escape = false;
+      else if (c == '\\')
+        scan->escape = true;
+      else if (c == scan->quote || c == '\n')
+        scan->state = SCAN_CODE;
+      continue;
+    }
+    if (scan->state == SCAN_COMMENT) {
+      i++;
+      if (scan->star && c == '/')
+        scan->state = SCAN_CODE;
+      scan->star = c == '*';
+      continue;
+    }
+    if (scan->state == SCAN_URL) {
+      i++;
+      if (c == ')')
+        scan->state = SCAN_CODE;
+      continue;
+    }
+    if (scan->escape) {
+      scan->escape = false;
+      i++;
+      continue;
+    }
+
+    if (c == '/') {
+      if (i + 1 == length && !ended)
+        break;
+      if (i + 1 < length && css[i + 1] == '*') {
+        scan->state = SCAN_COMMENT;
+        scan->star = false;
+        i += 2;
+        continue;
+      }
+    }
+    if (!scan->in_rule) {
+      // Whitespace and comments between rules belong to no rule
+      if (isspace((unsigned char)c)) {
+        i++;
+        continue;
+      }
+      scan_begin(scan, i);
+    }
+    if (c == '"' || c == '\'') {
+      scan->state = SCAN_STRING;
+      scan->quote = c;
+      i++;
+      continue;
+    }
+    if (c == '\\') {
+      scan->escape = true;
+      i++;
+      continue;
+    }
+    if (c == 'u' || c == 'U') {
+      size_t body;
+      int url = unquoted_url_body(css, length, scan->start, i, &body);
+      if (url < 0 && !ended)
+        break;
+      if (url > 0) {
+        scan->state = SCAN_URL;
+        i = body;
+        continue;
+      }
+    }
+
+    i++;
+    if (c == '{' || c == '(' || c == '[') {
+      if (c == '{' && scan->depth == 0)
+        scan->open = i - 1;
+      // Past the limit brackets are only counted, and any closer matches
+      if (scan->depth < RULE_SPLIT_NESTING)
+        scan->closers[scan->depth] = c == '{' ? '}' : c == '(' ? ')' : ']';
+      scan->depth++;
+    } else if (c == '}' || c == ')' || c == ']') {
+      if (scan->depth > 0 && (scan->depth > RULE_SPLIT_NESTING ||
+                              scan->closers[scan->depth - 1] == c))
+        scan->depth--;
+      else if (scan->depth > 0 || c != '}')
+        continue;
+      // A stray `}` at the top level ends a rule of its own, which the
+      // parser drops
+      if (scan->depth == 0 && c == '}') {
+        scan->pos = i;
+        return true;
+      }
+    } else if (c == ';' && scan->depth == 0) {
+      scan->pos = i;
+      return true;
+    }
+  }
+  scan->pos = i;
+  return ended && scan->in_rule;
+}
+
+// Scans the top-level rule starting at `i` in complete input and returns the
+// position after its closing `}` or `;`, or `length` if it is unterminated.
+// `*block` gets the position of the `{` opening its block, or the returned
+// end if it has none.
+static size_t scan_rule(const char *css, size_t length, size_t i,
+                        size_t *block) {
+  rule_scan_t scan;
+  scan_begin(&scan, i);
+  scan_on(&scan, css, length, true);
+  *block = scan.open == NO_BLOCK ? scan.pos : scan.open;
+  return scan.pos;
+}
+
+size_t rule_split_next(const char *css, size_t length, size_t start,
+                       size_t window) {
+  if (window >= length - start)
+    return length;
+  size_t limit = start + window;
+
+  size_t last = 0; // latest boundary within the limit; never equal to start
+  for (size_t i = start; i < length;) {
+    size_t block;
+    size_t end = scan_rule(css, length, i, &block);
+    if (end > limit)
+      return last ? last : end;
+    last = end;
+    i = end;
+  }
+  return last ? last : length;
+}
+
+bool rule_split_span(const char *css, size_t length, size_t offset,
+                     rule_span_t *span) {
+  rule_scan_t scan;
+  rule_scan_init(&scan, offset);
+  return rule_scan_next(&scan, css, length, true, span);
+}
+
+void rule_scan_init(rule_scan_t *scan, size_t offset) {
+  scan->pos = offset;
+  scan->in_rule = false;
+  scan->state = SCAN_CODE;
+  scan->escape = false;
+}
+
+bool rule_scan_next(rule_scan_t *scan, const char *css, size_t length,
+                    bool ended, rule_span_t *span) {
+  if (!scan_on(scan, css, length, ended))
+    return false;
+  span->start = scan->start;
+  span->block = scan->open == NO_BLOCK ? scan->pos : scan->open;
+  span->end = scan->pos;
+  scan->in_rule = false;
+  return true;
+}
+
+void rule_scan_shift(rule_scan_t *scan, size_t bytes) {
+  scan->pos -= bytes;
+  if (scan->in_rule) {
+    scan->start -= bytes;
+    if (scan->open != NO_BLOCK)
+      scan->open -= bytes;
+  }
+}
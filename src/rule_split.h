@@ -0,0 +1,66 @@
+#ifndef CSSOPTIM_RULE_SPLIT_H
+#define CSSOPTIM_RULE_SPLIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Finds top-level rule boundaries in raw stylesheet text: after a `}`
+ * closing a top-level block, or after a `;` ending a top-level statement such
+ * as @import. Strings, comments, escapes and unquoted url() bodies are
+ * skipped, so braces inside them never count. A window cut at boundaries
+ * parses on its own to the same rules it held in the whole stylesheet.
+ */
+
+// Returns the end of the window starting at `start`: the last boundary within
+// `window` bytes, or the first one after it when a single rule is larger.
+// Returns `length` once the rest of the input fits.
+size_t rule_split_next(const char *css, size_t length, size_t start,
+                       size_t window);
+
+// One top-level rule: its prelude runs from `start` to `block`, the `{`
+// opening its block (or `end` for a statement), and the rule ends at `end`,
+// past its closing `}` or `;`.
+typedef struct {
+  size_t start;
+  size_t block;
+  size_t end;
+} rule_span_t;
+
+// Finds the first rule at or after `offset`, skipping whitespace and
+// comments. Returns false at the end of the input.
+bool rule_split_span(const char *css, size_t length, size_t offset,
+                     rule_span_t *span);
+
+// Brackets tracked per rule; deeper ones are only counted
+#define RULE_SPLIT_NESTING 64
+
+// Rules found in input that arrives in pieces. The scan stops at the end of
+// what has arrived and goes on from there once there is more, so every byte
+// is scanned once however the input is cut. Positions are offsets into the
+// caller's buffer.
+typedef struct {
+  size_t pos;   // where the scan goes on
+  size_t start; // of the rule being scanned
+  size_t open;  // the `{` opening its block, if seen yet
+  size_t depth;
+  bool in_rule;
+  unsigned char state; // in code, a string, a comment or a url() body
+  bool escape;
+  bool star; // a comment's last byte was `*`
+  char quote;
+  char closers[RULE_SPLIT_NESTING];
+} rule_scan_t;
+
+void rule_scan_init(rule_scan_t *scan, size_t offset);
+
+// Finds the next rule like rule_split_span(), in `length` bytes that more
+// input may follow. Returns false until the rule is complete; with `ended`
+// the input is whole and an unterminated rule ends at `length`.
+bool rule_scan_next(rule_scan_t *scan, const char *css, size_t length,
+                    bool ended, rule_span_t *span);
+
+// Follows the buffer after `bytes` before the rule being scanned were
+// dropped from its front.
+void rule_scan_shift(rule_scan_t *scan, size_t bytes);
+
+#endif // CSSOPTIM_RULE_SPLIT_H
@@ -1,4 +1,5 @@
 #include "cssoptim/scanner.h"
+#include "cssoptim/memory.h"
 #include <ctype.h>
 #include <lexbor/dom/collection.h>
 #include <lexbor/dom/interfaces/element.h>
@@ -9,73 +10,120 @@
 
 /* Implementation of scanner logic using Lexbor. */
 
+/* Destination for scanned names: plain string lists (any may be NULL) and/or
+ * a shared usage set.
+ */
+typedef struct {
+  string_list_t *classes;
+  string_list_t *tags;
+  string_list_t *attrs;
+  css_usage_t *usage;
+} scan_sink_t;
+
+static void sink_add(const scan_sink_t *sink, css_usage_kind_t kind,
+                     const char *str, size_t len) {
+  string_list_t *list = kind == CSS_USAGE_CLASS ? sink->classes
+                        : kind == CSS_USAGE_TAG ? sink->tags
+                                                : sink->attrs;
+  if (list)
+    string_list_add_n(list, str, len);
+  if (sink->usage)
+    css_usage_add(sink->usage, kind, str, len);
+}
+
+static bool sink_wants(const scan_sink_t *sink, css_usage_kind_t kind) {
+  if (sink->usage)
+    return true;
+  return kind == CSS_USAGE_CLASS ? sink->classes != NULL
+         : kind == CSS_USAGE_TAG ? sink->tags != NULL
+                                 : sink->attrs != NULL;
+}
+
+/* Splits a span on any of the delimiter characters and adds each non-empty
+ * token to the sink, without copying the span first.
+ */
+static void add_tokens(const scan_sink_t *sink, css_usage_kind_t kind,
+                       const char *data, size_t len, const char *delims) {
+  size_t i = 0;
+  while (i < len) {
+    while (i < len && strchr(delims, data[i]))
+      i++;
+    size_t start = i;
+    while (i < len && !strchr(delims, data[i]))
+      i++;
+    if (i > start)
+      sink_add(sink, kind, data + start, i - start);
+  }
+}
+
 /* DOM Traversal Helper
  * Recursively scans an element and its children for the 'class' attribute and
  * tag names.
  */
 static lxb_status_t scan_element(lxb_dom_element_t *element,
-                                 string_list_t *classes, string_list_t *tags,
-                                 string_list_t *attrs) {
+                                 const scan_sink_t *sink) {
   // 1. Collect tag name
-  if (tags) {
-    const lxb_char_t *local_name = lxb_dom_element_local_name(element, NULL);
+  if (sink_wants(sink, CSS_USAGE_TAG)) {
+    size_t name_len = 0;
+    const lxb_char_t *local_name =
+        lxb_dom_element_local_name(element, &name_len);
     if (local_name) {
-      string_list_add(tags, (const char *)local_name);
+      if (sink->tags)
+        string_list_add_n(sink->tags, (const char *)local_name, name_len);
+      // Usage sets key standard tags by lexbor tag ID
+      if (sink->usage)
+        css_usage_add_tag_id(sink->usage, lxb_dom_element_tag_id(element),
+                             (const char *)local_name, name_len);
     }
   }
 
   // 2. Collect attributes
-  if (attrs) {
+  if (sink_wants(sink, CSS_USAGE_ATTR)) {
     lxb_dom_attr_t *attr = lxb_dom_element_first_attribute(element);
     while (attr) {
-      const lxb_char_t *name = lxb_dom_attr_local_name(attr, NULL);
+      size_t name_len = 0;
+      const lxb_char_t *name = lxb_dom_attr_local_name(attr, &name_len);
       size_t val_len = 0;
       const lxb_char_t *value = lxb_dom_attr_value(attr, &val_len);
 
-      if (name) {
+      if (name && sink->usage) {
+        // Usage sets index the value under its attribute name
+        css_usage_add_attr(sink->usage, (const char *)name, name_len,
+                           (const char *)value, value ? val_len : 0);
+      }
+
+      if (name && sink->attrs) {
         // Add plain attribute name
-        string_list_add(attrs, (const char *)name);
+        string_list_add_n(sink->attrs, (const char *)name, name_len);
 
         if (value && val_len > 0) {
-          // Add name=value pair
-          size_t name_len = strlen((const char *)name);
-          char *pair = malloc(name_len + val_len + 2);
+          // Add name=value pair, built on the stack unless it is unusually long
+          size_t pair_len = name_len + 1 + val_len;
+          char stack_pair[256];
+          char *pair =
+              pair_len <= sizeof(stack_pair) ? stack_pair : malloc(pair_len);
           if (pair) {
             memcpy(pair, name, name_len);
             pair[name_len] = '=';
             memcpy(pair + name_len + 1, value, val_len);
-            pair[name_len + 1 + val_len] = '\0';
-            string_list_add(attrs, pair);
-            free(pair);
+            string_list_add_n(sink->attrs, pair, pair_len);
+            if (pair != stack_pair)
+              free(pair);
           }
         }
       }
-      // Move to next attribute
-      lxb_dom_node_t *next_node =
-          lxb_dom_node_next(lxb_dom_interface_node(attr));
-      attr = (next_node && next_node->type == LXB_DOM_NODE_TYPE_ATTRIBUTE)
-                 ? (lxb_dom_attr_t *)next_node
-                 : NULL;
+      attr = lxb_dom_element_next_attribute(attr);
     }
   }
 
   // 3. Collect classes
-  if (classes) {
+  if (sink_wants(sink, CSS_USAGE_CLASS)) {
     size_t value_len = 0;
     const lxb_char_t *class_attr = lxb_dom_element_get_attribute(
         element, (const lxb_char_t *)"class", 5, &value_len);
     if (class_attr && value_len > 0) {
-      char *copy = malloc(value_len + 1);
-      if (copy) {
-        memcpy(copy, class_attr, value_len);
-        copy[value_len] = '\0';
-        char *token = strtok(copy, " \t\n\r");
-        while (token) {
-          string_list_add(classes, token);
-          token = strtok(NULL, " \t\n\r");
-        }
-        free(copy);
-      }
+      add_tokens(sink, CSS_USAGE_CLASS, (const char *)class_attr, value_len,
+                 " \t\n\r");
     }
   }
 
@@ -84,7 +132,7 @@ static lxb_status_t scan_element(lxb_dom_element_t *element,
       lxb_dom_node_first_child(lxb_dom_interface_node(element));
   while (child) {
     if (child->type == LXB_DOM_NODE_TYPE_ELEMENT) {
-      scan_element(lxb_dom_interface_element(child), classes, tags, attrs);
+      scan_element(lxb_dom_interface_element(child), sink);
     }
     child = child->next;
   }
@@ -92,44 +140,96 @@ static lxb_status_t scan_element(lxb_dom_element_t *element,
   return LXB_STATUS_OK;
 }
 
-void scan_html(const char *content, size_t length, string_list_t *classes,
-               string_list_t *tags, string_list_t *attrs) {
-  if (!content || length == 0)
+/* Reusable HTML parsing state. The document keeps its parser and memory
+ * between pages; lexbor cleans the parser before each parse.
+ */
+struct css_scanner {
+  lxb_html_document_t *document;
+};
+
+css_scanner_t *css_scanner_create(void) {
+  return calloc(1, sizeof(css_scanner_t));
+}
+
+void css_scanner_destroy(css_scanner_t *scanner) {
+  if (!scanner)
     return;
+  if (scanner->document)
+    lxb_html_document_destroy(scanner->document);
+  free(scanner);
+}
 
-  lxb_html_parser_t *parser = lxb_html_parser_create();
-  if (!parser)
+static void scan_document(css_scanner_t *scanner, const char *content,
+                          size_t length, const scan_sink_t *sink) {
+  if (!content || length == 0)
     return;
-  lxb_html_parser_init(parser);
 
-  lxb_html_document_t *document =
-      lxb_html_parse(parser, (const lxb_char_t *)content, length);
-  if (!document) {
-    lxb_html_parser_destroy(parser);
+  css_mem_phase_t phase = css_mem_phase_enter(CSS_MEM_PHASE_HTML_PARSE);
+  if (!scanner->document)
+    scanner->document = lxb_html_document_create();
+  else
+    lxb_html_document_clean(scanner->document);
+
+  lxb_html_document_t *document = scanner->document;
+  lxb_status_t status =
+      document ? lxb_html_document_parse(document, (const lxb_char_t *)content,
+                                         length)
+               : LXB_STATUS_ERROR;
+  css_mem_phase_enter(phase);
+  if (status != LXB_STATUS_OK)
     return;
-  }
 
   lxb_dom_element_t *body =
       (lxb_dom_element_t *)lxb_html_document_body_element(document);
   if (body) {
-    scan_element(body, classes, tags, attrs);
+    scan_element(body, sink);
   } else {
     lxb_dom_node_t *node =
         lxb_dom_node_first_child(lxb_dom_interface_node(document));
     while (node) {
       if (node->type == LXB_DOM_NODE_TYPE_ELEMENT) {
-        scan_element(lxb_dom_interface_element(node), classes, tags, attrs);
+        scan_element(lxb_dom_interface_element(node), sink);
       }
       node = node->next;
     }
   }
+}
 
-  lxb_html_document_destroy(document);
-  lxb_html_parser_destroy(parser);
+// One-off scans use a scanner of their own
+static void scan_document_once(const char *content, size_t length,
+                               const scan_sink_t *sink) {
+  css_scanner_t *scanner = css_scanner_create();
+  if (!scanner)
+    return;
+  scan_document(scanner, content, length, sink);
+  css_scanner_destroy(scanner);
 }
 
-// Public API: Scans JS/TS/JSX content for potential class names in strings
-void scan_js(const char *content, size_t length, string_list_t *list) {
+void scan_html(const char *content, size_t length, string_list_t *classes,
+               string_list_t *tags, string_list_t *attrs) {
+  scan_sink_t sink = {
+      .classes = classes, .tags = tags, .attrs = attrs, .usage = NULL};
+  scan_document_once(content, length, &sink);
+}
+
+void scan_html_usage(const char *content, size_t length, css_usage_t *usage) {
+  scan_sink_t sink = {
+      .classes = NULL, .tags = NULL, .attrs = NULL, .usage = usage};
+  scan_document_once(content, length, &sink);
+}
+
+void scan_html_usage_ctx(css_scanner_t *scanner, const char *content,
+                         size_t length, css_usage_t *usage) {
+  scan_sink_t sink = {
+      .classes = NULL, .tags = NULL, .attrs = NULL, .usage = usage};
+  if (scanner)
+    scan_document(scanner, content, length, &sink);
+  else
+    scan_document_once(content, length, &sink);
+}
+
+static void scan_script(const char *content, size_t length,
+                        const scan_sink_t *sink) {
   if (!content || length == 0)
     return;
 
@@ -152,25 +252,9 @@ void scan_js(const char *content, size_t length, string_list_t *list) {
         // Found end of string literal
         size_t token_len = &content[i] - start;
         if (token_len > 0) {
-          char *str = malloc(token_len + 1);
-          if (str) {
-            memcpy(str, start, token_len);
-            str[token_len] = '\0';
-
-            // Split string content by whitespace and delimiters as potential
-            // classes
-            char *temp = malloc(token_len + 1);
-            if (temp) {
-              memcpy(temp, str, token_len + 1);
-              char *t = strtok(temp, " \t\n\r,;:");
-              while (t) {
-                string_list_add(list, t);
-                t = strtok(NULL, " \t\n\r,;:");
-              }
-              free(temp);
-            }
-            free(str);
-          }
+          // Split string content by whitespace and delimiters as potential
+          // classes
+          add_tokens(sink, CSS_USAGE_CLASS, start, token_len, " \t\n\r,;:");
         }
         in_string = false;
       }
@@ -200,3 +284,16 @@ void scan_js(const char *content, size_t length, string_list_t *list) {
     }
   }
 }
+
+// Public API: Scans JS/TS/JSX content for potential class names in strings
+void scan_js(const char *content, size_t length, string_list_t *list) {
+  scan_sink_t sink = {
+      .classes = list, .tags = NULL, .attrs = NULL, .usage = NULL};
+  scan_script(content, length, &sink);
+}
+
+void scan_js_usage(const char *content, size_t length, css_usage_t *usage) {
+  scan_sink_t sink = {
+      .classes = NULL, .tags = NULL, .attrs = NULL, .usage = usage};
+  scan_script(content, length, &sink);
+}
@@ -0,0 +1,474 @@
+#include "selector_program.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A selector's key is the class, or failing that the tag, of its rightmost
+ * compound, as browsers use to index rules. Bucket 2 * symbol holds class
+ * keys and 2 * symbol + 1 tag keys, so an unused name drops every selector
+ * in its bucket without evaluating them.
+ */
+#define NO_KEY UINT32_MAX
+#define PENDING 0xff
+
+struct selector_program {
+  symtab_t *symbols;
+  uint8_t *symbol_ops; // per symbol: SELOP_BIT mask of referencing ops
+  uint8_t *verdicts;   // per symbol: SELPROG_FAIL_* bits
+  size_t symbol_capacity;
+
+  // Instructions
+  uint8_t *ops;
+  uint32_t *operands;
+  size_t op_count;
+  size_t op_capacity;
+
+  // Selectors: instruction range [op_start[i], op_start[i + 1])
+  uint32_t *op_start;
+  lxb_css_selector_list_t **selectors;
+  uint32_t *keys; // rightmost key bucket, or NO_KEY
+  uint8_t *keep;
+  size_t selector_count;
+  size_t selector_capacity;
+
+  // Rightmost-key buckets: selectors of bucket b are
+  // bucket_selectors[bucket_start[b] .. bucket_start[b + 1]]
+  uint32_t *bucket_start;
+  uint32_t *bucket_selectors;
+  size_t bucket_count;
+
+  // Rules: selector range [selector_start[i], selector_start[i + 1])
+  lxb_css_rule_t **rules;
+  lxb_css_rule_list_t **parents;
+  uint32_t *selector_start;
+  size_t rule_count;
+  size_t rule_capacity;
+
+  selprog_attr_t *attrs;
+  uint8_t *attr_verdicts;
+  size_t attr_count;
+  size_t attr_capacity;
+};
+
+// Grows each array in `arrays` (element sizes in `sizes`) to hold one more
+// item beyond `count`. Extra slots stay reserved for the end sentinel.
+static bool grow_arrays(void **arrays[], const size_t sizes[], size_t n,
+                        size_t count, size_t *capacity) {
+  if (count + 1 < *capacity)
+    return true;
+  size_t new_capacity = *capacity ? *capacity * 2 : 64;
+  for (size_t i = 0; i < n; i++) {
+    void *grown = realloc(*arrays[i], new_capacity * sizes[i]);
+    if (!grown)
+      return false;
+    *arrays[i] = grown;
+  }
+  *capacity = new_capacity;
+  return true;
+}
+
+static symbol_id_t intern(selector_program_t *program, const lexbor_str_t *name,
+                          selop_t op) {
+  const char *data = name->data ? (const char *)name->data : "";
+  symbol_id_t id = symtab_intern(program->symbols, data, name->length);
+  if (id == SYMBOL_NONE)
+    return SYMBOL_NONE;
+
+  if (id >= program->symbol_capacity) {
+    size_t capacity = program->symbol_capacity ? program->symbol_capacity * 2
+                                               : 64;
+    uint8_t *ops = realloc(program->symbol_ops, capacity);
+    if (!ops)
+      return SYMBOL_NONE;
+    program->symbol_ops = ops;
+    uint8_t *verdicts = realloc(program->verdicts, capacity);
+    if (!verdicts)
+      return SYMBOL_NONE;
+    program->verdicts = verdicts;
+    memset(ops + program->symbol_capacity, 0,
+           capacity - program->symbol_capacity);
+    memset(verdicts + program->symbol_capacity, 0,
+           capacity - program->symbol_capacity);
+    program->symbol_capacity = capacity;
+  }
+  program->symbol_ops[id] |= SELOP_BIT(op);
+  return id;
+}
+
+static bool emit(selector_program_t *program, selop_t op, uint32_t operand) {
+  void **arrays[] = {(void **)&program->ops, (void **)&program->operands};
+  const size_t sizes[] = {sizeof(uint8_t), sizeof(uint32_t)};
+  if (!grow_arrays(arrays, sizes, 2, program->op_count,
+                   &program->op_capacity))
+    return false;
+  program->ops[program->op_count] = (uint8_t)op;
+  program->operands[program->op_count] = operand;
+  program->op_count++;
+  return true;
+}
+
+static css_attr_match_t attr_op(const lxb_css_selector_attribute_t *attr) {
+  if (!attr->value.data)
+    return CSS_ATTR_EXISTS;
+  switch (attr->match) {
+  case LXB_CSS_SELECTOR_MATCH_INCLUDE:
+    return CSS_ATTR_INCLUDE;
+  case LXB_CSS_SELECTOR_MATCH_DASH:
+    return CSS_ATTR_DASH;
+  case LXB_CSS_SELECTOR_MATCH_PREFIX:
+    return CSS_ATTR_PREFIX;
+  case LXB_CSS_SELECTOR_MATCH_SUFFIX:
+    return CSS_ATTR_SUFFIX;
+  case LXB_CSS_SELECTOR_MATCH_SUBSTRING:
+    return CSS_ATTR_SUBSTRING;
+  default:
+    return CSS_ATTR_EQUAL;
+  }
+}
+
+static bool compile_attr(selector_program_t *program,
+                         const lxb_css_selector_t *sel) {
+  void **arrays[] = {(void **)&program->attrs,
+                     (void **)&program->attr_verdicts};
+  const size_t sizes[] = {sizeof(selprog_attr_t), sizeof(uint8_t)};
+  if (!grow_arrays(arrays, sizes, 2, program->attr_count,
+                   &program->attr_capacity))
+    return false;
+
+  selprog_attr_t *attr = &program->attrs[program->attr_count];
+  attr->name = SYMBOL_NONE;
+  if (sel->name.data) {
+    attr->name = intern(program, &sel->name, SELOP_ATTR);
+    if (attr->name == SYMBOL_NONE)
+      return false;
+  }
+  attr->op = attr_op(&sel->u.attribute);
+  attr->value = (const char *)sel->u.attribute.value.data;
+  attr->value_len = sel->u.attribute.value.length;
+  attr->ignore_case =
+      sel->u.attribute.modifier == LXB_CSS_SELECTOR_MODIFIER_I;
+  program->attr_verdicts[program->attr_count] = 0;
+
+  return emit(program, SELOP_ATTR, (uint32_t)program->attr_count++);
+}
+
+static bool compile_selector(selector_program_t *program,
+                             lxb_css_selector_list_t *list) {
+  void **arrays[] = {(void **)&program->op_start,
+                     (void **)&program->selectors, (void **)&program->keys,
+                     (void **)&program->keep};
+  const size_t sizes[] = {sizeof(uint32_t), sizeof(lxb_css_selector_list_t *),
+                          sizeof(uint32_t), sizeof(uint8_t)};
+  if (!grow_arrays(arrays, sizes, 4, program->selector_count,
+                   &program->selector_capacity))
+    return false;
+  size_t index = program->selector_count++;
+  program->op_start[index] = (uint32_t)program->op_count;
+  program->selectors[index] = list;
+
+  uint32_t class_key = NO_KEY;
+  uint32_t tag_key = NO_KEY;
+  bool universal = false; // a universal selector may keep it before the key
+
+  for (lxb_css_selector_t *sel = list->first; sel; sel = sel->next) {
+    if (sel != list->first &&
+        sel->combinator != LXB_CSS_SELECTOR_COMBINATOR_CLOSE) {
+      // A new compound starts; only the rightmost one provides the key
+      class_key = tag_key = NO_KEY;
+    }
+
+    symbol_id_t id;
+    switch (sel->type) {
+    case LXB_CSS_SELECTOR_TYPE_CLASS:
+      id = intern(program, &sel->name, SELOP_CLASS);
+      if (id == SYMBOL_NONE || !emit(program, SELOP_CLASS, id))
+        return false;
+      if (class_key == NO_KEY && !universal)
+        class_key = 2 * id;
+      break;
+    case LXB_CSS_SELECTOR_TYPE_ELEMENT:
+      if (sel->name.length == 1 && sel->name.data[0] == '*') {
+        if (!emit(program, SELOP_UNIVERSAL, 0))
+          return false;
+        universal = true;
+      } else if (sel->name.length > 0) {
+        id = intern(program, &sel->name, SELOP_TAG);
+        if (id == SYMBOL_NONE || !emit(program, SELOP_TAG, id))
+          return false;
+        if (tag_key == NO_KEY && !universal)
+          tag_key = 2 * id + 1;
+      }
+      break;
+    case LXB_CSS_SELECTOR_TYPE_ATTRIBUTE:
+      if (!compile_attr(program, sel))
+        return false;
+      break;
+    case LXB_CSS_SELECTOR_TYPE_PSEUDO_ELEMENT:
+      if (sel->name.length > 0) {
+        id = intern(program, &sel->name, SELOP_PSEUDO_ELEMENT);
+        if (id == SYMBOL_NONE || !emit(program, SELOP_PSEUDO_ELEMENT, id))
+          return false;
+      }
+      break;
+    default:
+      // IDs, pseudo-classes and functional selectors never remove a rule
+      break;
+    }
+  }
+
+  program->keys[index] = class_key != NO_KEY ? class_key : tag_key;
+  return true;
+}
+
+// Groups selectors by key (a counting sort, so buckets keep document order)
+static bool build_buckets(selector_program_t *program) {
+  program->bucket_count = 2 * symtab_count(program->symbols);
+  program->bucket_start =
+      calloc(program->bucket_count + 1, sizeof(uint32_t));
+  program->bucket_selectors =
+      malloc((program->selector_count + 1) * sizeof(uint32_t));
+  if (!program->bucket_start || !program->bucket_selectors)
+    return false;
+
+  for (size_t s = 0; s < program->selector_count; s++) {
+    if (program->keys[s] != NO_KEY)
+      program->bucket_start[program->keys[s] + 1]++;
+  }
+  for (size_t b = 0; b < program->bucket_count; b++)
+    program->bucket_start[b + 1] += program->bucket_start[b];
+
+  uint32_t *fill = malloc((program->bucket_count + 1) * sizeof(uint32_t));
+  if (!fill)
+    return false;
+  memcpy(fill, program->bucket_start,
+         (program->bucket_count + 1) * sizeof(uint32_t));
+  for (size_t s = 0; s < program->selector_count; s++) {
+    if (program->keys[s] != NO_KEY)
+      program->bucket_selectors[fill[program->keys[s]]++] = (uint32_t)s;
+  }
+  free(fill);
+  return true;
+}
+
+static bool compile_rule(selector_program_t *program, lxb_css_rule_t *rule,
+                         lxb_css_rule_list_t *parent,
+                         lxb_css_selector_list_t *selectors) {
+  void **arrays[] = {(void **)&program->rules, (void **)&program->parents,
+                     (void **)&program->selector_start};
+  const size_t sizes[] = {sizeof(lxb_css_rule_t *),
+                          sizeof(lxb_css_rule_list_t *), sizeof(uint32_t)};
+  if (!grow_arrays(arrays, sizes, 3, program->rule_count,
+                   &program->rule_capacity))
+    return false;
+  program->rules[program->rule_count] = rule;
+  program->parents[program->rule_count] = parent;
+  program->selector_start[program->rule_count] =
+      (uint32_t)program->selector_count;
+  program->rule_count++;
+
+  for (lxb_css_selector_list_t *list = selectors; list; list = list->next) {
+    if (!compile_selector(program, list))
+      return false;
+  }
+  return true;
+}
+
+static bool compile_list(selector_program_t *program,
+                         lxb_css_rule_list_t *list) {
+  for (lxb_css_rule_t *rule = list->first; rule; rule = rule->next) {
+    if (rule->type == LXB_CSS_RULE_STYLE) {
+      if (!compile_rule(program, rule, list,
+                        lxb_css_rule_style(rule)->selector))
+        return false;
+    } else if (rule->type == LXB_CSS_RULE_LIST) {
+      if (!compile_list(program, lxb_css_rule_list(rule)))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Builds the buckets and end sentinels once every rule is compiled.
+static bool finish(selector_program_t *program) {
+  if (!build_buckets(program))
+    return false;
+  // End sentinels (grow_arrays always leaves room for one)
+  if (program->selector_capacity)
+    program->op_start[program->selector_count] = (uint32_t)program->op_count;
+  if (program->rule_capacity)
+    program->selector_start[program->rule_count] =
+        (uint32_t)program->selector_count;
+  return true;
+}
+
+static selector_program_t *create(void) {
+  selector_program_t *program = calloc(1, sizeof(selector_program_t));
+  if (!program)
+    return NULL;
+  program->symbols = symtab_create();
+  if (!program->symbols) {
+    free(program);
+    return NULL;
+  }
+  return program;
+}
+
+selector_program_t *selector_program_compile(lxb_css_rule_t *root) {
+  if (!root || (root->type != LXB_CSS_RULE_LIST &&
+                root->type != LXB_CSS_RULE_STYLESHEET))
+    return NULL;
+
+  selector_program_t *program = create();
+  if (program && (!compile_list(program, (lxb_css_rule_list_t *)root) ||
+                  !finish(program))) {
+    selector_program_destroy(program);
+    return NULL;
+  }
+  return program;
+}
+
+selector_program_t *
+selector_program_compile_lists(lxb_css_selector_list_t *const *lists,
+                               size_t count) {
+  selector_program_t *program = create();
+  if (!program)
+    return NULL;
+  for (size_t i = 0; i < count; i++) {
+    if (!compile_rule(program, NULL, NULL, lists[i])) {
+      selector_program_destroy(program);
+      return NULL;
+    }
+  }
+  if (!finish(program)) {
+    selector_program_destroy(program);
+    return NULL;
+  }
+  return program;
+}
+
+void selector_program_destroy(selector_program_t *program) {
+  if (!program)
+    return;
+  symtab_destroy(program->symbols);
+  free(program->symbol_ops);
+  free(program->verdicts);
+  free(program->ops);
+  free(program->operands);
+  free(program->op_start);
+  free(program->selectors);
+  free(program->keys);
+  free(program->keep);
+  free(program->bucket_start);
+  free(program->bucket_selectors);
+  free(program->rules);
+  free(program->parents);
+  free(program->selector_start);
+  free(program->attrs);
+  free(program->attr_verdicts);
+  free(program);
+}
+
+const symtab_t *selector_program_symbols(const selector_program_t *program) {
+  return program->symbols;
+}
+
+uint8_t selector_program_symbol_ops(const selector_program_t *program,
+                                    symbol_id_t id) {
+  return id < symtab_count(program->symbols) ? program->symbol_ops[id] : 0;
+}
+
+void selector_program_set_verdict(selector_program_t *program, symbol_id_t id,
+                                  uint8_t fail) {
+  if (id < symtab_count(program->symbols))
+    program->verdicts[id] = fail;
+}
+
+size_t selector_program_attr_count(const selector_program_t *program) {
+  return program->attr_count;
+}
+
+const selprog_attr_t *selector_program_attr(const selector_program_t *program,
+                                            size_t index) {
+  return index < program->attr_count ? &program->attrs[index] : NULL;
+}
+
+void selector_program_set_attr_verdict(selector_program_t *program,
+                                       size_t index, bool fail) {
+  if (index < program->attr_count)
+    program->attr_verdicts[index] = fail;
+}
+
+const uint8_t *selector_program_run(selector_program_t *program,
+                                    bool universal_keeps) {
+  if (!program || program->selector_count == 0)
+    return NULL;
+
+  const uint8_t *ops = program->ops;
+  const uint32_t *operands = program->operands;
+  const uint8_t *verdicts = program->verdicts;
+  const uint8_t *attr_verdicts = program->attr_verdicts;
+
+  // Unused keys drop their whole bucket without evaluating any selector
+  memset(program->keep, PENDING, program->selector_count);
+  for (size_t b = 0; b < program->bucket_count; b++) {
+    uint32_t first = program->bucket_start[b];
+    uint32_t last = program->bucket_start[b + 1];
+    if (first == last)
+      continue;
+    uint8_t op = (b & 1) ? SELOP_TAG : SELOP_CLASS;
+    if (!(verdicts[b / 2] & SELOP_BIT(op)))
+      continue;
+    for (uint32_t i = first; i < last; i++)
+      program->keep[program->bucket_selectors[i]] = 0;
+  }
+
+  // Selectors with a used key or no key at all get a full evaluation
+  for (size_t s = 0; s < program->selector_count; s++) {
+    if (program->keep[s] != PENDING)
+      continue;
+    uint8_t keep = 1;
+    uint32_t end = program->op_start[s + 1];
+    for (uint32_t pc = program->op_start[s]; pc < end; pc++) {
+      uint8_t op = ops[pc];
+      if (op == SELOP_UNIVERSAL) {
+        if (universal_keeps)
+          break;
+      } else if (op == SELOP_ATTR) {
+        if (attr_verdicts[operands[pc]]) {
+          keep = 0;
+          break;
+        }
+      } else if (verdicts[operands[pc]] & SELOP_BIT(op)) {
+        keep = 0;
+        break;
+      }
+    }
+    program->keep[s] = keep;
+  }
+  return program->keep;
+}
+
+size_t selector_program_rule_count(const selector_program_t *program) {
+  return program ? program->rule_count : 0;
+}
+
+lxb_css_rule_t *selector_program_rule(const selector_program_t *program,
+                                      size_t index,
+                                      lxb_css_rule_list_t **parent,
+                                      size_t *first_selector,
+                                      size_t *selector_count) {
+  if (index >= program->rule_count)
+    return NULL;
+  if (parent)
+    *parent = program->parents[index];
+  if (first_selector)
+    *first_selector = program->selector_start[index];
+  if (selector_count)
+    *selector_count =
+        program->selector_start[index + 1] - program->selector_start[index];
+  return program->rules[index];
+}
+
+lxb_css_selector_list_t *
+selector_program_selector(const selector_program_t *program, size_t index) {
+  return index < program->selector_count ? program->selectors[index] : NULL;
+}
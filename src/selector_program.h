@@ -0,0 +1,92 @@
+#ifndef CSSOPTIM_SELECTOR_PROGRAM_H
+#define CSSOPTIM_SELECTOR_PROGRAM_H
+
+#include "cssoptim/symtab.h"
+#include "cssoptim/usage.h"
+#include <lexbor/css/rule.h>
+#include <lexbor/css/selectors/selector.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Style rule selectors lowered to flat (op, operand) instructions.
+ * Rules, selectors and instructions are kept in parallel arrays in document
+ * order, so evaluating a stylesheet is one sequential sweep. Names are
+ * interned into the program's own symbol table; a caller binds a usage set
+ * by giving each symbol a verdict, then runs the program to get one keep
+ * flag per selector. Binding and running can be repeated without
+ * recompiling.
+ *
+ * Selectors are also bucketed by the class (or tag) of their rightmost
+ * compound, so a run drops every selector keyed by an unused name at once
+ * and only evaluates the rest instruction by instruction.
+ */
+typedef struct selector_program selector_program_t;
+
+typedef enum {
+  SELOP_CLASS,          // operand: symbol
+  SELOP_TAG,            // operand: symbol
+  SELOP_UNIVERSAL,      // keeps the selector when the run allows it
+  SELOP_ATTR,           // operand: attribute test index
+  SELOP_PSEUDO_ELEMENT, // operand: symbol (name without "::")
+  SELOP_COUNT
+} selop_t;
+
+#define SELOP_BIT(op) ((uint8_t)(1u << (op)))
+
+// Verdict bits: the symbol makes selectors fail when used with that op
+#define SELPROG_FAIL_CLASS SELOP_BIT(SELOP_CLASS)
+#define SELPROG_FAIL_TAG SELOP_BIT(SELOP_TAG)
+#define SELPROG_FAIL_PSEUDO SELOP_BIT(SELOP_PSEUDO_ELEMENT)
+
+typedef struct {
+  symbol_id_t name; // SYMBOL_NONE for an unnamed attribute
+  css_attr_match_t op;
+  const char *value; // points into the stylesheet
+  size_t value_len;
+  bool ignore_case;
+} selprog_attr_t;
+
+// Compiles every style rule in a rule list and its nested lists (at-rule
+// blocks are not entered). The program points into the stylesheet, which
+// must outlive it.
+selector_program_t *selector_program_compile(lxb_css_rule_t *root);
+// Compiles bare selector lists, one rule each with no style rule or parent
+// behind it, for selectors parsed ahead of their rules.
+selector_program_t *
+selector_program_compile_lists(lxb_css_selector_list_t *const *lists,
+                               size_t count);
+void selector_program_destroy(selector_program_t *program);
+
+const symtab_t *selector_program_symbols(const selector_program_t *program);
+
+// SELOP_BIT mask of the ops referencing a symbol.
+uint8_t selector_program_symbol_ops(const selector_program_t *program,
+                                    symbol_id_t id);
+void selector_program_set_verdict(selector_program_t *program, symbol_id_t id,
+                                  uint8_t fail);
+
+size_t selector_program_attr_count(const selector_program_t *program);
+const selprog_attr_t *selector_program_attr(const selector_program_t *program,
+                                            size_t index);
+void selector_program_set_attr_verdict(selector_program_t *program,
+                                       size_t index, bool fail);
+
+// Evaluates every selector against the bound verdicts. A selector is kept
+// unless one of its instructions fails; SELOP_UNIVERSAL keeps it outright
+// when universal_keeps is set. Returns one flag per selector, valid until
+// the next run (NULL if the program has no selectors).
+const uint8_t *selector_program_run(selector_program_t *program,
+                                    bool universal_keeps);
+
+size_t selector_program_rule_count(const selector_program_t *program);
+// The style rule, the list holding it, and its selector index range.
+lxb_css_rule_t *selector_program_rule(const selector_program_t *program,
+                                      size_t index,
+                                      lxb_css_rule_list_t **parent,
+                                      size_t *first_selector,
+                                      size_t *selector_count);
+lxb_css_selector_list_t *
+selector_program_selector(const selector_program_t *program, size_t index);
+
+#endif // CSSOPTIM_SELECTOR_PROGRAM_H
@@ -0,0 +1,128 @@
+#include "simple_selector.h"
+#include <string.h>
+
+// Pseudo-classes lexbor parses as plain (non-functional) ones. The selector
+// program ignores them, so they never decide a verdict.
+static const char *const plain_pseudo_classes[] = {
+    "active", "checked", "default", "disabled", "empty", "enabled",
+    "first-child", "first-of-type", "focus", "focus-visible", "focus-within",
+    "hover", "indeterminate", "invalid", "last-child", "last-of-type", "link",
+    "only-child", "only-of-type", "optional", "read-only", "read-write",
+    "required", "root", "target", "valid", "visited", NULL};
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool is_name_start(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool is_name_char(char c) {
+  return is_name_start(c) || (c >= '0' && c <= '9') || c == '-';
+}
+
+static size_t skip_spaces(const char *css, size_t length, size_t i) {
+  while (i < length && is_space(css[i]))
+    i++;
+  return i;
+}
+
+// Returns the end of the ASCII identifier starting at `i`, or `i` if there is
+// none. An escape or non-ASCII byte right after it makes the caller give up,
+// since the tokenizer would continue the identifier.
+static size_t scan_ident(const char *css, size_t length, size_t i) {
+  size_t p = i;
+  if (p < length && css[p] == '-') {
+    p++;
+    if (p < length && css[p] == '-')
+      p++;
+    else if (p >= length || !is_name_start(css[p]))
+      return i;
+  } else if (p >= length || !is_name_start(css[p])) {
+    return i;
+  }
+  while (p < length && is_name_char(css[p]))
+    p++;
+  return p;
+}
+
+static bool is_lowercase(const char *name, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (name[i] >= 'A' && name[i] <= 'Z')
+      return false;
+  }
+  return true;
+}
+
+static bool is_plain_pseudo_class(const char *name, size_t len) {
+  for (size_t i = 0; plain_pseudo_classes[i]; i++) {
+    if (strlen(plain_pseudo_classes[i]) == len &&
+        memcmp(plain_pseudo_classes[i], name, len) == 0)
+      return true;
+  }
+  return false;
+}
+
+simple_selector_verdict_t simple_selector_match(const char *prelude,
+                                                size_t length,
+                                                simple_name_used_cb_t used,
+                                                void *ctx) {
+  size_t i = skip_spaces(prelude, length, 0);
+  bool any_used = false;
+
+  for (;;) {
+    // Names are looked up until the selector is known to be unused, but the
+    // rest of the list is still checked to be simple
+    bool selector_used = true;
+
+    for (;;) {
+      size_t compound = i;
+      size_t end = scan_ident(prelude, length, i);
+      if (end > i) {
+        if (!is_lowercase(prelude + i, end - i))
+          return SIMPLE_SELECTOR_UNKNOWN;
+        if (selector_used && !used(CSS_USAGE_TAG, prelude + i, end - i, ctx))
+          selector_used = false;
+        i = end;
+      }
+      while (i < length &&
+             (prelude[i] == '.' || prelude[i] == '#' || prelude[i] == ':')) {
+        char kind = prelude[i++];
+        end = scan_ident(prelude, length, i);
+        if (end == i)
+          return SIMPLE_SELECTOR_UNKNOWN;
+        if (kind == '.' && selector_used &&
+            !used(CSS_USAGE_CLASS, prelude + i, end - i, ctx))
+          selector_used = false;
+        else if (kind == ':' && !is_plain_pseudo_class(prelude + i, end - i))
+          return SIMPLE_SELECTOR_UNKNOWN;
+        i = end;
+      }
+      if (i == compound)
+        return SIMPLE_SELECTOR_UNKNOWN;
+
+      // A combinator, or the end of the selector
+      size_t next = skip_spaces(prelude, length, i);
+      if (next < length &&
+          (prelude[next] == '>' || prelude[next] == '+' ||
+           prelude[next] == '~')) {
+        i = skip_spaces(prelude, length, next + 1);
+      } else if (next == length || next == i || prelude[next] == ',') {
+        i = next;
+        break;
+      } else {
+        i = next; // descendant
+      }
+    }
+
+    any_used = any_used || selector_used;
+    if (i == length)
+      break;
+    if (prelude[i] != ',')
+      return SIMPLE_SELECTOR_UNKNOWN;
+    i = skip_spaces(prelude, length, i + 1);
+  }
+
+  return any_used ? SIMPLE_SELECTOR_USED : SIMPLE_SELECTOR_UNUSED;
+}
@@ -0,0 +1,35 @@
+#ifndef CSSOPTIM_SIMPLE_SELECTOR_H
+#define CSSOPTIM_SIMPLE_SELECTOR_H
+
+#include "cssoptim/usage.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Decides style rule preludes made only of simple compounds straight from
+ * their bytes, without the CSS parser. A simple compound is an optional
+ * lowercase type selector followed by classes, IDs and plain pseudo-classes
+ * such as :hover, with compounds joined by descendant, `>`, `+` or `~`
+ * combinators. Everything else (escapes, comments, non-ASCII, attributes,
+ * `*`, pseudo-elements, functional or unknown pseudo-classes) is left
+ * undecided for the parser, so a decided prelude is one lexbor parses
+ * without error.
+ *
+ * A selector is unused when one of its classes or tags is; IDs and
+ * pseudo-classes never remove it, as in the selector program.
+ */
+typedef enum {
+  SIMPLE_SELECTOR_UNKNOWN,
+  SIMPLE_SELECTOR_USED,  // some selector of the list is used
+  SIMPLE_SELECTOR_UNUSED // every selector is unused
+} simple_selector_verdict_t;
+
+// Returns whether a class (CSS_USAGE_CLASS) or tag (CSS_USAGE_TAG) is used
+typedef bool (*simple_name_used_cb_t)(css_usage_kind_t kind, const char *name,
+                                      size_t len, void *ctx);
+
+simple_selector_verdict_t simple_selector_match(const char *prelude,
+                                                size_t length,
+                                                simple_name_used_cb_t used,
+                                                void *ctx);
+
+#endif // CSSOPTIM_SIMPLE_SELECTOR_H
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include "splice.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Ranges gathered per writev() call, within the system's limit
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define IOV_BATCH IOV_MAX
+#else
+#define IOV_BATCH 256
+#endif
+
+static bool add_range(splice_plan_t *plan, size_t offset, size_t length,
+                      bool synthesized) {
+  if (length == 0)
+    return true;
+  if (plan->count > 0) {
+    splice_range_t *last = &plan->ranges[plan->count - 1];
+    if (last->synthesized == synthesized &&
+        last->offset + last->length == offset) {
+      last->length += length;
+      return true;
+    }
+  }
+  if (plan->count == plan->capacity) {
+    size_t capacity = plan->capacity ? plan->capacity * 2 : 64;
+    splice_range_t *ranges =
+        realloc(plan->ranges, capacity * sizeof(splice_range_t));
+    if (!ranges)
+      return false;
+    plan->ranges = ranges;
+    plan->capacity = capacity;
+  }
+  plan->ranges[plan->count++] = (splice_range_t){
+      .offset = offset, .length = length, .synthesized = synthesized};
+  return true;
+}
+
+bool splice_add_input(splice_plan_t *plan, size_t offset, size_t length) {
+  return add_range(plan, offset, length, false);
+}
+
+bool splice_add_text(splice_plan_t *plan, size_t offset, size_t length) {
+  return add_range(plan, offset, length, true);
+}
+
+void splice_plan_free(splice_plan_t *plan) {
+  free(plan->ranges);
+  *plan = (splice_plan_t){0};
+}
+
+static const char *range_data(const splice_range_t *range, const char *input,
+                              const char *text) {
+  return (range->synthesized ? text : input) + range->offset;
+}
+
+bool splice_write(const splice_plan_t *plan, const char *input,
+                  const char *text, css_write_cb_t write, void *user) {
+  for (size_t i = 0; i < plan->count; i++) {
+    const splice_range_t *range = &plan->ranges[i];
+    if (!write(range_data(range, input, text), range->length, user))
+      return false;
+  }
+  return true;
+}
+
+// Writes ranges [first, last) with as few writev() calls as it takes
+static bool write_ranges(const splice_plan_t *plan, size_t first, size_t last,
+                         const char *input, const char *text, int out_fd) {
+  struct iovec iov[IOV_BATCH];
+  size_t next = first; // first range not yet in iov
+  size_t count = 0;
+  size_t start = 0; // iov entries already written out
+
+  while (start < count || next < last) {
+    // Refill from the ranges once everything queued is out
+    if (start == count) {
+      start = count = 0;
+      for (; next < last && count < IOV_BATCH; next++, count++) {
+        const splice_range_t *range = &plan->ranges[next];
+        iov[count].iov_base = (void *)range_data(range, input, text);
+        iov[count].iov_len = range->length;
+      }
+    }
+
+    ssize_t n = writev(out_fd, iov + start, (int)(count - start));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    // Skip what was written, resuming a partly written entry
+    size_t written = (size_t)n;
+    while (start < count && written >= iov[start].iov_len)
+      written -= iov[start++].iov_len;
+    if (start < count) {
+      iov[start].iov_base = (char *)iov[start].iov_base + written;
+      iov[start].iov_len -= written;
+    }
+  }
+  return true;
+}
+
+#ifdef __linux__
+// Copies an input range to out_fd within the kernel. Returns 1 when done, 0
+// when the descriptors do not support it before anything was copied, or -1
+// on error.
+static int copy_range(int in_fd, int out_fd, size_t offset, size_t length) {
+  loff_t in_offset = (loff_t)offset;
+  bool copied = false;
+  while (length > 0) {
+    ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, NULL, length, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && !copied &&
+        (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+         errno == EBADF || errno == EOPNOTSUPP))
+      return 0;
+    if (n <= 0)
+      return -1;
+    copied = true;
+    length -= (size_t)n;
+  }
+  return 1;
+}
+#endif
+
+bool splice_write_fd(const splice_plan_t *plan, const char *input,
+                     const char *text, int in_fd, int out_fd) {
+#ifdef __linux__
+  // A file copied onto itself would come out as nothing; write from the map
+  struct stat in_st, out_st;
+  if (in_fd >= 0 && fstat(in_fd, &in_st) == 0 && fstat(out_fd, &out_st) == 0 &&
+      in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)
+    in_fd = -1;
+
+  // Synthesized text between input ranges is gathered into one writev()
+  size_t pending = 0;
+  for (size_t i = 0; in_fd >= 0 && i < plan->count; i++) {
+    const splice_range_t *range = &plan->ranges[i];
+    if (range->synthesized)
+      continue;
+    if (!write_ranges(plan, pending, i, input, text, out_fd))
+      return false;
+    int copied = copy_range(in_fd, out_fd, range->offset, range->length);
+    if (copied < 0)
+      return false;
+    if (copied == 0)
+      break; // everything from this range on goes through writev()
+    pending = i + 1;
+  }
+  return write_ranges(plan, pending, plan->count, input, text, out_fd);
+#else
+  (void)in_fd;
+  return write_ranges(plan, 0, plan->count, input, text, out_fd);
+#endif
+}
@@ -0,0 +1,42 @@
+#ifndef CSSOPTIM_SPLICE_H
+#define CSSOPTIM_SPLICE_H
+
+#include "cssoptim/optimizer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Output assembled from byte ranges of the input and of a separate buffer of
+ * synthesized text, in order. Adjacent ranges of the same source are merged
+ * as they are added, so an input kept whole is one range. The text buffer
+ * may move while the plan is built; ranges only hold offsets into it.
+ */
+typedef struct {
+  size_t offset;
+  size_t length;
+  bool synthesized; // from the text buffer rather than the input
+} splice_range_t;
+
+typedef struct {
+  splice_range_t *ranges;
+  size_t count;
+  size_t capacity;
+} splice_plan_t;
+
+// Each returns false on allocation failure
+bool splice_add_input(splice_plan_t *plan, size_t offset, size_t length);
+bool splice_add_text(splice_plan_t *plan, size_t offset, size_t length);
+
+void splice_plan_free(splice_plan_t *plan);
+
+// Writes the output through a sink, one call per range.
+bool splice_write(const splice_plan_t *plan, const char *input,
+                  const char *text, css_write_cb_t write, void *user);
+
+// Writes the output to a file descriptor with writev(). With in_fd >= 0,
+// holding the input from offset 0, input ranges are copied by the kernel with
+// copy_file_range() where it is supported for the two descriptors and they
+// are not the same file.
+bool splice_write_fd(const splice_plan_t *plan, const char *input,
+                     const char *text, int in_fd, int out_fd);
+
+#endif // CSSOPTIM_SPLICE_H
@@ -0,0 +1,382 @@
+#include "cssoptim/usage.h"
+#include "attr_index.h"
+#include "bloom.h"
+#include <ctype.h>
+#include <lexbor/core/hash.h>
+#include <lexbor/tag/tag.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Usage set shared by the scanner and the optimizer.
+ * Every collected name is interned once; each kind keeps a bitset indexed by
+ * symbol ID recording whether the name was seen as that kind.
+ *
+ * Standard HTML tags also set a bit in a fixed bitset keyed by lexbor tag ID,
+ * so tag checks skip the string table entirely; the symbol table then acts
+ * as the side table for custom elements.
+ *
+ * Attribute values live in a separate index keyed by attribute name symbol.
+ *
+ * An optional Bloom filter over (kind, name) pairs sits in front of the
+ * symbol table. It is reached through a pointer so that const lookups can
+ * still update its counters, which they do with relaxed atomic adds since
+ * threads share one usage set.
+ */
+#define TAG_ID_WORDS ((LXB_TAG__LAST_ENTRY + 63) / 64)
+
+struct css_usage {
+  symtab_t *symbols;
+  uint64_t *bits[CSS_USAGE_KIND_COUNT];
+  size_t words;
+  size_t counts[CSS_USAGE_KIND_COUNT];
+
+  uint64_t tag_ids[TAG_ID_WORDS];
+  // Always empty: lexbor's name lookup falls back to a per-document hash for
+  // names outside its static table, and ours has none.
+  lexbor_hash_t *tag_names;
+
+  attr_index_t *attr_values;
+
+  struct prefilter *prefilter;
+};
+
+#define PREFILTER_BITS_PER_KEY 16
+
+struct prefilter {
+  bloom_t *filter;
+  unsigned bits_per_key;
+  size_t keys;
+  css_usage_prefilter_stats_t stats;
+};
+
+// Longest tag or attribute name folded on the stack; longer ones are folded
+// into an allocation.
+#define MAX_TAG_NAME 128
+
+// Bumps a prefilter counter from any thread
+#define COUNT(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+static bool bit_test(const uint64_t *bits, size_t words, symbol_id_t id) {
+  size_t word = id / 64;
+  return word < words && (bits[word] >> (id % 64)) & 1;
+}
+
+static bool ensure_words(css_usage_t *usage, symbol_id_t id) {
+  size_t needed = id / 64 + 1;
+  if (needed <= usage->words)
+    return true;
+
+  size_t new_words = usage->words ? usage->words * 2 : 4;
+  while (new_words < needed)
+    new_words *= 2;
+
+  for (int k = 0; k < CSS_USAGE_KIND_COUNT; k++) {
+    uint64_t *bits = realloc(usage->bits[k], new_words * sizeof(uint64_t));
+    if (!bits)
+      return false;
+    memset(bits + usage->words, 0,
+           (new_words - usage->words) * sizeof(uint64_t));
+    usage->bits[k] = bits;
+  }
+  usage->words = new_words;
+  return true;
+}
+
+// Lower-cases a tag or attribute name into buf, or into an allocation
+// returned in *owned if it does not fit. Returns the folded name, or NULL on
+// allocation failure.
+static const char *fold_tag(const char *str, size_t len, char *buf,
+                            char **owned) {
+  *owned = NULL;
+  if (len > MAX_TAG_NAME) {
+    buf = *owned = malloc(len);
+    if (!buf)
+      return NULL;
+  }
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (char)tolower((unsigned char)str[i]);
+  return buf;
+}
+
+static bool is_static_tag(uintptr_t tag_id) {
+  return tag_id != LXB_TAG__UNDEF && tag_id < LXB_TAG__LAST_ENTRY;
+}
+
+css_usage_t *css_usage_create(void) {
+  css_usage_t *usage = calloc(1, sizeof(css_usage_t));
+  if (!usage)
+    return NULL;
+  usage->symbols = symtab_create();
+  usage->tag_names = lexbor_hash_create();
+  usage->attr_values = usage->symbols ? attr_index_create(usage->symbols) : NULL;
+  if (!usage->symbols || !usage->tag_names || !usage->attr_values ||
+      lexbor_hash_init(usage->tag_names, 16, sizeof(lxb_tag_data_t)) !=
+          LXB_STATUS_OK) {
+    css_usage_destroy(usage);
+    return NULL;
+  }
+  return usage;
+}
+
+void css_usage_destroy(css_usage_t *usage) {
+  if (!usage)
+    return;
+  for (int k = 0; k < CSS_USAGE_KIND_COUNT; k++)
+    free(usage->bits[k]);
+  if (usage->prefilter) {
+    bloom_destroy(usage->prefilter->filter);
+    free(usage->prefilter);
+  }
+  attr_index_destroy(usage->attr_values);
+  symtab_destroy(usage->symbols);
+  if (usage->tag_names)
+    lexbor_hash_destroy(usage->tag_names, true);
+  free(usage);
+}
+
+// Rebuilds the filter from every recorded (kind, name) pair, sized for
+// `keys` names.
+static bool rebuild_prefilter(css_usage_t *usage, size_t keys) {
+  struct prefilter *pf = usage->prefilter;
+  bloom_t *filter = bloom_create(keys, pf->bits_per_key);
+  if (!filter)
+    return false;
+
+  size_t count = symtab_count(usage->symbols);
+  for (symbol_id_t id = 0; id < count; id++) {
+    const char *name = symtab_name(usage->symbols, id);
+    size_t len = strlen(name);
+    for (int k = 0; k < CSS_USAGE_KIND_COUNT; k++) {
+      if (bit_test(usage->bits[k], usage->words, id))
+        bloom_add(filter, bloom_hash(name, len, (uint64_t)k));
+    }
+  }
+
+  bloom_destroy(pf->filter);
+  pf->filter = filter;
+  pf->stats.bytes = bloom_bytes(filter);
+  return true;
+}
+
+static void prefilter_add(css_usage_t *usage, css_usage_kind_t kind,
+                          const char *str, size_t len) {
+  struct prefilter *pf = usage->prefilter;
+  pf->keys++;
+  if (pf->keys > bloom_capacity(pf->filter) &&
+      rebuild_prefilter(usage, pf->keys * 2))
+    return;
+  bloom_add(pf->filter, bloom_hash(str, len, (uint64_t)kind));
+}
+
+// Interns a (folded) name and sets its bit for the kind. Returns true if the
+// bit was newly set; *out receives the symbol (SYMBOL_NONE on failure).
+static bool mark_symbol(css_usage_t *usage, css_usage_kind_t kind,
+                        const char *str, size_t len, symbol_id_t *out) {
+  char folded[MAX_TAG_NAME];
+  char *owned = NULL;
+  if (kind != CSS_USAGE_CLASS)
+    str = fold_tag(str, len, folded, &owned);
+
+  symbol_id_t id = str ? symtab_intern(usage->symbols, str, len) : SYMBOL_NONE;
+  if (id != SYMBOL_NONE && !ensure_words(usage, id))
+    id = SYMBOL_NONE;
+  if (out)
+    *out = id;
+
+  bool added = false;
+  if (id != SYMBOL_NONE) {
+    uint64_t *word = &usage->bits[kind][id / 64];
+    uint64_t mask = (uint64_t)1 << (id % 64);
+    added = !(*word & mask);
+    if (added) {
+      *word |= mask;
+      usage->counts[kind]++;
+      if (usage->prefilter)
+        prefilter_add(usage, kind, str, len);
+    }
+  }
+  free(owned);
+  return added;
+}
+
+// Looks up a (folded) name recorded for the kind.
+static symbol_id_t find_symbol(const css_usage_t *usage, css_usage_kind_t kind,
+                               const char *str, size_t len) {
+  char folded[MAX_TAG_NAME];
+  char *owned = NULL;
+  if (kind != CSS_USAGE_CLASS) {
+    str = fold_tag(str, len, folded, &owned);
+    if (!str)
+      return SYMBOL_NONE;
+  }
+
+  struct prefilter *pf = usage->prefilter;
+  if (pf) {
+    COUNT(pf->stats.lookups);
+    if (!bloom_maybe_contains(pf->filter,
+                              bloom_hash(str, len, (uint64_t)kind))) {
+      COUNT(pf->stats.rejected);
+      free(owned);
+      return SYMBOL_NONE;
+    }
+  }
+
+  symbol_id_t id = symtab_lookup(usage->symbols, str, len);
+  if (id == SYMBOL_NONE || !bit_test(usage->bits[kind], usage->words, id)) {
+    if (pf)
+      COUNT(pf->stats.false_positives);
+    id = SYMBOL_NONE;
+  }
+  free(owned);
+  return id;
+}
+
+bool css_usage_add(css_usage_t *usage, css_usage_kind_t kind, const char *str,
+                   size_t len) {
+  if (!usage || !str || len == 0)
+    return false;
+
+  if (kind == CSS_USAGE_ATTR) {
+    const char *eq = memchr(str, '=', len);
+    if (eq)
+      return css_usage_add_attr(usage, str, (size_t)(eq - str), eq + 1,
+                                len - (size_t)(eq - str) - 1);
+  }
+
+  if (kind == CSS_USAGE_TAG) {
+    uintptr_t tag_id = css_usage_tag_id(usage, str, len);
+    if (is_static_tag(tag_id))
+      usage->tag_ids[tag_id / 64] |= (uint64_t)1 << (tag_id % 64);
+  }
+
+  return mark_symbol(usage, kind, str, len, NULL);
+}
+
+bool css_usage_has(const css_usage_t *usage, css_usage_kind_t kind,
+                   const char *str, size_t len) {
+  if (!usage || !str || usage->counts[kind] == 0)
+    return false;
+
+  if (kind == CSS_USAGE_TAG) {
+    uintptr_t tag_id = css_usage_tag_id(usage, str, len);
+    if (is_static_tag(tag_id))
+      return css_usage_has_tag_id(usage, tag_id);
+  } else if (kind == CSS_USAGE_ATTR) {
+    const char *eq = memchr(str, '=', len);
+    if (eq)
+      return css_usage_match_attr(usage, str, (size_t)(eq - str),
+                                  CSS_ATTR_EQUAL, eq + 1,
+                                  len - (size_t)(eq - str) - 1, false);
+  }
+
+  return find_symbol(usage, kind, str, len) != SYMBOL_NONE;
+}
+
+bool css_usage_add_attr(css_usage_t *usage, const char *name, size_t name_len,
+                        const char *value, size_t value_len) {
+  if (!usage || !name || name_len == 0)
+    return false;
+
+  symbol_id_t id;
+  bool added = mark_symbol(usage, CSS_USAGE_ATTR, name, name_len, &id);
+  if (id == SYMBOL_NONE)
+    return false;
+  if (!value)
+    return added;
+  return attr_index_add(usage->attr_values, id, value, value_len);
+}
+
+bool css_usage_match_attr(const css_usage_t *usage, const char *name,
+                          size_t name_len, css_attr_match_t op,
+                          const char *value, size_t value_len,
+                          bool ignore_case) {
+  if (!usage || !name || usage->counts[CSS_USAGE_ATTR] == 0)
+    return false;
+
+  symbol_id_t id = find_symbol(usage, CSS_USAGE_ATTR, name, name_len);
+  if (id == SYMBOL_NONE)
+    return false;
+  if (op == CSS_ATTR_EXISTS || !value)
+    return true;
+  return attr_index_match(usage->attr_values, id, op, value, value_len,
+                          ignore_case);
+}
+
+bool css_usage_add_tag_id(css_usage_t *usage, uintptr_t tag_id,
+                          const char *name, size_t len) {
+  if (!usage || !name || len == 0)
+    return false;
+  if (is_static_tag(tag_id)) {
+    uint64_t mask = (uint64_t)1 << (tag_id % 64);
+    if (usage->tag_ids[tag_id / 64] & mask)
+      return false;
+  }
+  // Registers the ID bit and the name (for listing and custom elements)
+  return css_usage_add(usage, CSS_USAGE_TAG, name, len);
+}
+
+uintptr_t css_usage_tag_id(const css_usage_t *usage, const char *name,
+                           size_t len) {
+  if (!usage || !name || len == 0)
+    return LXB_TAG__UNDEF;
+  lxb_tag_id_t tag_id =
+      lxb_tag_id_by_name(usage->tag_names, (const lxb_char_t *)name, len);
+  return is_static_tag(tag_id) ? tag_id : LXB_TAG__UNDEF;
+}
+
+bool css_usage_has_tag_id(const css_usage_t *usage, uintptr_t tag_id) {
+  if (!usage || !is_static_tag(tag_id))
+    return false;
+  return (usage->tag_ids[tag_id / 64] >> (tag_id % 64)) & 1;
+}
+
+size_t css_usage_count(const css_usage_t *usage, css_usage_kind_t kind) {
+  return usage ? usage->counts[kind] : 0;
+}
+
+const symtab_t *css_usage_symbols(const css_usage_t *usage) {
+  return usage->symbols;
+}
+
+bool css_usage_symbol_has(const css_usage_t *usage, css_usage_kind_t kind,
+                          symbol_id_t id) {
+  return bit_test(usage->bits[kind], usage->words, id);
+}
+
+bool css_usage_enable_prefilter(css_usage_t *usage, unsigned bits_per_key) {
+  if (!usage)
+    return false;
+  if (usage->prefilter)
+    return true;
+
+  struct prefilter *pf = calloc(1, sizeof(struct prefilter));
+  if (!pf)
+    return false;
+  pf->bits_per_key = bits_per_key ? bits_per_key : PREFILTER_BITS_PER_KEY;
+  for (int k = 0; k < CSS_USAGE_KIND_COUNT; k++)
+    pf->keys += usage->counts[k];
+
+  usage->prefilter = pf;
+  if (!rebuild_prefilter(usage, pf->keys * 2)) {
+    usage->prefilter = NULL;
+    free(pf);
+    return false;
+  }
+  return true;
+}
+
+bool css_usage_prefilter_stats(const css_usage_t *usage,
+                               css_usage_prefilter_stats_t *stats) {
+  if (!usage || !usage->prefilter)
+    return false;
+  if (stats) {
+    const css_usage_prefilter_stats_t *pf = &usage->prefilter->stats;
+    stats->lookups = __atomic_load_n(&pf->lookups, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&pf->rejected, __ATOMIC_RELAXED);
+    stats->false_positives =
+        __atomic_load_n(&pf->false_positives, __ATOMIC_RELAXED);
+    stats->bytes = pf->bytes;
+  }
+  return true;
+}
@@ -30,7 +30,21 @@ void test_args_verbose(void) {
   TEST_ASSERT_EQUAL(1, args.css_file_count);
 }
 
+void test_args_stdin(void) {
+  const char *argv[] = {"prog", "--css", "a.css", "-", "-v"};
+  int argc = 5;
+  css_args_t args = {0};
+
+  int result = parse_args(argc, argv, &args);
+
+  TEST_ASSERT_EQUAL(0, result);
+  TEST_ASSERT_EQUAL(2, args.css_file_count);
+  TEST_ASSERT_EQUAL_STRING("-", args.css_files[1]);
+  TEST_ASSERT_TRUE(args.verbose);
+}
+
 void run_arg_tests(void) {
   RUN_TEST(test_args_explicit);
   RUN_TEST(test_args_verbose);
+  RUN_TEST(test_args_stdin);
 }
@@ -39,8 +39,101 @@ void test_css_optimize_no_filter(void) {
   free(result);
 }
 
+void test_css_optimize_with_usage(void) {
+  const char *css = ".foo { color: red; } .bar { color: blue; } "
+                    "P.baz { margin: 0; } h1.baz { margin: 1px; }";
+  css_usage_t *usage = css_usage_create();
+  TEST_ASSERT_NOT_NULL(usage);
+  css_usage_add(usage, CSS_USAGE_CLASS, "foo", 3);
+  css_usage_add(usage, CSS_USAGE_CLASS, "baz", 3);
+  css_usage_add(usage, CSS_USAGE_TAG, "p", 1);
+
+  OptimizerConfig config = {.usage = usage,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_NOT_NULL(strstr(result, ".foo"));
+  TEST_ASSERT_NULL(strstr(result, ".bar"));
+  TEST_ASSERT_NOT_NULL(strstr(result, ".baz"));
+  TEST_ASSERT_NULL(strstr(result, "h1"));
+
+  free(result);
+  css_usage_destroy(usage);
+}
+
+void test_css_optimize_stats(void) {
+  const char *css = ".a { --gap: 4px; margin: var(--gap); animation: spin 1s; }"
+                    "@keyframes spin { to { opacity: 0; } }"
+                    "@keyframes fade { to { opacity: 1; } }";
+  const char *used_classes[] = {"a"};
+  css_optimize_stats_t stats = {0};
+
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true,
+                            .stats = &stats};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_NOT_NULL(strstr(result, "--gap"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "spin"));
+  TEST_ASSERT_NULL(strstr(result, "fade"));
+  // Declaration names and values were serialized into the scratch arena
+  TEST_ASSERT_TRUE(stats.scratch_peak > 0);
+
+  free(result);
+}
+
+void test_css_optimize_ctx_reuse(void) {
+  const char *css = ".a { --gap: 4px; margin: var(--gap); }"
+                    ".b { color: red; }"
+                    "@media (min-width: 10px) { .a { color: blue; } }";
+  const char *used_a[] = {"a"};
+  const char *used_b[] = {"b"};
+  OptimizerConfig config_a = {.used_classes = used_a,
+                              .class_count = 1,
+                              .mode = LXB_CSS_OPTIM_MODE_SAFE};
+  OptimizerConfig config_b = {.used_classes = used_b,
+                              .class_count = 1,
+                              .mode = LXB_CSS_OPTIM_MODE_SAFE};
+
+  char *expected_a = css_optimize(css, strlen(css), &config_a);
+  char *expected_b = css_optimize(css, strlen(css), &config_b);
+  TEST_ASSERT_NOT_NULL(expected_a);
+  TEST_ASSERT_NOT_NULL(expected_b);
+
+  // Two contexts used in turn, each for several runs
+  css_optimizer_ctx_t *ctx1 = css_optimizer_ctx_create();
+  css_optimizer_ctx_t *ctx2 = css_optimizer_ctx_create();
+  TEST_ASSERT_NOT_NULL(ctx1);
+  TEST_ASSERT_NOT_NULL(ctx2);
+  for (int i = 0; i < 3; i++) {
+    char *a = css_optimize_ctx(ctx1, css, strlen(css), &config_a);
+    char *b = css_optimize_ctx(ctx2, css, strlen(css), &config_b);
+    TEST_ASSERT_TRUE(css_validate_ctx(ctx1, css, strlen(css)));
+    char *c = css_optimize_ctx(ctx1, css, strlen(css), &config_b);
+    TEST_ASSERT_EQUAL_STRING(expected_a, a);
+    TEST_ASSERT_EQUAL_STRING(expected_b, b);
+    TEST_ASSERT_EQUAL_STRING(expected_b, c);
+    free(a);
+    free(b);
+    free(c);
+  }
+  css_optimizer_ctx_destroy(ctx1);
+  css_optimizer_ctx_destroy(ctx2);
+
+  free(expected_a);
+  free(expected_b);
+}
+
 void run_css_tests(void) {
   RUN_TEST(test_css_validation_basic);
   RUN_TEST(test_css_validate_invalid);
   RUN_TEST(test_css_optimize_no_filter);
+  RUN_TEST(test_css_optimize_with_usage);
+  RUN_TEST(test_css_optimize_stats);
+  RUN_TEST(test_css_optimize_ctx_reuse);
 }
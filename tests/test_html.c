@@ -1,5 +1,6 @@
 #include "cssoptim/scanner.h"
 #include "unity.h"
+#include <stdio.h>
 #include <string.h>
 
 void test_class_list_basic(void) {
@@ -17,6 +18,31 @@ void test_class_list_basic(void) {
   string_list_destroy(list);
 }
 
+void test_class_list_add_n(void) {
+  string_list_t *list = string_list_create();
+  TEST_ASSERT_NOT_NULL(list);
+
+  const char *text = "btn btn-primary";
+  TEST_ASSERT_TRUE(string_list_add_n(list, text, 3));
+  TEST_ASSERT_TRUE(string_list_add_n(list, text + 4, 11));
+  TEST_ASSERT_FALSE(string_list_add(list, "btn"));
+
+  // Grow well past the initial table size
+  char name[32];
+  for (int i = 0; i < 5000; i++) {
+    snprintf(name, sizeof(name), "c%d", i);
+    string_list_add(list, name);
+  }
+
+  TEST_ASSERT_EQUAL(5002, string_list_count(list));
+  TEST_ASSERT_EQUAL_STRING("btn", string_list_get(list, 0));
+  TEST_ASSERT_EQUAL_STRING("btn-primary", string_list_get(list, 1));
+  TEST_ASSERT_TRUE(string_list_contains(list, "c4999"));
+  TEST_ASSERT_FALSE(string_list_contains(list, "btn-"));
+
+  string_list_destroy(list);
+}
+
 void test_scan_html_basic(void) {
   const char *html =
       "<html><body><div class=\"foo bar\">Hello</div></body></html>";
@@ -31,6 +57,123 @@ void test_scan_html_basic(void) {
   string_list_destroy(list);
 }
 
+void test_scan_html_usage(void) {
+  const char *html = "<html><body><div class=\"foo bar\" role=\"button\">"
+                     "<span>Hi</span><my-widget></my-widget></div></body></html>";
+  css_usage_t *usage = css_usage_create();
+  TEST_ASSERT_NOT_NULL(usage);
+
+  scan_html_usage(html, strlen(html), usage);
+  scan_js_usage("'baz'", 5, usage);
+
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_CLASS, "foo", 3));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_CLASS, "baz", 3));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_TAG, "SPAN", 4));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_TAG, "my-widget", 9));
+  TEST_ASSERT_FALSE(css_usage_has(usage, CSS_USAGE_TAG, "p", 1));
+  TEST_ASSERT_TRUE(css_usage_has_tag_id(
+      usage, css_usage_tag_id(usage, "Span", 4)));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_ATTR, "role=button", 11));
+  // Kinds share symbols but not usage bits
+  TEST_ASSERT_FALSE(css_usage_has(usage, CSS_USAGE_TAG, "foo", 3));
+  TEST_ASSERT_FALSE(css_usage_has(usage, CSS_USAGE_CLASS, "span", 4));
+  TEST_ASSERT_EQUAL(3, css_usage_count(usage, CSS_USAGE_CLASS));
+
+  css_usage_destroy(usage);
+}
+
+void test_scanner_reuse(void) {
+  css_scanner_t *scanner = css_scanner_create();
+  css_usage_t *usage = css_usage_create();
+  TEST_ASSERT_NOT_NULL(scanner);
+  TEST_ASSERT_NOT_NULL(usage);
+
+  // Pages of different shapes through one document, custom elements included
+  char html[128];
+  for (int i = 0; i < 50; i++) {
+    int len = snprintf(html, sizeof(html),
+                       "<div class=\"page-%d\"><x-item-%d></x-item-%d>%s",
+                       i, i % 3, i % 3, i % 2 ? "</div>" : "<p>unclosed");
+    scan_html_usage_ctx(scanner, html, (size_t)len, usage);
+  }
+
+  TEST_ASSERT_EQUAL(50, css_usage_count(usage, CSS_USAGE_CLASS));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_CLASS, "page-0", 6));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_CLASS, "page-49", 7));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_TAG, "x-item-2", 8));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_TAG, "p", 1));
+
+  css_usage_destroy(usage);
+  css_scanner_destroy(scanner);
+}
+
+void test_usage_prefilter(void) {
+  css_usage_t *usage = css_usage_create();
+  TEST_ASSERT_NOT_NULL(usage);
+  css_usage_add(usage, CSS_USAGE_CLASS, "early", 5);
+
+  css_usage_prefilter_stats_t stats;
+  TEST_ASSERT_FALSE(css_usage_prefilter_stats(usage, &stats));
+  TEST_ASSERT_TRUE(css_usage_enable_prefilter(usage, 0));
+
+  // Names added after enabling grow the filter
+  char name[32];
+  for (int i = 0; i < 5000; i++) {
+    int len = snprintf(name, sizeof(name), "used-%d", i);
+    css_usage_add(usage, CSS_USAGE_CLASS, name, (size_t)len);
+  }
+  css_usage_add(usage, CSS_USAGE_TAG, "my-widget", 9);
+
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_CLASS, "early", 5));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_TAG, "MY-WIDGET", 9));
+  TEST_ASSERT_FALSE(css_usage_has(usage, CSS_USAGE_CLASS, "my-widget", 9));
+  for (int i = 0; i < 5000; i++) {
+    int len = snprintf(name, sizeof(name), "used-%d", i);
+    TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_CLASS, name, (size_t)len));
+  }
+  for (int i = 0; i < 5000; i++) {
+    int len = snprintf(name, sizeof(name), "unused-%d", i);
+    TEST_ASSERT_FALSE(
+        css_usage_has(usage, CSS_USAGE_CLASS, name, (size_t)len));
+  }
+
+  TEST_ASSERT_TRUE(css_usage_prefilter_stats(usage, &stats));
+  TEST_ASSERT_EQUAL_UINT64(10003, stats.lookups);
+  TEST_ASSERT_EQUAL_UINT64(5001, stats.rejected + stats.false_positives);
+  // Well under 1% false positives at the default density
+  TEST_ASSERT_TRUE(stats.false_positives < 50);
+  TEST_ASSERT_TRUE(stats.bytes > 0);
+
+  css_usage_destroy(usage);
+}
+
+void test_usage_long_names(void) {
+  css_usage_t *usage = css_usage_create();
+  TEST_ASSERT_NOT_NULL(usage);
+
+  // Names past the stack buffer fold the same when marked and looked up
+  char tag[201], upper[201];
+  memset(tag, 'x', 200);
+  memcpy(tag, "my-", 3);
+  tag[200] = '\0';
+  for (int i = 0; i < 200; i++)
+    upper[i] = (char)(tag[i] == '-' ? '-' : tag[i] - 'a' + 'A');
+  upper[200] = '\0';
+
+  TEST_ASSERT_TRUE(css_usage_add(usage, CSS_USAGE_TAG, upper, 200));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_TAG, tag, 200));
+  TEST_ASSERT_TRUE(css_usage_has(usage, CSS_USAGE_TAG, upper, 200));
+  TEST_ASSERT_FALSE(css_usage_has(usage, CSS_USAGE_TAG, tag, 199));
+
+  TEST_ASSERT_TRUE(css_usage_add_attr(usage, upper, 200, "on", 2));
+  TEST_ASSERT_TRUE(
+      css_usage_match_attr(usage, tag, 200, CSS_ATTR_EQUAL, "on", 2, false));
+  TEST_ASSERT_TRUE(
+      css_usage_match_attr(usage, tag, 200, CSS_ATTR_PREFIX, "o", 1, false));
+
+  css_usage_destroy(usage);
+}
+
 void test_scan_js_basic(void) {
   const char *js = "var x = 'foo'; let y = \"bar\"; const z = `baz`;";
   string_list_t *list = string_list_create();
@@ -47,6 +190,11 @@ void test_scan_js_basic(void) {
 
 void run_html_tests(void) {
   RUN_TEST(test_class_list_basic);
+  RUN_TEST(test_class_list_add_n);
   RUN_TEST(test_scan_html_basic);
+  RUN_TEST(test_scan_html_usage);
+  RUN_TEST(test_scanner_reuse);
+  RUN_TEST(test_usage_prefilter);
+  RUN_TEST(test_usage_long_names);
   RUN_TEST(test_scan_js_basic);
 }
@@ -177,6 +177,134 @@ void test_bootstrap_reduction(void) {
   free(css);
 }
 
+void test_parallel_matches_serial(void) {
+  long len;
+  char *css = read_fixture_file("tests/fixtures/bootstrap.css", &len);
+  TEST_ASSERT_NOT_NULL_MESSAGE(css, "Could not read bootstrap.css");
+
+  // Custom properties and keyframes are defined and used in different chunks
+  const char *used[] = {"d-flex", "btn", "spinner-border", "progress-bar"};
+  OptimizerConfig config = {.used_classes = used,
+                            .class_count = 4,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+  char *serial = css_optimize(css, (size_t)len, &config);
+  TEST_ASSERT_NOT_NULL(serial);
+
+  const unsigned threads[] = {1, 2, 4, 64};
+  for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+    char *parallel =
+        css_optimize_parallel(css, (size_t)len, &config, threads[i]);
+    TEST_ASSERT_NOT_NULL(parallel);
+    TEST_ASSERT_EQUAL_STRING(serial, parallel);
+    free(parallel);
+  }
+
+  free(serial);
+  free(css);
+}
+
+void test_parallel_prefilter(void) {
+  long len;
+  char *css = read_fixture_file("tests/fixtures/bootstrap.css", &len);
+  TEST_ASSERT_NOT_NULL_MESSAGE(css, "Could not read bootstrap.css");
+
+  // Chunk threads share one usage set and its prefilter counters
+  css_usage_t *usage = css_usage_create();
+  TEST_ASSERT_NOT_NULL(usage);
+  const char *used[] = {"d-flex", "btn", "spinner-border", "progress-bar"};
+  for (size_t i = 0; i < sizeof(used) / sizeof(used[0]); i++)
+    css_usage_add(usage, CSS_USAGE_CLASS, used[i], strlen(used[i]));
+  TEST_ASSERT_TRUE(css_usage_enable_prefilter(usage, 0));
+  OptimizerConfig config = {.usage = usage,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+  char *serial = css_optimize(css, (size_t)len, &config);
+  TEST_ASSERT_NOT_NULL(serial);
+
+  // The same chunks make the same lookups, so no count is lost
+  css_usage_prefilter_stats_t before, after;
+  uint64_t lookups[2], misses[2];
+  for (int run = 0; run < 2; run++) {
+    TEST_ASSERT_TRUE(css_usage_prefilter_stats(usage, &before));
+    char *parallel = css_optimize_parallel(css, (size_t)len, &config, 8);
+    TEST_ASSERT_NOT_NULL(parallel);
+    TEST_ASSERT_EQUAL_STRING(serial, parallel);
+    free(parallel);
+    TEST_ASSERT_TRUE(css_usage_prefilter_stats(usage, &after));
+    lookups[run] = after.lookups - before.lookups;
+    misses[run] = after.rejected + after.false_positives - before.rejected -
+                  before.false_positives;
+  }
+  TEST_ASSERT_TRUE(lookups[0] > 0);
+  TEST_ASSERT_EQUAL_UINT64(lookups[0], lookups[1]);
+  TEST_ASSERT_EQUAL_UINT64(misses[0], misses[1]);
+
+  css_usage_destroy(usage);
+  free(serial);
+  free(css);
+}
+
+struct piecewise {
+  const char *data;
+  size_t length;
+  size_t offset;
+};
+
+// Hands out the input in small uneven pieces, like a pipe
+static bool read_piecewise(char *data, size_t size, size_t *len, void *user) {
+  struct piecewise *in = user;
+  size_t n = in->length - in->offset;
+  if (n > 4093)
+    n = 4093;
+  if (n > size)
+    n = size;
+  memcpy(data, in->data + in->offset, n);
+  in->offset += n;
+  *len = n;
+  return true;
+}
+
+void test_stream_matches_serial(void) {
+  long len;
+  char *css = read_fixture_file("tests/fixtures/bootstrap.css", &len);
+  TEST_ASSERT_NOT_NULL_MESSAGE(css, "Could not read bootstrap.css");
+
+  // Twice over, so it is parsed in several batches
+  char *twice = malloc(2 * (size_t)len);
+  TEST_ASSERT_NOT_NULL(twice);
+  memcpy(twice, css, (size_t)len);
+  memcpy(twice + len, css, (size_t)len);
+
+  const char *used[] = {"d-flex", "btn", "spinner-border", "progress-bar"};
+  OptimizerConfig config = {.used_classes = used,
+                            .class_count = 4,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+  char *serial = css_optimize(twice, 2 * (size_t)len, &config);
+  TEST_ASSERT_NOT_NULL(serial);
+
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  TEST_ASSERT_NOT_NULL(ctx);
+  struct piecewise in = {twice, 2 * (size_t)len, 0};
+  char *streamed = css_optimize_stream(ctx, read_piecewise, &in, &config);
+  TEST_ASSERT_NOT_NULL(streamed);
+  TEST_ASSERT_EQUAL_STRING(serial, streamed);
+  free(streamed);
+
+  // Empty input gives empty output
+  struct piecewise empty = {"", 0, 0};
+  streamed = css_optimize_stream(ctx, read_piecewise, &empty, &config);
+  TEST_ASSERT_NOT_NULL(streamed);
+  TEST_ASSERT_EQUAL_STRING("", streamed);
+  free(streamed);
+
+  css_optimizer_ctx_destroy(ctx);
+  free(serial);
+  free(twice);
+  free(css);
+}
+
 void test_html_tag_removal(void) {
   // 1. Read htmlrmtest.html content to scan it
   long h_len;
@@ -305,6 +433,9 @@ void run_integration_tests(void) {
   RUN_TEST(test_manual_minified_media_queries);
   RUN_TEST(test_complex_filtering);
   RUN_TEST(test_bootstrap_reduction);
+  RUN_TEST(test_parallel_matches_serial);
+  RUN_TEST(test_parallel_prefilter);
+  RUN_TEST(test_stream_matches_serial);
   RUN_TEST(test_html_tag_removal);
   RUN_TEST(test_attr_and_pseudo);
 }
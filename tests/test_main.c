@@ -1,3 +1,4 @@
+#include "cssoptim/memory.h"
 #include "unity.h"
 #include <stdio.h>
 
@@ -8,6 +9,7 @@ void run_arg_tests(void);
 void run_integration_tests(void);
 void run_mode_tests(void);
 void run_optimization_tests(void);
+void run_memory_tests(void);
 
 void setUp(void) {
   // Standard setup
@@ -18,6 +20,9 @@ void tearDown(void) {
 }
 
 int main(void) {
+  // Before any lexbor object exists
+  css_memory_install();
+
   UNITY_BEGIN();
 
   // RUN_TEST(test_function_name);
@@ -27,6 +32,7 @@ int main(void) {
   run_integration_tests();
   run_mode_tests();
   run_optimization_tests();
+  run_memory_tests();
 
   return UNITY_END();
 }
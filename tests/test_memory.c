@@ -0,0 +1,129 @@
+#include "cssoptim/memory.h"
+#include "cssoptim/optimizer.h"
+#include "unity.h"
+#include <lexbor/core/lexbor.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *css = ".a { color: red } @media print { .a { color: blue } "
+                         ".b { color: green } }";
+
+void test_memory_phases(void) {
+  css_mem_job_t *job = css_mem_job_create(false, 0);
+  TEST_ASSERT_NOT_NULL(job);
+  css_mem_job_t *previous = css_mem_job_enter(job);
+
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+  free(result);
+
+  css_mem_job_enter(previous);
+
+  css_mem_stats_t stats;
+  css_mem_job_stats(job, &stats);
+  TEST_ASSERT_TRUE(stats.total[CSS_MEM_PHASE_CSS_PARSE] > 0);
+  TEST_ASSERT_EQUAL_size_t(0, stats.total[CSS_MEM_PHASE_HTML_PARSE]);
+  // Everything was handed back
+  TEST_ASSERT_EQUAL_size_t(0, stats.live[CSS_MEM_PHASE_CSS_PARSE]);
+  TEST_ASSERT_EQUAL_size_t(0, stats.live[CSS_MEM_PHASE_NESTED]);
+  TEST_ASSERT_TRUE(stats.peak_live >= stats.peak[CSS_MEM_PHASE_CSS_PARSE]);
+  TEST_ASSERT_EQUAL_size_t(0, stats.region_reserved);
+
+  css_mem_job_destroy(job);
+}
+
+void test_memory_region(void) {
+  css_mem_job_t *job = css_mem_job_create(true, 0);
+  TEST_ASSERT_NOT_NULL(job);
+  css_mem_job_t *previous = css_mem_job_enter(job);
+
+  const char *used_classes[] = {"b"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_NOT_NULL(strstr(result, "green"));
+  free(result);
+
+  css_mem_job_enter(previous);
+
+  css_mem_stats_t stats;
+  css_mem_job_stats(job, &stats);
+  TEST_ASSERT_TRUE(stats.region_reserved >= stats.peak_live);
+  css_mem_job_destroy(job);
+}
+
+void test_memory_limit(void) {
+  css_mem_job_t *job = css_mem_job_create(false, 4096);
+  TEST_ASSERT_NOT_NULL(job);
+  css_mem_job_t *previous = css_mem_job_enter(job);
+
+  void *small = lexbor_malloc(1024);
+  TEST_ASSERT_NOT_NULL(small);
+  TEST_ASSERT_NULL(lexbor_malloc(8192));
+  // A failed realloc leaves the block alone
+  TEST_ASSERT_NULL(lexbor_realloc(small, 8192));
+  small = lexbor_realloc(small, 2048);
+  TEST_ASSERT_NOT_NULL(small);
+
+  // Frees count against the job the block was allocated in
+  css_mem_job_enter(previous);
+  lexbor_free(small);
+
+  css_mem_stats_t stats;
+  css_mem_job_stats(job, &stats);
+  TEST_ASSERT_EQUAL_size_t(0, stats.live[CSS_MEM_PHASE_OTHER]);
+  TEST_ASSERT_EQUAL_size_t(2048, stats.peak[CSS_MEM_PHASE_OTHER]);
+  // Failed allocations are not counted
+  TEST_ASSERT_EQUAL_size_t(1024 + 2048, stats.total[CSS_MEM_PHASE_OTHER]);
+  css_mem_job_destroy(job);
+}
+
+void test_memory_parallel(void) {
+  // Enough rules for every thread to get a chunk
+  size_t css_len = strlen(css);
+  size_t length = css_len * 64;
+  char *sheet = malloc(length + 1);
+  TEST_ASSERT_NOT_NULL(sheet);
+  for (size_t i = 0; i < 64; i++)
+    memcpy(sheet + i * css_len, css, css_len);
+  sheet[length] = '\0';
+
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+  char *expected = css_optimize(sheet, length, &config);
+  TEST_ASSERT_NOT_NULL(expected);
+
+  // Worker threads allocate in the caller's job and region
+  css_mem_job_t *job = css_mem_job_create(true, 0);
+  TEST_ASSERT_NOT_NULL(job);
+  css_mem_job_t *previous = css_mem_job_enter(job);
+  char *result = css_optimize_parallel(sheet, length, &config, 4);
+  css_mem_job_enter(previous);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_EQUAL_STRING(expected, result);
+
+  css_mem_stats_t stats;
+  css_mem_job_stats(job, &stats);
+  TEST_ASSERT_TRUE(stats.total[CSS_MEM_PHASE_CSS_PARSE] > 0);
+  TEST_ASSERT_TRUE(stats.region_reserved >= stats.peak_live);
+  css_mem_job_destroy(job);
+
+  free(expected);
+  free(result);
+  free(sheet);
+}
+
+void run_memory_tests(void) {
+  RUN_TEST(test_memory_phases);
+  RUN_TEST(test_memory_region);
+  RUN_TEST(test_memory_limit);
+  RUN_TEST(test_memory_parallel);
+}
@@ -1,7 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../src/rule_split.h"
+#include "../src/simple_selector.h"
+#include "cssoptim/io.h"
 #include "cssoptim/optimizer.h"
 #include "unity.h"
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 void test_remove_unused_keyframes(void) {
   const char *css =
@@ -111,9 +118,645 @@ void test_refinements_vendor_prefixes_and_pseudos(void) {
   free(result);
 }
 
+void test_attribute_operators(void) {
+  const char *css = "[class^=col-] { float: left }"
+                    "[class^=row-] { display: flex }"
+                    "[href$=\".pdf\"] { color: red }"
+                    "[data-x*=foo] { color: blue }"
+                    "[lang|=en] { quotes: none }"
+                    "[lang|=fr] { quotes: auto }";
+  css_usage_t *usage = css_usage_create();
+  TEST_ASSERT_NOT_NULL(usage);
+  css_usage_add_attr(usage, "class", 5, "col-md-6 card", 13);
+  css_usage_add_attr(usage, "href", 4, "/files/report.pdf", 17);
+  css_usage_add_attr(usage, "data-x", 6, "xfoox", 5);
+  css_usage_add_attr(usage, "lang", 4, "en-GB", 5);
+
+  OptimizerConfig config = {.usage = usage,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+
+  TEST_ASSERT_NOT_NULL(strstr(result, "col-"));
+  TEST_ASSERT_NULL(strstr(result, "row-"));
+  TEST_ASSERT_NOT_NULL(strstr(result, ".pdf"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "data-x"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "en"));
+  TEST_ASSERT_NULL(strstr(result, "fr"));
+
+  free(result);
+  css_usage_destroy(usage);
+}
+
+void test_selector_groups(void) {
+  const char *css = ".a, .unused { color: red }"
+                    ".unused > .a { color: blue }"
+                    "div.b, span.b { margin: 0 }"
+                    "*.unused { padding: 0 }";
+  const char *used_classes[] = {"a", "b"};
+  const char *used_tags[] = {"div"};
+
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 2,
+                            .used_tags = used_tags,
+                            .tag_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_STRICT};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+
+  // Unused selectors leave their group; rules with none left are removed
+  TEST_ASSERT_NOT_NULL(strstr(result, "red"));
+  TEST_ASSERT_NULL(strstr(result, "unused"));
+  TEST_ASSERT_NULL(strstr(result, "blue"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "div"));
+  TEST_ASSERT_NULL(strstr(result, "span"));
+  TEST_ASSERT_NULL(strstr(result, "padding"));
+
+  free(result);
+}
+
+void test_rightmost_key_buckets(void) {
+  const char *css = ".nav .item { color: red }"
+                    ".gone .item { color: blue }"
+                    ".item .gone { color: green }"
+                    "* .gone { color: gray }"
+                    "ul > li { margin: 0 }";
+  const char *used_classes[] = {"nav", "item"};
+  const char *used_tags[] = {"ul"};
+
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 2,
+                            .used_tags = used_tags,
+                            .tag_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+
+  // Used rightmost key, but an unused ancestor
+  TEST_ASSERT_NOT_NULL(strstr(result, "red"));
+  TEST_ASSERT_NULL(strstr(result, "blue"));
+  // Unused rightmost key drops the rule
+  TEST_ASSERT_NULL(strstr(result, "green"));
+  // A universal selector before the key still keeps it in safe mode
+  TEST_ASSERT_NOT_NULL(strstr(result, "gray"));
+  // Tag keys: li is not used
+  TEST_ASSERT_NULL(strstr(result, "margin"));
+
+  free(result);
+}
+
+void test_many_custom_properties(void) {
+  // Well past the old fixed limit of 1024 tracked dependencies
+  enum { DEFINED = 3000, USED = 2500 };
+  size_t cap = (size_t)DEFINED * 64;
+  char *css = malloc(cap);
+  TEST_ASSERT_NOT_NULL(css);
+
+  size_t len = (size_t)snprintf(css, cap, ":root {");
+  for (int i = 0; i < DEFINED; i++)
+    len += (size_t)snprintf(css + len, cap - len, " --v%d: %d;", i, i);
+  len += (size_t)snprintf(css + len, cap - len, " } .a {");
+  for (int i = 0; i < USED; i++)
+    len += (size_t)snprintf(css + len, cap - len, " margin: var(--v%d);", i);
+  len += (size_t)snprintf(css + len, cap - len, " }");
+
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+
+  char *result = css_optimize(css, len, &config);
+  TEST_ASSERT_NOT_NULL(result);
+
+  // Every referenced variable keeps its definition
+  TEST_ASSERT_NOT_NULL(strstr(result, "--v0:"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "--v2499:"));
+  TEST_ASSERT_NULL(strstr(result, "--v2500"));
+  TEST_ASSERT_NULL(strstr(result, "--v2999"));
+
+  free(result);
+  free(css);
+}
+
+void test_rule_split_boundaries(void) {
+  const char *css = "@import url(a.css);"
+                    ".a { content: \"}\"; }"
+                    "/* } */ .b { background: url(x}y.png); }"
+                    "@media print { .c { color: red; } }";
+  size_t len = strlen(css);
+  size_t first = strlen("@import url(a.css);");
+  size_t second = first + strlen(".a { content: \"}\"; }");
+  size_t third = second + strlen("/* } */ .b { background: url(x}y.png); }");
+
+  // A one-byte window still yields whole rules
+  TEST_ASSERT_EQUAL_size_t(first, rule_split_next(css, len, 0, 1));
+  TEST_ASSERT_EQUAL_size_t(second, rule_split_next(css, len, first, 1));
+  TEST_ASSERT_EQUAL_size_t(third, rule_split_next(css, len, second, 1));
+  TEST_ASSERT_EQUAL_size_t(len, rule_split_next(css, len, third, 1));
+
+  // Larger windows take as many rules as fit
+  TEST_ASSERT_EQUAL_size_t(second, rule_split_next(css, len, 0, third - 1));
+  TEST_ASSERT_EQUAL_size_t(len, rule_split_next(css, len, 0, len));
+
+  // Input arriving a byte at a time gives the same rules, and the scan only
+  // moves forward, across strings, comments and url() bodies cut anywhere
+  const size_t ends[] = {first, second, third, len};
+  rule_scan_t scan;
+  rule_scan_init(&scan, 0);
+  rule_span_t span;
+  size_t found = 0;
+  size_t pos = 0;
+  for (size_t have = 0; have <= len; have++) {
+    while (rule_scan_next(&scan, css, have, have == len, &span)) {
+      TEST_ASSERT_TRUE(found < 4);
+      TEST_ASSERT_EQUAL_size_t(ends[found++], span.end);
+    }
+    TEST_ASSERT_TRUE(scan.pos >= pos);
+    pos = scan.pos;
+  }
+  TEST_ASSERT_EQUAL_size_t(4, found);
+}
+
+struct collected {
+  char *data;
+  size_t len;
+};
+
+static bool collect_output(const char *data, size_t len, void *user) {
+  struct collected *out = user;
+  char *grown = realloc(out->data, out->len + len + 1);
+  if (!grown)
+    return false;
+  memcpy(grown + out->len, data, len);
+  out->len += len;
+  grown[out->len] = '\0';
+  out->data = grown;
+  return true;
+}
+
+static void strip_newlines(char *str) {
+  char *dst = str;
+  for (; *str; str++) {
+    if (*str != '\n')
+      *dst++ = *str;
+  }
+  *dst = '\0';
+}
+
+void test_optimize_windowed(void) {
+  // Definitions, uses and keyframes spread over windows of a rule or two
+  const char *css = ":root { --used: 1px; --unused: 2px; }"
+                    "@keyframes spin { to { opacity: 0; } }"
+                    ".gone { margin: var(--unused); animation: fade 1s; }"
+                    "@keyframes fade { to { opacity: 1; } }"
+                    ".a { margin: var(--used); }"
+                    "@media print { .a { animation: spin 1s; } }";
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+
+  char *expected = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(expected);
+  strip_newlines(expected);
+
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  TEST_ASSERT_NOT_NULL(ctx);
+  struct collected out = {0};
+  TEST_ASSERT_TRUE(css_optimize_windowed(ctx, css, strlen(css), 64, &config,
+                                         collect_output, &out));
+  TEST_ASSERT_NOT_NULL(out.data);
+  strip_newlines(out.data);
+  TEST_ASSERT_EQUAL_STRING(expected, out.data);
+  TEST_ASSERT_NOT_NULL(strstr(out.data, "--used"));
+  TEST_ASSERT_NOT_NULL(strstr(out.data, "spin"));
+  TEST_ASSERT_NULL(strstr(out.data, "--unused"));
+  TEST_ASSERT_NULL(strstr(out.data, "fade"));
+
+  css_optimizer_ctx_destroy(ctx);
+  free(out.data);
+  free(expected);
+}
+
+void test_nested_blocks(void) {
+  // Nested blocks are parsed once and edited by the walk in place
+  const char *css = "@media print {"
+                    "  @supports (display: grid) { .b { color: red; } }"
+                    "  @supports (display: flex) { .a { margin: var(--m); } }"
+                    "  .a { animation: spin 1s; }"
+                    "}"
+                    "@media screen { .b { color: blue; } }"
+                    ":root { --m: 1px; --n: 2px; }"
+                    "@keyframes spin { to { opacity: 0; } }";
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_NOT_NULL(strstr(result, "@media print"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "flex"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "--m"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "spin"));
+  // Emptied blocks take their at-rules with them
+  TEST_ASSERT_NULL(strstr(result, "grid"));
+  TEST_ASSERT_NULL(strstr(result, "screen"));
+  TEST_ASSERT_NULL(strstr(result, ".b"));
+  TEST_ASSERT_NULL(strstr(result, "--n"));
+
+  free(result);
+}
+
+void test_lazy_parse(void) {
+  // Every kind of top-level item, including selectors lexbor cannot parse
+  const char *css = "@charset \"utf-8\";"
+                    ".a, .gone { color: red; }"
+                    ".gone { margin: var(--x); }"
+                    "[data-x=\"{\"] { color: blue; }"
+                    "* { box-sizing: border-box; }"
+                    "div.b > .gone { color: green; }"
+                    ".a:not-a-pseudo { color: pink; }"
+                    "@media print { .gone { color: red; } .a { top: 0; } }"
+                    "/* .gone { } */ .a::after { content: \"}\"; }";
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+
+  char *expected = css_optimize(css, strlen(css), &config);
+  config.lazy_parse = true;
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(expected);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_EQUAL_STRING(expected, result);
+  TEST_ASSERT_NULL(strstr(result, "var(--x)"));
+  TEST_ASSERT_NULL(strstr(result, "green"));
+
+  free(expected);
+  free(result);
+}
+
+void test_references_in_raw_values(void) {
+  // Fallbacks, nesting and spacing inside var(), and animation name lists
+  const char *css =
+      ":root { --a: 1px; --b: 2px; --c: 3px; --d: 4px; }"
+      ".x { margin: var( --a , 0) var(--b,var(--c));"
+      "     animation-name: spin,\tfade; }"
+      "@keyframes spin { to { opacity: 0; } }"
+      "@keyframes fade { to { opacity: 1; } }"
+      "@keyframes gone { to { opacity: 1; } }";
+  const char *used_classes[] = {"x"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_NOT_NULL(strstr(result, "--a:"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "--b:"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "--c:"));
+  TEST_ASSERT_NULL(strstr(result, "--d:"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "keyframes spin"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "keyframes fade"));
+  TEST_ASSERT_NULL(strstr(result, "gone"));
+
+  free(result);
+}
+
+void test_dependency_fixpoint(void) {
+  // Definitions only reached from unused definitions go with them, and
+  // blocks left empty take their at-rules along
+  const char *css = ":root { --a: var(--b); --b: 1px; --c: var(--d); --d: 2px;"
+                    "        --e: 3px; --f: 4px; }"
+                    ".x { margin: var(--a); animation: spin 1s; }"
+                    "@keyframes spin { to { padding: var(--e); } }"
+                    "@keyframes gone { to { margin: var(--f); } }"
+                    "@media print { .x { --lone: var(--a); } }";
+  const char *used_classes[] = {"x"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+
+  char *result = css_optimize(css, strlen(css), &config);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_NOT_NULL(strstr(result, "--a:"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "--b:"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "--e:"));
+  TEST_ASSERT_NOT_NULL(strstr(result, "keyframes spin"));
+  TEST_ASSERT_NULL(strstr(result, "--c:"));
+  TEST_ASSERT_NULL(strstr(result, "--d:"));
+  TEST_ASSERT_NULL(strstr(result, "--f:"));
+  TEST_ASSERT_NULL(strstr(result, "gone"));
+  TEST_ASSERT_NULL(strstr(result, "--lone"));
+  TEST_ASSERT_NULL(strstr(result, "print"));
+
+  // Windows resolve the same graph before pruning
+  strip_newlines(result);
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  TEST_ASSERT_NOT_NULL(ctx);
+  struct collected out = {0};
+  TEST_ASSERT_TRUE(css_optimize_windowed(ctx, css, strlen(css), 64, &config,
+                                         collect_output, &out));
+  TEST_ASSERT_NOT_NULL(out.data);
+  strip_newlines(out.data);
+  TEST_ASSERT_EQUAL_STRING(result, out.data);
+
+  css_optimizer_ctx_destroy(ctx);
+  free(out.data);
+  free(result);
+}
+
+struct counted {
+  struct collected out;
+  size_t writes;
+};
+
+static bool collect_counted(const char *data, size_t len, void *user) {
+  struct counted *counted = user;
+  counted->writes++;
+  return collect_output(data, len, &counted->out);
+}
+
+static bool refuse_output(const char *data, size_t len, void *user) {
+  (void)data;
+  (void)len;
+  (void)user;
+  return false;
+}
+
+void test_large_output(void) {
+  // Output built from thousands of kept rules, with the @charset semicolon
+  // inserted while the first rule is written
+  enum { RULES = 5000 };
+  size_t cap = (size_t)RULES * 32 + 32;
+  char *css = malloc(cap);
+  TEST_ASSERT_NOT_NULL(css);
+  size_t len = (size_t)snprintf(css, cap, "@charset \"utf-8\";");
+  for (int i = 0; i < RULES; i++)
+    len += (size_t)snprintf(css + len, cap - len, ".a { z-index: %d; }", i);
+
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+
+  char *result = css_optimize(css, len, &config);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_EQUAL_INT(0, strncmp(result, "@charset \"utf-8\";", 17));
+  TEST_ASSERT_NULL(strstr(result, "\";;"));
+  size_t rules = 0;
+  for (const char *p = result; (p = strstr(p, "z-index")); p++)
+    rules++;
+  TEST_ASSERT_EQUAL_size_t(RULES, rules);
+
+  // A sink gets the same text in several writes
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  TEST_ASSERT_NOT_NULL(ctx);
+  struct counted sunk = {0};
+  TEST_ASSERT_TRUE(css_optimize_to_sink(ctx, css, len, &config,
+                                        collect_counted, &sunk));
+  TEST_ASSERT_NOT_NULL(sunk.out.data);
+  TEST_ASSERT_EQUAL_STRING(result, sunk.out.data);
+  TEST_ASSERT_TRUE(sunk.writes > 1);
+
+  // A failing sink stops the run
+  TEST_ASSERT_FALSE(
+      css_optimize_to_sink(ctx, css, len, &config, refuse_output, NULL));
+
+  // Runs of rules serialized on several threads join into the same text
+  config.serialize_threads = 4;
+  char *threaded = css_optimize_ctx(ctx, css, len, &config);
+  TEST_ASSERT_NOT_NULL(threaded);
+  TEST_ASSERT_EQUAL_STRING(result, threaded);
+  struct collected threaded_sunk = {0};
+  TEST_ASSERT_TRUE(css_optimize_to_sink(ctx, css, len, &config,
+                                        collect_output, &threaded_sunk));
+  TEST_ASSERT_NOT_NULL(threaded_sunk.data);
+  TEST_ASSERT_EQUAL_STRING(result, threaded_sunk.data);
+
+  css_optimizer_ctx_destroy(ctx);
+  free(threaded_sunk.data);
+  free(threaded);
+  free(sunk.out.data);
+  free(result);
+  free(css);
+}
+
+void test_threaded_separators(void) {
+  // Rules that may be written as nothing sit between kept ones, so for some
+  // thread count a run starts or consists of them
+  static const char *const quiet[] = {"@x;", "@namespace svg url(a);",
+                                      "@charset \"utf-8\";"};
+  enum { RULES = 30000 };
+  size_t cap = (size_t)RULES * 40 + 64;
+  char *css = malloc(cap);
+  TEST_ASSERT_NOT_NULL(css);
+  size_t len = 0;
+  for (int i = 0; i < RULES; i++) {
+    if (i % 7 < 3)
+      len += (size_t)snprintf(css + len, cap - len, "%s", quiet[i % 7]);
+    else
+      len += (size_t)snprintf(css + len, cap - len, ".a { z-index: %d; }", i);
+  }
+
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+  char *serial = css_optimize(css, len, &config);
+  TEST_ASSERT_NOT_NULL(serial);
+  for (unsigned threads = 2; threads <= 9; threads++) {
+    config.serialize_threads = threads;
+    char *threaded = css_optimize(css, len, &config);
+    TEST_ASSERT_NOT_NULL(threaded);
+    TEST_ASSERT_EQUAL_STRING(serial, threaded);
+    free(threaded);
+  }
+
+  free(serial);
+  free(css);
+}
+
+void test_splice_output(void) {
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE,
+                            .remove_unused_keyframes = true};
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  TEST_ASSERT_NOT_NULL(ctx);
+
+  // Nothing removed: the input comes out byte for byte
+  const char *kept = "/* header */\n.a{color:RED}\n\n"
+                     "@media print {\n  .a { top: 0 }\n}\n";
+  struct collected out = {0};
+  TEST_ASSERT_TRUE(css_optimize_splice(ctx, kept, strlen(kept), &config,
+                                       collect_output, &out));
+  TEST_ASSERT_NOT_NULL(out.data);
+  TEST_ASSERT_EQUAL_STRING(kept, out.data);
+  free(out.data);
+
+  // Kept rules keep their formatting, a rule that lost selectors its block,
+  // and the rest is what css_optimize() keeps
+  const char *css = "/* a */ .a  >  p {\n  color: red\n}\n"
+                    ".gone { color: blue }\n"
+                    ".a, .gone {\n  top: 0 }\n"
+                    "@media print { .gone { x: 1 } .a { y: 2 } }\n"
+                    ":root { --gone: 1px; }\n"
+                    "@keyframes unused { to { top: 0 } }\n";
+  out = (struct collected){0};
+  TEST_ASSERT_TRUE(css_optimize_splice(ctx, css, strlen(css), &config,
+                                       collect_output, &out));
+  TEST_ASSERT_NOT_NULL(out.data);
+  TEST_ASSERT_NOT_NULL(
+      strstr(out.data, "/* a */ .a  >  p {\n  color: red\n}"));
+  TEST_ASSERT_NOT_NULL(strstr(out.data, ".a {\n  top: 0 }"));
+  TEST_ASSERT_NULL(strstr(out.data, "gone"));
+  TEST_ASSERT_NULL(strstr(out.data, "unused"));
+
+  char *expected = css_optimize(css, strlen(css), &config);
+  char *result = css_optimize(out.data, out.len, &config);
+  TEST_ASSERT_NOT_NULL(expected);
+  TEST_ASSERT_NOT_NULL(result);
+  strip_newlines(expected);
+  strip_newlines(result);
+  TEST_ASSERT_EQUAL_STRING(expected, result);
+
+  css_optimizer_ctx_destroy(ctx);
+  free(expected);
+  free(result);
+  free(out.data);
+}
+
+void test_splice_output_over_input(void) {
+  // As -o naming the input: the input stays mapped and open while its
+  // replacement is written
+  const char *css = "/* a */ .a  >  p {\n  color: red\n}\n"
+                    ".gone { color: blue }\n"
+                    ".a, .gone {\n  top: 0 }\n";
+  const char *used_classes[] = {"a"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+  css_optimizer_ctx_t *ctx = css_optimizer_ctx_create();
+  TEST_ASSERT_NOT_NULL(ctx);
+
+  char path[] = "/tmp/cssoptim-splice-XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  close(fd);
+  TEST_ASSERT_TRUE(write_file(path, css));
+
+  struct collected expected = {0};
+  TEST_ASSERT_TRUE(css_optimize_splice(ctx, css, strlen(css), &config,
+                                       collect_output, &expected));
+
+  size_t len = 0;
+  const char *content = map_file(path, &len);
+  TEST_ASSERT_NOT_NULL(content);
+  int in_fd = open(path, O_RDONLY);
+  TEST_ASSERT_TRUE(in_fd >= 0);
+  char *temp_path;
+  int out_fd = open_output(path, &temp_path);
+  TEST_ASSERT_TRUE(out_fd >= 0);
+  bool ok =
+      css_optimize_splice_fd(ctx, content, len, &config, in_fd, out_fd);
+  TEST_ASSERT_TRUE(finish_output(out_fd, temp_path, path, ok));
+  close(in_fd);
+  unmap_file(content, len);
+
+  char *result = read_file(path, &len);
+  TEST_ASSERT_NOT_NULL(result);
+  TEST_ASSERT_EQUAL_STRING(expected.data, result);
+
+  unlink(path);
+  css_optimizer_ctx_destroy(ctx);
+  free(expected.data);
+  free(result);
+}
+
+static bool only_a_used(css_usage_kind_t kind, const char *name, size_t len,
+                        void *ctx) {
+  (void)ctx;
+  return kind == CSS_USAGE_TAG || (len == 1 && name[0] == 'a');
+}
+
+void test_prefilter_rules(void) {
+  // Simple selector lists are decided from their bytes, the rest are not
+  const char *used[] = {".a", ".gone, div.a:hover", "#x > .a ~ p"};
+  const char *unused[] = {".gone", "div.gone:focus, .a .gone", ".gone+.a"};
+  const char *unknown[] = {".a::after", "*",   ".a[x]",  ".gone:not(.a)",
+                           "DIV.a",     ".a,", ".a\\b", ".a:unknown"};
+  for (size_t i = 0; i < sizeof(used) / sizeof(used[0]); i++)
+    TEST_ASSERT_EQUAL(SIMPLE_SELECTOR_USED,
+                      simple_selector_match(used[i], strlen(used[i]),
+                                            only_a_used, NULL));
+  for (size_t i = 0; i < sizeof(unused) / sizeof(unused[0]); i++)
+    TEST_ASSERT_EQUAL(SIMPLE_SELECTOR_UNUSED,
+                      simple_selector_match(unused[i], strlen(unused[i]),
+                                            only_a_used, NULL));
+  for (size_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++)
+    TEST_ASSERT_EQUAL(SIMPLE_SELECTOR_UNKNOWN,
+                      simple_selector_match(unknown[i], strlen(unknown[i]),
+                                            only_a_used, NULL));
+
+  const char *css = ".a, .gone { color: red; }"
+                    ".gone:hover { margin: var(--x); }"
+                    "nav.a { color: blue; }"
+                    ".gone::after { content: \"}\"; }"
+                    "@media print { .gone { color: red; } .a { top: 0; } }"
+                    ":root { --x: 1px; }";
+  const char *used_classes[] = {"a"};
+  const char *used_tags[] = {"div"};
+  OptimizerConfig config = {.used_classes = used_classes,
+                            .class_count = 1,
+                            .used_tags = used_tags,
+                            .tag_count = 1,
+                            .mode = LXB_CSS_OPTIM_MODE_SAFE};
+
+  for (int lazy = 0; lazy <= 1; lazy++) {
+    config.lazy_parse = lazy;
+    config.prefilter_rules = false;
+    char *expected = css_optimize(css, strlen(css), &config);
+    config.prefilter_rules = true;
+    char *result = css_optimize(css, strlen(css), &config);
+    TEST_ASSERT_NOT_NULL(expected);
+    TEST_ASSERT_NOT_NULL(result);
+    TEST_ASSERT_EQUAL_STRING(expected, result);
+    TEST_ASSERT_NULL(strstr(result, "nav"));
+    TEST_ASSERT_NULL(strstr(result, "--x"));
+    free(expected);
+    free(result);
+  }
+}
+
 void run_optimization_tests(void) {
   RUN_TEST(test_remove_unused_keyframes);
   RUN_TEST(test_remove_form_pseudoelements_without_forms);
   RUN_TEST(test_keep_form_pseudoelements_with_forms);
   RUN_TEST(test_refinements_vendor_prefixes_and_pseudos);
+  RUN_TEST(test_attribute_operators);
+  RUN_TEST(test_selector_groups);
+  RUN_TEST(test_rightmost_key_buckets);
+  RUN_TEST(test_many_custom_properties);
+  RUN_TEST(test_rule_split_boundaries);
+  RUN_TEST(test_optimize_windowed);
+  RUN_TEST(test_nested_blocks);
+  RUN_TEST(test_lazy_parse);
+  RUN_TEST(test_prefilter_rules);
+  RUN_TEST(test_references_in_raw_values);
+  RUN_TEST(test_dependency_fixpoint);
+  RUN_TEST(test_large_output);
+  RUN_TEST(test_threaded_separators);
+  RUN_TEST(test_splice_output);
+  RUN_TEST(test_splice_output_over_input);
 }
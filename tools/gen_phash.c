@@ -0,0 +1,289 @@
+/* Build-time generator for collision-free (perfect) hash lookup tables.
+ *
+ * Reads src/pseudo_table.def and writes a header with a static open table
+ * of every name, a seed for which no two names share a slot, and the
+ * requirement lists of the form pseudo-elements. A lookup is then one hash,
+ * one slot and one comparison, however many entries the table grows to.
+ *
+ * Usage: gen_phash <table.def> <output.h>
+ */
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_ENTRIES 256
+#define MAX_REQS 8
+#define MAX_NAME 64
+
+typedef struct {
+  char name[MAX_NAME];
+  size_t len;
+  const char *kind;
+  int rule; // index into rules, -1 for none
+} entry_t;
+
+typedef struct {
+  char attrs[MAX_REQS][MAX_NAME];
+  size_t attr_count;
+  char tags[MAX_REQS][MAX_NAME];
+  size_t tag_count;
+} rule_t;
+
+static entry_t entries[MAX_ENTRIES];
+static size_t entry_count;
+static rule_t rules[MAX_ENTRIES];
+static size_t rule_count;
+
+/* Must match pseudo_phash() in the generated header. */
+static uint32_t phash(const char *s, size_t len, uint32_t seed) {
+  uint32_t h = seed;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint32_t)tolower((unsigned char)s[i]);
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+static int die(const char *path, int line, const char *msg) {
+  fprintf(stderr, "%s:%d: %s\n", path, line, msg);
+  return 1;
+}
+
+// Reuses an identical requirement set, so rules stay deduplicated.
+static int intern_rule(const rule_t *rule) {
+  for (size_t i = 0; i < rule_count; i++) {
+    if (memcmp(&rules[i], rule, sizeof(rule_t)) == 0)
+      return (int)i;
+  }
+  rules[rule_count] = *rule;
+  return (int)rule_count++;
+}
+
+static int parse_table(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+
+  char line[1024];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+
+    char *kind = strtok(line, " \t\r\n");
+    if (!kind)
+      continue;
+    char *name = strtok(NULL, " \t\r\n");
+    if (!name || strlen(name) >= MAX_NAME)
+      return die(path, lineno, "missing or over-long name");
+    if (entry_count == MAX_ENTRIES)
+      return die(path, lineno, "too many entries");
+
+    entry_t *e = &entries[entry_count++];
+    memset(e, 0, sizeof(entry_t));
+    for (size_t i = 0; name[i]; i++)
+      e->name[i] = (char)tolower((unsigned char)name[i]);
+    e->len = strlen(e->name);
+    e->rule = -1;
+
+    if (strcmp(kind, "vendor") == 0) {
+      e->kind = "PSEUDO_KIND_VENDOR";
+    } else if (strcmp(kind, "form") == 0) {
+      e->kind = "PSEUDO_KIND_FORM";
+      rule_t rule;
+      memset(&rule, 0, sizeof(rule));
+      char *key;
+      while ((key = strtok(NULL, " \t\r\n"))) {
+        char *value = strtok(NULL, " \t\r\n");
+        if (!value || strlen(value) >= MAX_NAME)
+          return die(path, lineno, "requirement without value");
+        if (strcmp(key, "attr") == 0 && rule.attr_count < MAX_REQS) {
+          strcpy(rule.attrs[rule.attr_count++], value);
+        } else if (strcmp(key, "tag") == 0 && rule.tag_count < MAX_REQS) {
+          strcpy(rule.tags[rule.tag_count++], value);
+        } else {
+          return die(path, lineno, "unknown or too many requirements");
+        }
+      }
+      e->rule = intern_rule(&rule);
+    } else {
+      return die(path, lineno, "unknown entry kind");
+    }
+
+    for (size_t i = 0; i + 1 < entry_count; i++) {
+      if (strcmp(entries[i].name, e->name) == 0)
+        return die(path, lineno, "duplicate name");
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <table.def> <output.h>\n", argv[0]);
+    return 1;
+  }
+  if (parse_table(argv[1]) != 0)
+    return 1;
+
+  // Table at most half full, then search for a seed without collisions
+  size_t size = 16;
+  while (size < entry_count * 2)
+    size *= 2;
+
+  int slots[MAX_ENTRIES * 4];
+  uint32_t seed = 2166136261u;
+  for (;;) {
+    for (size_t i = 0; i < size; i++)
+      slots[i] = -1;
+    size_t placed = 0;
+    for (; placed < entry_count; placed++) {
+      size_t slot = phash(entries[placed].name, entries[placed].len, seed) &
+                    (size - 1);
+      if (slots[slot] >= 0)
+        break;
+      slots[slot] = (int)placed;
+    }
+    if (placed == entry_count)
+      break;
+    seed++;
+    if (seed == 2166136261u + 1000000u) {
+      // Practically unreachable at half load; widen the table instead
+      seed = 2166136261u;
+      size *= 2;
+      if (size > MAX_ENTRIES * 4) {
+        fprintf(stderr, "no perfect hash found\n");
+        return 1;
+      }
+    }
+  }
+
+  FILE *out = fopen(argv[2], "w");
+  if (!out) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  size_t max_len = 0, max_attrs = 1, max_tags = 1;
+  for (size_t i = 0; i < entry_count; i++)
+    max_len = entries[i].len > max_len ? entries[i].len : max_len;
+  for (size_t r = 0; r < rule_count; r++) {
+    max_attrs = rules[r].attr_count + 1 > max_attrs ? rules[r].attr_count + 1
+                                                    : max_attrs;
+    max_tags =
+        rules[r].tag_count + 1 > max_tags ? rules[r].tag_count + 1 : max_tags;
+  }
+
+  fprintf(out,
+          "/* Generated by tools/gen_phash.c from %s. Do not edit. */\n"
+          "#ifndef CSSOPTIM_PSEUDO_PHASH_H\n"
+          "#define CSSOPTIM_PSEUDO_PHASH_H\n\n"
+          "#include <ctype.h>\n"
+          "#include <stddef.h>\n"
+          "#include <stdint.h>\n"
+          "#include <string.h>\n\n"
+          "/* Requires lxb_tag_id_t and the LXB_TAG_* constants in scope. */\n\n"
+          "#define PSEUDO_PHASH_SEED %uu\n"
+          "#define PSEUDO_PHASH_MASK %zuu\n"
+          "#define PSEUDO_PHASH_MAX_LEN %zu\n\n"
+          "enum { PSEUDO_KIND_NONE, PSEUDO_KIND_FORM, PSEUDO_KIND_VENDOR };\n\n"
+          "typedef struct {\n"
+          "  const char *name;\n"
+          "  unsigned char len;\n"
+          "  unsigned char kind;\n"
+          "  unsigned char rule;\n"
+          "} pseudo_phash_entry_t;\n\n",
+          argv[1], seed, size - 1, max_len);
+
+  fprintf(out, "static const pseudo_phash_entry_t pseudo_phash_table[%zu] = {\n",
+          size);
+  for (size_t i = 0; i < size; i++) {
+    if (slots[i] < 0)
+      continue;
+    const entry_t *e = &entries[slots[i]];
+    fprintf(out, "    [%zu] = {\"%s\", %zu, %s, %d},\n", i, e->name, e->len,
+            e->kind, e->rule < 0 ? 0 : e->rule);
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static const char *const pseudo_rule_attrs[%zu][%zu] = {\n",
+          rule_count ? rule_count : 1, max_attrs);
+  for (size_t r = 0; r < rule_count; r++) {
+    fprintf(out, "    {");
+    for (size_t a = 0; a < rules[r].attr_count; a++)
+      fprintf(out, "\"%s\", ", rules[r].attrs[a]);
+    fprintf(out, "NULL},\n");
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static const lxb_tag_id_t pseudo_rule_tags[%zu][%zu] = {\n",
+          rule_count ? rule_count : 1, max_tags);
+  for (size_t r = 0; r < rule_count; r++) {
+    fprintf(out, "    {");
+    for (size_t t = 0; t < rules[r].tag_count; t++) {
+      fprintf(out, "LXB_TAG_");
+      for (const char *c = rules[r].tags[t]; *c; c++)
+        fputc(*c == '-' ? '_' : toupper((unsigned char)*c), out);
+      fprintf(out, ", ");
+    }
+    fprintf(out, "LXB_TAG__UNDEF},\n");
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out,
+          "static inline uint32_t pseudo_phash(const char *s, size_t len) {\n"
+          "  uint32_t h = PSEUDO_PHASH_SEED;\n"
+          "  for (size_t i = 0; i < len; i++) {\n"
+          "    h ^= (uint32_t)tolower((unsigned char)s[i]);\n"
+          "    h *= 16777619u;\n"
+          "  }\n"
+          "  h ^= h >> 16;\n"
+          "  h *= 0x85ebca6bu;\n"
+          "  h ^= h >> 13;\n"
+          "  return h;\n"
+          "}\n\n"
+          "/* Case-insensitive lookup; returns NULL if the name is unknown. */\n"
+          "static inline const pseudo_phash_entry_t *\n"
+          "pseudo_phash_lookup(const char *name, size_t len) {\n"
+          "  if (len == 0 || len > PSEUDO_PHASH_MAX_LEN)\n"
+          "    return NULL;\n"
+          "  const pseudo_phash_entry_t *e =\n"
+          "      &pseudo_phash_table[pseudo_phash(name, len) & "
+          "PSEUDO_PHASH_MASK];\n"
+          "  if (e->len != len)\n"
+          "    return NULL;\n"
+          "  for (size_t i = 0; i < len; i++) {\n"
+          "    if (tolower((unsigned char)name[i]) != e->name[i])\n"
+          "      return NULL;\n"
+          "  }\n"
+          "  return e;\n"
+          "}\n\n"
+          "/* Length of the vendor prefix (e.g. \"-webkit-\") that starts name,\n"
+          " * or 0 if it has none. */\n"
+          "static inline size_t pseudo_phash_vendor_prefix(const char *name,\n"
+          "                                                size_t len) {\n"
+          "  if (len < 3 || name[0] != '-')\n"
+          "    return 0;\n"
+          "  const char *dash = memchr(name + 1, '-', len - 1);\n"
+          "  if (!dash)\n"
+          "    return 0;\n"
+          "  size_t prefix_len = (size_t)(dash - name) + 1;\n"
+          "  const pseudo_phash_entry_t *e = pseudo_phash_lookup(name, "
+          "prefix_len);\n"
+          "  return e && e->kind == PSEUDO_KIND_VENDOR ? prefix_len : 0;\n"
+          "}\n\n"
+          "#endif // CSSOPTIM_PSEUDO_PHASH_H\n");
+
+  fclose(out);
+  return 0;
+}